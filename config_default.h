@@ -13,6 +13,9 @@
 /* Define to 1 if you want 'sqlite3' platform support. */
 #define ENABLE_DATABASE_SQLITE3 1
 
+/* Define to 1 if you want 'io_uring' streaming support. */
+/* #undef ENABLE_IO_URING */
+
 /* Define to 1 if you want 'mediaserver' support. */
 #define ENABLE_MEDIASERVER 1
 
@@ -73,6 +73,11 @@ typedef struct thread_cond_s thread_cond_t;
  */
 typedef struct thread_mutex_s thread_mutex_t;
 
+/**
+ * @brief exported thread read/write lock structure
+ */
+typedef struct thread_rwlock_s thread_rwlock_t;
+
 /**
  * @brief creates a new thread of control that executes concurrently
  *        with the calling thread. the new thread applies the function
@@ -104,6 +109,16 @@ unsigned int upnpd_thread_self (void);
  */
 int upnpd_thread_join (thread_t *thread);
 
+/**
+ * @brief binds the thread to one of the online processors
+ *
+ * @param *thread - the thread
+ * @param cpu     - processor index, wraps around number of online processors
+ *
+ * @returns 0 on success, -1 on error or if not supported on the platform
+ */
+int upnpd_thread_affinity (thread_t *thread, unsigned int cpu);
+
 /**
  * @brief initialize the mutex object
  *
@@ -141,6 +156,51 @@ int upnpd_thread_mutex_unlock (thread_mutex_t *mutex);
  */
 int upnpd_thread_mutex_destroy (thread_mutex_t *mutex);
 
+/**
+ * @brief initialize the read/write lock object
+ *
+ * @param *name - name of the lock
+ *
+ * @returns NULL on error, otherwise the lock object
+ */
+thread_rwlock_t * upnpd_thread_rwlock_init (const char *name);
+
+/**
+ * @brief locks the given lock shared, readers run concurrently
+ *
+ * @param *rwlock - the lock
+ *
+ * @returns 0 on success, 1 on error.
+ */
+int upnpd_thread_rwlock_rdlock (thread_rwlock_t *rwlock);
+
+/**
+ * @brief locks the given lock exclusive
+ *
+ * @param *rwlock - the lock
+ *
+ * @returns 0 on success, 1 on error.
+ */
+int upnpd_thread_rwlock_wrlock (thread_rwlock_t *rwlock);
+
+/**
+ * @brief unlocks the given lock, held either shared or exclusive
+ *
+ * @param *rwlock - the lock
+ *
+ * @returns 0 on success, 1 on error.
+ */
+int upnpd_thread_rwlock_unlock (thread_rwlock_t *rwlock);
+
+/**
+ * @brief destroys the given lock
+ *
+ * @param *rwlock - the lock
+ *
+ * @returns 0 on success, 1 on error.
+ */
+int upnpd_thread_rwlock_destroy (thread_rwlock_t *rwlock);
+
 /**
  * @brief initialize condition variable object
  *
@@ -199,6 +259,25 @@ int upnpd_thread_cond_broadcast (thread_cond_t *cond);
  */
 int upnpd_thread_cond_destroy (thread_cond_t *cond);
 
+/**
+ * @brief atomically adds to a counter shared between threads
+ *
+ * @param *counter - the counter
+ * @param value    - value to add, wraps around for subtraction
+ *
+ * @returns the new value of the counter
+ */
+unsigned long long upnpd_atomic_add (volatile unsigned long long *counter, unsigned long long value);
+
+/**
+ * @brief atomically reads a counter shared between threads
+ *
+ * @param *counter - the counter
+ *
+ * @returns the value of the counter
+ */
+unsigned long long upnpd_atomic_get (volatile unsigned long long *counter);
+
 /*@}*/
 
 /**
@@ -217,6 +296,12 @@ int upnpd_thread_cond_destroy (thread_cond_t *cond);
 #define SOCKET_IP_LENGTH 20
 #endif
 
+/**
+ * @brief returned by recv/send calls on non-blocking sockets, when the
+ *        operation would block
+ */
+#define SOCKET_AGAIN -2
+
 /**
  * @brief socket communication types
  */
@@ -249,11 +334,50 @@ typedef struct poll_item_s {
 	poll_event_t revents;
 } poll_item_t;
 
+/**
+ * @brief exported socket event set structure
+ */
+typedef struct socket_event_s socket_event_t;
+
+/**
+ * @brief socket event set result type
+ */
+typedef struct socket_event_item_s {
+	void *data;
+	poll_event_t revents;
+} socket_event_item_t;
+
 /**
  * @brief exported socket structure
  */
 typedef struct socket_s socket_t;
 
+/**
+ * @brief exported socket completion ring structure
+ */
+typedef struct socket_ring_s socket_ring_t;
+
+/**
+ * @brief socket completion ring operations
+ */
+typedef enum {
+	/** file read into slot buffer */
+	SOCKET_RING_READ   = 0x00,
+	/** send from slot buffer */
+	SOCKET_RING_SEND   = 0x01,
+	/** cancellation of slot operations */
+	SOCKET_RING_CANCEL = 0x02,
+} socket_ring_op_t;
+
+/**
+ * @brief socket completion ring result type
+ */
+typedef struct socket_ring_item_s {
+	unsigned int slot;
+	socket_ring_op_t op;
+	int result;
+} socket_ring_item_t;
+
 /**
  * @brief create a socket object with given socket type
  *
@@ -293,6 +417,15 @@ int upnpd_socket_listen (socket_t *socket, int backlog);
  */
 socket_t * upnpd_socket_accept (socket_t *socket);
 
+/**
+ * @brief accepts a connection on a socket, accepted socket is non-blocking
+ *
+ * @param *socket - socket object
+ *
+ * @returns accepted socket object on success, NULL on error
+ */
+socket_t * upnpd_socket_accept_nonblock (socket_t *socket);
+
 /**
  * @brief connects to given address and port with given timeout value
  *
@@ -312,7 +445,7 @@ int upnpd_socket_connect (socket_t *socket, const char *address, int port, int t
  * @param *buffer - recv buffer
  * @param length  - maximum data length to read
  *
- * @returns received buffer size on success, -1 on error
+ * @returns received buffer size on success, SOCKET_AGAIN if would block, -1 on error
  */
 int upnpd_socket_recv (socket_t *socket, void *buffer, int length);
 
@@ -323,10 +456,48 @@ int upnpd_socket_recv (socket_t *socket, void *buffer, int length);
  * @param *buffer - send buffer
  * @param length  - length of buffer
  *
- * @returns sent buffer size on success, -1 on error
+ * @returns sent buffer size on success, SOCKET_AGAIN if would block, -1 on error
  */
 int upnpd_socket_send (socket_t *socket, const void *buffer, int length);
 
+/**
+ * @brief send data from stream socket, telling the stack that more data
+ *        follows so that it goes out in the same segments with next send
+ *        or sendfile call
+ *
+ * @param *socket - socket object
+ * @param *buffer - send buffer
+ * @param length  - length of buffer
+ *
+ * @returns sent buffer size on success, SOCKET_AGAIN if would block, -1 on error
+ */
+int upnpd_socket_send_more (socket_t *socket, const void *buffer, int length);
+
+/**
+ * @brief send file contents from stream socket without copying through
+ *        user space, file offset of descriptor is not changed
+ *
+ * @param *socket - socket object
+ * @param fd      - file descriptor, see upnpd_file_descriptor
+ * @param offset  - file offset to start sending from
+ * @param length  - maximum data length to send
+ *
+ * @returns sent data size on success, SOCKET_AGAIN if would block, -1 on error
+ *          or if not supported on the platform
+ */
+int upnpd_socket_sendfile (socket_t *socket, int fd, unsigned long long offset, int length);
+
+/**
+ * @brief get remote address of connected socket
+ *
+ * @param *socket  - socket object
+ * @param *address - preallocated peer address, at least SOCKET_IP_LENGTH bytes
+ * @param *port    - peer port, can be NULL
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_peername (socket_t *socket, char *address, int *port);
+
 /**
  * @brief receive data from datagram socket
  *
@@ -365,6 +536,152 @@ int upnpd_socket_sendto (socket_t *socket, const void *buf, int length, const ch
  */
 int upnpd_socket_poll (poll_item_t *items, unsigned int nitems, int timeout);
 
+/**
+ * @brief creates a socket event set, sockets are registered once and
+ *        waited on without rebuilding the interest list on each call
+ *
+ * @returns socket event set on success, NULL on error
+ */
+socket_event_t * upnpd_socket_event_init (void);
+
+/**
+ * @brief registers socket to event set
+ *
+ * @param *event  - socket event set
+ * @param *socket - socket object
+ * @param events  - requested events (bitwise or'ed)
+ * @param *data   - private data returned with the events of socket
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_event_add (socket_event_t *event, socket_t *socket, poll_event_t events, void *data);
+
+/**
+ * @brief modifies requested events of a registered socket
+ *
+ * @param *event  - socket event set
+ * @param *socket - socket object
+ * @param events  - requested events (bitwise or'ed)
+ * @param *data   - private data returned with the events of socket
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_event_mod (socket_event_t *event, socket_t *socket, poll_event_t events, void *data);
+
+/**
+ * @brief removes socket from event set, should be called from the thread
+ *        waiting on the event set
+ *
+ * @param *event  - socket event set
+ * @param *socket - socket object
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_event_del (socket_event_t *event, socket_t *socket);
+
+/**
+ * @brief waits for events on registered sockets
+ *
+ * @param *event  - socket event set
+ * @param *items  - result items
+ * @param nitems  - maximum number of result items
+ * @param timeout - timeout in miliseconds, -1 for infinite
+ *
+ * @returns number of result items, 0 on timeout, -1 on error
+ */
+int upnpd_socket_event_wait (socket_event_t *event, socket_event_item_t *items, unsigned int nitems, int timeout);
+
+/**
+ * @brief destroys socket event set, registered sockets are not closed
+ *
+ * @param *event  - socket event set
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_event_uninit (socket_event_t *event);
+
+/**
+ * @brief creates a completion ring streaming files to sockets, each slot
+ *        owns a buffer of given size that is registered to the kernel
+ *
+ * @param nslots - number of slots
+ * @param size   - buffer size of each slot
+ *
+ * @returns ring object on success, NULL on error or if not supported on
+ *          the platform
+ */
+socket_ring_t * upnpd_socket_ring_init (unsigned int nslots, unsigned int size);
+
+/**
+ * @brief returns socket object of ring, readable while completions are
+ *        waiting to be reaped, to be registered to a socket event set
+ *
+ * @param *ring - ring object
+ *
+ * @returns socket object, must not be closed
+ */
+socket_t * upnpd_socket_ring_socket (socket_ring_t *ring);
+
+/**
+ * @brief submits a file read into slot buffer linked with a send of the
+ *        read data, a short read cancels the send
+ *
+ * @param *ring   - ring object
+ * @param slot    - slot index
+ * @param *socket - socket object
+ * @param fd      - file descriptor, see upnpd_file_descriptor
+ * @param offset  - file offset to read from
+ * @param length  - length to read, at most the slot buffer size
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_ring_stream (socket_ring_t *ring, unsigned int slot, socket_t *socket, int fd, unsigned long long offset, unsigned int length);
+
+/**
+ * @brief submits a send from slot buffer, for the remainder of short sends
+ *
+ * @param *ring   - ring object
+ * @param slot    - slot index
+ * @param *socket - socket object
+ * @param offset  - offset in slot buffer
+ * @param length  - length to send
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_ring_send (socket_ring_t *ring, unsigned int slot, socket_t *socket, unsigned int offset, unsigned int length);
+
+/**
+ * @brief cancels operations of slot, each of them still completes
+ *
+ * @param *ring - ring object
+ * @param slot  - slot index
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_ring_cancel (socket_ring_t *ring, unsigned int slot);
+
+/**
+ * @brief reaps completed operations
+ *
+ * @param *ring  - ring object
+ * @param *items - result items, result is transferred data size,
+ *                 SOCKET_AGAIN if operation was cancelled, -1 on error
+ * @param nitems - maximum number of result items
+ * @param wait   - waits for at least one completion if set
+ *
+ * @returns number of result items, -1 on error
+ */
+int upnpd_socket_ring_reap (socket_ring_t *ring, socket_ring_item_t *items, unsigned int nitems, int wait);
+
+/**
+ * @brief destroys completion ring, operations should be reaped before
+ *
+ * @param *ring - ring object
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_ring_uninit (socket_ring_t *ring);
+
 /**
  * @brief closes and destroys given socket object
  *
@@ -384,6 +701,87 @@ int upnpd_socket_close (socket_t *socket);
  */
 int upnpd_socket_option_reuseaddr (socket_t *socket, int on);
 
+/**
+ * @brief lets several sockets bind to the same address and port, incoming
+ *        connections are distributed among them by the kernel
+ *
+ * @param *socket - socket object
+ * @param on      - 0 for disable, 1 for enable
+ *
+ * @returns 0 on success, -1 on error or if not supported on the platform
+ */
+int upnpd_socket_option_reuseport (socket_t *socket, int on);
+
+/**
+ * @brief sets non-blocking flag for given socket object
+ *
+ * @param *socket - socket object
+ * @param on      - 0 for disable, 1 for enable
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_option_nonblock (socket_t *socket, int on);
+
+/**
+ * @brief disables/enables nagle algorithm on stream socket
+ *
+ * @param *socket - socket object
+ * @param on      - 0 for disable, 1 for enable
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_option_nodelay (socket_t *socket, int on);
+
+/**
+ * @brief holds back partial frames on stream socket until uncorked
+ *
+ * @param *socket - socket object
+ * @param on      - 0 for uncork, 1 for cork
+ *
+ * @returns 0 on success, -1 on error or if not supported on the platform
+ */
+int upnpd_socket_option_cork (socket_t *socket, int on);
+
+/**
+ * @brief sets kernel send buffer size of given socket
+ *
+ * @param *socket - socket object
+ * @param size    - buffer size in bytes
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_option_sndbuf (socket_t *socket, int size);
+
+/**
+ * @brief sets kernel receive buffer size of given socket
+ *
+ * @param *socket - socket object
+ * @param size    - buffer size in bytes
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_option_rcvbuf (socket_t *socket, int size);
+
+/**
+ * @brief sets keep alive probing of stream socket
+ *
+ * @param *socket - socket object
+ * @param on      - 0 for disable, 1 for enable
+ *
+ * @returns 0 on success, -1 on error
+ */
+int upnpd_socket_option_keepalive (socket_t *socket, int on);
+
+/**
+ * @brief wakes listening socket only when data arrives on a new connection
+ *
+ * @param *socket - socket object
+ * @param seconds - time to wait for data, 0 for disable
+ *
+ * @returns 0 on success, -1 on error or if not supported on the platform
+ */
+int upnpd_socket_option_deferaccept (socket_t *socket, int seconds);
+
 /**
  * @brief joins/leaves to a given multicast address
  *
@@ -469,6 +867,20 @@ typedef enum {
 	FILE_MATCH_CASEFOLD = 0x01,
 } file_match_t;
 
+/**
+ * @brief file access pattern advices, see upnpd_file_advise
+ */
+typedef enum {
+	/** no special treatment */
+	FILE_ADVICE_NORMAL     = 0x00,
+	/** data is read sequentially, read ahead aggressively */
+	FILE_ADVICE_SEQUENTIAL = 0x01,
+	/** data will be needed soon, start reading it in */
+	FILE_ADVICE_WILLNEED   = 0x02,
+	/** data will not be needed again, drop it from cache */
+	FILE_ADVICE_DONTNEED   = 0x03,
+} file_advice_t;
+
 /**
  * @brief exported file structure
  */
@@ -517,6 +929,8 @@ int upnpd_file_read (file_t *file, void *buffer, int length);
 int upnpd_file_write (file_t *file, const void *buffer, int length);
 unsigned long long upnpd_file_seek (file_t *file, unsigned long long offset, file_seek_t whence);
 int upnpd_file_poll (file_t *socket, poll_event_t request, poll_event_t *result, int timeout);
+int upnpd_file_descriptor (file_t *file);
+int upnpd_file_advise (int fd, unsigned long long offset, unsigned long long length, file_advice_t advice);
 int upnpd_file_close (file_t *file);
 int upnpd_file_unlink(const char *path);
 
@@ -530,13 +944,50 @@ int upnpd_rand_rand (void);
 void upnpd_time_sleep (unsigned int secs);
 void upnpd_time_usleep (unsigned int usecs);
 unsigned long long upnpd_time_gettimeofday (void);
+/* microseconds from an arbitrary point, not affected by changes of the wall clock */
+unsigned long long upnpd_time_monotonic (void);
 #define TIME_FORMAT_RFC1123 "%a, %d %b %Y %H:%M:%S GMT"
 int upnpd_time_strftime (char *str, int max, const char *format, unsigned long long tm, int local);
+unsigned long long upnpd_time_strptime (const char *str, const char *format);
 
 char * upnpd_interface_getaddr (const char *ifname);
 char * upnpd_interface_getmask (const char *ifname);
 int upnpd_interface_printall (void);
 
+/* growable string builder, an allocation failure is sticky: later appends
+ * are ignored and detach returns NULL, so builders check only once */
+typedef struct strbuf_s {
+	char *buffer;
+	unsigned int length;
+	unsigned int size;
+	int error;
+} strbuf_t;
+
+int upnpd_strbuf_init (strbuf_t *strbuf, unsigned int size);
+void upnpd_strbuf_uninit (strbuf_t *strbuf);
+int upnpd_strbuf_reserve (strbuf_t *strbuf, unsigned int length);
+int upnpd_strbuf_append (strbuf_t *strbuf, const char *string);
+int upnpd_strbuf_appendn (strbuf_t *strbuf, const char *string, unsigned int length);
+int upnpd_strbuf_printf (strbuf_t *strbuf, const char *format, ...);
+/* appends string with xml special characters replaced by entities */
+int upnpd_strbuf_escape (strbuf_t *strbuf, const char *string);
+/* length of string after upnpd_strbuf_escape, for pre-sizing */
+unsigned int upnpd_strbuf_escape_length (const char *string);
+/* returns the built string and resets the builder, caller frees */
+char * upnpd_strbuf_detach (strbuf_t *strbuf);
+
+/* fixed size string keyed table, filled once at init and then only read,
+ * so lookups need no locking. keys are not copied, they must outlive the
+ * table */
+typedef struct strmap_s strmap_t;
+
+strmap_t * upnpd_strmap_init (unsigned int count);
+void upnpd_strmap_uninit (strmap_t *strmap);
+/* fails if the key is already present or count keys were added */
+int upnpd_strmap_add (strmap_t *strmap, const char *key, void *value);
+/* returns NULL for unknown keys, and for a NULL table */
+void * upnpd_strmap_find (const strmap_t *strmap, const char *key);
+
 extern int platform_debug;
 void upnpd_debug_debugf (char *file, int line, const char *func, char *fmt, ...);
 
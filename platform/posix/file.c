@@ -175,6 +175,27 @@ unsigned long long upnpd_file_seek (file_t *file, unsigned long long offset, fil
 	return r;
 }
 
+int upnpd_file_descriptor (file_t *file)
+{
+	return file->fd;
+}
+
+int upnpd_file_advise (int fd, unsigned long long offset, unsigned long long length, file_advice_t advice)
+{
+#if defined(POSIX_FADV_SEQUENTIAL)
+	int a;
+	switch (advice) {
+		case FILE_ADVICE_SEQUENTIAL: a = POSIX_FADV_SEQUENTIAL; break;
+		case FILE_ADVICE_WILLNEED:   a = POSIX_FADV_WILLNEED;   break;
+		case FILE_ADVICE_DONTNEED:   a = POSIX_FADV_DONTNEED;   break;
+		default:                     a = POSIX_FADV_NORMAL;     break;
+	}
+	return (posix_fadvise(fd, (off_t) offset, (off_t) length, a) == 0) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
 int upnpd_file_close (file_t *file)
 {
 	if (file) {
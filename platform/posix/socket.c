@@ -29,15 +29,30 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <poll.h>
 #include <netdb.h>
 
+#if defined(__linux__)
+#define SOCKET_EVENT_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
+
+#if defined(ENABLE_IO_URING)
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 #include "platform.h"
 
 struct socket_s {
@@ -45,6 +60,30 @@ struct socket_s {
 	int fd;
 };
 
+#if defined(SOCKET_EVENT_EPOLL)
+
+struct socket_event_s {
+	int fd;
+};
+
+#else
+
+typedef struct socket_event_entry_s {
+	socket_t *socket;
+	poll_event_t events;
+	void *data;
+} socket_event_entry_t;
+
+struct socket_event_s {
+	int wakeup[2];
+	unsigned int nentries;
+	unsigned int sentries;
+	socket_event_entry_t *entries;
+	thread_mutex_t *mutex;
+};
+
+#endif
+
 static inline int socket_type_bsd (socket_type_t type)
 {
 	switch (type) {
@@ -110,7 +149,7 @@ int upnpd_socket_listen (socket_t *socket, int backlog)
 	return listen(socket->fd, backlog);
 }
 
-socket_t * upnpd_socket_accept (socket_t *socket)
+static socket_t * socket_accept (socket_t *socket, int nonblock)
 {
 	socket_t *s;
 	socklen_t client_len;
@@ -123,7 +162,19 @@ socket_t * upnpd_socket_accept (socket_t *socket)
 	s->type = socket->type;
 	memset(&client, 0, sizeof(struct sockaddr_in));
 	client_len = sizeof(struct sockaddr_in);
+#if defined(__linux__) && defined(SOCK_CLOEXEC)
+	/* accepted sockets must not leak into spawned helpers */
+	s->fd = accept4(socket->fd, (struct sockaddr *) &client, &client_len, SOCK_CLOEXEC | ((nonblock) ? SOCK_NONBLOCK : 0));
+#else
 	s->fd = accept(socket->fd, (struct sockaddr *) &client, &client_len);
+	if (s->fd >= 0) {
+		fcntl(s->fd, F_SETFD, FD_CLOEXEC);
+		if (nonblock && upnpd_socket_option_nonblock(s, 1) != 0) {
+			close(s->fd);
+			s->fd = -1;
+		}
+	}
+#endif
 	if (s->fd < 0) {
 		free(s);
 		return NULL;
@@ -131,6 +182,16 @@ socket_t * upnpd_socket_accept (socket_t *socket)
 	return s;
 }
 
+socket_t * upnpd_socket_accept (socket_t *socket)
+{
+	return socket_accept(socket, 0);
+}
+
+socket_t * upnpd_socket_accept_nonblock (socket_t *socket)
+{
+	return socket_accept(socket, 1);
+}
+
 int upnpd_socket_connect (socket_t *socket, const char *address, int port, int timeout)
 {
 	long flags;
@@ -167,12 +228,71 @@ int upnpd_socket_connect (socket_t *socket, const char *address, int port, int t
 
 int upnpd_socket_recv (socket_t *socket, void *buffer, int length)
 {
-	return recv(socket->fd, buffer, length, 0);
+	int rc;
+	rc = recv(socket->fd, buffer, length, 0);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return SOCKET_AGAIN;
+	}
+	return rc;
 }
 
 int upnpd_socket_send (socket_t *socket, const void *buffer, int length)
 {
-	return send(socket->fd, buffer, length, 0);
+	int rc;
+	rc = send(socket->fd, buffer, length, 0);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return SOCKET_AGAIN;
+	}
+	return rc;
+}
+
+int upnpd_socket_send_more (socket_t *socket, const void *buffer, int length)
+{
+	int rc;
+#if defined(MSG_MORE)
+	rc = send(socket->fd, buffer, length, MSG_MORE);
+#else
+	rc = send(socket->fd, buffer, length, 0);
+#endif
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return SOCKET_AGAIN;
+	}
+	return rc;
+}
+
+int upnpd_socket_sendfile (socket_t *socket, int fd, unsigned long long offset, int length)
+{
+#if defined(__linux__)
+	int rc;
+	off_t off;
+	off = (off_t) offset;
+	rc = sendfile(socket->fd, fd, &off, length);
+	if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return SOCKET_AGAIN;
+	}
+	return rc;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int upnpd_socket_peername (socket_t *socket, char *address, int *port)
+{
+	socklen_t peer_length;
+	struct sockaddr_in peer;
+	peer_length = sizeof(struct sockaddr_in);
+	memset(&peer, 0, sizeof(struct sockaddr_in));
+	if (getpeername(socket->fd, (struct sockaddr *) &peer, &peer_length) != 0) {
+		return -1;
+	}
+	if (inet_ntop(AF_INET, &(peer.sin_addr), address, SOCKET_IP_LENGTH) == NULL) {
+		return -1;
+	}
+	if (port) {
+		*port = ntohs(peer.sin_port);
+	}
+	return 0;
 }
 
 int upnpd_socket_recvfrom (socket_t *socket, void *buf, int length, char *address, int *port)
@@ -227,6 +347,553 @@ int upnpd_socket_poll (poll_item_t *items, unsigned int nitems, int timeout)
 	return rc;
 }
 
+#if defined(SOCKET_EVENT_EPOLL)
+
+static inline int socket_event_epoll (poll_event_t event)
+{
+	int bsd;
+	bsd = 0;
+	if (event & POLL_EVENT_ERR)  bsd |= (EPOLLERR | EPOLLHUP);
+	if (event & POLL_EVENT_IN)   bsd |= EPOLLIN;
+	if (event & POLL_EVENT_OUT)  bsd |= EPOLLOUT;
+	return bsd;
+}
+
+static inline poll_event_t socket_epoll_event (int bsd)
+{
+	poll_event_t event;
+	event = 0;
+	if (bsd & EPOLLERR)  event |= POLL_EVENT_ERR;
+	if (bsd & EPOLLHUP)  event |= POLL_EVENT_ERR;
+	if (bsd & EPOLLIN)   event |= POLL_EVENT_IN;
+	if (bsd & EPOLLOUT)  event |= POLL_EVENT_OUT;
+	return event;
+}
+
+socket_event_t * upnpd_socket_event_init (void)
+{
+	socket_event_t *event;
+	event = (socket_event_t *) malloc(sizeof(socket_event_t));
+	if (event == NULL) {
+		return NULL;
+	}
+	event->fd = epoll_create(64);
+	if (event->fd < 0) {
+		free(event);
+		return NULL;
+	}
+	fcntl(event->fd, F_SETFD, FD_CLOEXEC);
+	return event;
+}
+
+static int socket_event_ctl (socket_event_t *event, int op, socket_t *socket, poll_event_t events, void *data)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = socket_event_epoll(events);
+	ev.data.ptr = data;
+	if (epoll_ctl(event->fd, op, socket->fd, &ev) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int upnpd_socket_event_add (socket_event_t *event, socket_t *socket, poll_event_t events, void *data)
+{
+	return socket_event_ctl(event, EPOLL_CTL_ADD, socket, events, data);
+}
+
+int upnpd_socket_event_mod (socket_event_t *event, socket_t *socket, poll_event_t events, void *data)
+{
+	return socket_event_ctl(event, EPOLL_CTL_MOD, socket, events, data);
+}
+
+int upnpd_socket_event_del (socket_event_t *event, socket_t *socket)
+{
+	return socket_event_ctl(event, EPOLL_CTL_DEL, socket, 0, NULL);
+}
+
+int upnpd_socket_event_wait (socket_event_t *event, socket_event_item_t *items, unsigned int nitems, int timeout)
+{
+	int i;
+	int rc;
+	struct epoll_event *ev;
+	ev = (struct epoll_event *) malloc(sizeof(struct epoll_event) * nitems);
+	if (ev == NULL) {
+		return -1;
+	}
+	rc = epoll_wait(event->fd, ev, nitems, timeout);
+	if (rc < 0) {
+		rc = (errno == EINTR) ? 0 : -1;
+	}
+	for (i = 0; i < rc; i++) {
+		items[i].data = ev[i].data.ptr;
+		items[i].revents = socket_epoll_event(ev[i].events);
+	}
+	free(ev);
+	return rc;
+}
+
+int upnpd_socket_event_uninit (socket_event_t *event)
+{
+	if (event) {
+		close(event->fd);
+		free(event);
+	}
+	return 0;
+}
+
+#else
+
+static void socket_event_wakeup (socket_event_t *event)
+{
+	char c;
+	c = 0;
+	if (write(event->wakeup[1], &c, 1) < 0) {
+		return;
+	}
+}
+
+socket_event_t * upnpd_socket_event_init (void)
+{
+	socket_event_t *event;
+	event = (socket_event_t *) malloc(sizeof(socket_event_t));
+	if (event == NULL) {
+		return NULL;
+	}
+	memset(event, 0, sizeof(socket_event_t));
+	if (pipe(event->wakeup) < 0) {
+		free(event);
+		return NULL;
+	}
+	fcntl(event->wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(event->wakeup[1], F_SETFL, O_NONBLOCK);
+	event->mutex = upnpd_thread_mutex_init("event->mutex", 0);
+	if (event->mutex == NULL) {
+		close(event->wakeup[0]);
+		close(event->wakeup[1]);
+		free(event);
+		return NULL;
+	}
+	return event;
+}
+
+static socket_event_entry_t * socket_event_find (socket_event_t *event, socket_t *socket)
+{
+	unsigned int i;
+	for (i = 0; i < event->nentries; i++) {
+		if (event->entries[i].socket == socket) {
+			return &event->entries[i];
+		}
+	}
+	return NULL;
+}
+
+int upnpd_socket_event_add (socket_event_t *event, socket_t *socket, poll_event_t events, void *data)
+{
+	socket_event_entry_t *entries;
+	upnpd_thread_mutex_lock(event->mutex);
+	if (socket_event_find(event, socket) != NULL) {
+		upnpd_thread_mutex_unlock(event->mutex);
+		return -1;
+	}
+	if (event->nentries == event->sentries) {
+		entries = (socket_event_entry_t *) realloc(event->entries, sizeof(socket_event_entry_t) * (event->sentries + 64));
+		if (entries == NULL) {
+			upnpd_thread_mutex_unlock(event->mutex);
+			return -1;
+		}
+		event->entries = entries;
+		event->sentries += 64;
+	}
+	event->entries[event->nentries].socket = socket;
+	event->entries[event->nentries].events = events;
+	event->entries[event->nentries].data = data;
+	event->nentries++;
+	upnpd_thread_mutex_unlock(event->mutex);
+	socket_event_wakeup(event);
+	return 0;
+}
+
+int upnpd_socket_event_mod (socket_event_t *event, socket_t *socket, poll_event_t events, void *data)
+{
+	socket_event_entry_t *entry;
+	upnpd_thread_mutex_lock(event->mutex);
+	entry = socket_event_find(event, socket);
+	if (entry == NULL) {
+		upnpd_thread_mutex_unlock(event->mutex);
+		return -1;
+	}
+	entry->events = events;
+	entry->data = data;
+	upnpd_thread_mutex_unlock(event->mutex);
+	socket_event_wakeup(event);
+	return 0;
+}
+
+int upnpd_socket_event_del (socket_event_t *event, socket_t *socket)
+{
+	socket_event_entry_t *entry;
+	upnpd_thread_mutex_lock(event->mutex);
+	entry = socket_event_find(event, socket);
+	if (entry == NULL) {
+		upnpd_thread_mutex_unlock(event->mutex);
+		return -1;
+	}
+	*entry = event->entries[event->nentries - 1];
+	event->nentries--;
+	upnpd_thread_mutex_unlock(event->mutex);
+	return 0;
+}
+
+int upnpd_socket_event_wait (socket_event_t *event, socket_event_item_t *items, unsigned int nitems, int timeout)
+{
+	int rc;
+	char c;
+	unsigned int i;
+	unsigned int n;
+	unsigned int nentries;
+	struct pollfd *pfd;
+	socket_event_entry_t *entries;
+	upnpd_thread_mutex_lock(event->mutex);
+	nentries = event->nentries;
+	pfd = (struct pollfd *) malloc(sizeof(struct pollfd) * (nentries + 1));
+	entries = (socket_event_entry_t *) malloc(sizeof(socket_event_entry_t) * (nentries + 1));
+	if (pfd == NULL || entries == NULL) {
+		upnpd_thread_mutex_unlock(event->mutex);
+		free(pfd);
+		free(entries);
+		return -1;
+	}
+	memset(pfd, 0, sizeof(struct pollfd) * (nentries + 1));
+	pfd[0].fd = event->wakeup[0];
+	pfd[0].events = POLLIN;
+	for (i = 0; i < nentries; i++) {
+		entries[i] = event->entries[i];
+		pfd[i + 1].fd = entries[i].socket->fd;
+		pfd[i + 1].events = socket_event_bsd(entries[i].events);
+	}
+	upnpd_thread_mutex_unlock(event->mutex);
+	rc = poll(pfd, nentries + 1, timeout);
+	if (rc < 0) {
+		rc = (errno == EINTR) ? 0 : -1;
+		goto out;
+	}
+	if (pfd[0].revents & POLLIN) {
+		while (read(event->wakeup[0], &c, 1) == 1) {
+		}
+	}
+	for (i = 0, n = 0; i < nentries && n < nitems; i++) {
+		if (pfd[i + 1].revents == 0) {
+			continue;
+		}
+		items[n].data = entries[i].data;
+		items[n].revents = socket_bsd_event(pfd[i + 1].revents);
+		n++;
+	}
+	rc = n;
+out:
+	free(pfd);
+	free(entries);
+	return rc;
+}
+
+int upnpd_socket_event_uninit (socket_event_t *event)
+{
+	if (event) {
+		close(event->wakeup[0]);
+		close(event->wakeup[1]);
+		upnpd_thread_mutex_destroy(event->mutex);
+		free(event->entries);
+		free(event);
+	}
+	return 0;
+}
+
+#endif
+
+#if defined(ENABLE_IO_URING)
+
+/* user data of an operation keeps its slot and type */
+#define SOCKET_RING_DATA(slot, op)	(((unsigned long long) (slot) << 2) | (op))
+
+struct socket_ring_s {
+	socket_t socket;
+	unsigned int nslots;
+	unsigned int size;
+	char *buffers;
+	int fixed;
+	unsigned int entries;
+	void *sqmap;
+	size_t sqmapsize;
+	void *cqmap;
+	size_t cqmapsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	unsigned int *sqhead;
+	unsigned int *sqtail;
+	unsigned int *sqmask;
+	unsigned int *sqarray;
+	unsigned int *cqhead;
+	unsigned int *cqtail;
+	unsigned int *cqmask;
+	struct io_uring_cqe *cqes;
+};
+
+static int socket_ring_enter (socket_ring_t *ring, unsigned int submit, unsigned int complete, unsigned int flags)
+{
+	int rc;
+	do {
+		rc = syscall(__NR_io_uring_enter, ring->socket.fd, submit, complete, flags, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	return rc;
+}
+
+static struct io_uring_sqe * socket_ring_sqe (socket_ring_t *ring, unsigned int n)
+{
+	unsigned int i;
+	unsigned int head;
+	unsigned int tail;
+	struct io_uring_sqe *sqe;
+	head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+	tail = *ring->sqtail;
+	if (tail - head + n > ring->entries) {
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		sqe = &ring->sqes[(tail + i) & *ring->sqmask];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		ring->sqarray[(tail + i) & *ring->sqmask] = (tail + i) & *ring->sqmask;
+	}
+	return &ring->sqes[tail & *ring->sqmask];
+}
+
+static int socket_ring_submit (socket_ring_t *ring, unsigned int n)
+{
+	__atomic_store_n(ring->sqtail, *ring->sqtail + n, __ATOMIC_RELEASE);
+	return (socket_ring_enter(ring, n, 0, 0) == (int) n) ? 0 : -1;
+}
+
+socket_ring_t * upnpd_socket_ring_init (unsigned int nslots, unsigned int size)
+{
+	unsigned int i;
+	struct iovec *iovecs;
+	socket_ring_t *ring;
+	struct io_uring_params params;
+
+	ring = (socket_ring_t *) malloc(sizeof(socket_ring_t));
+	if (ring == NULL) {
+		return NULL;
+	}
+	memset(ring, 0, sizeof(socket_ring_t));
+	ring->nslots = nslots;
+	ring->size = size;
+	memset(&params, 0, sizeof(params));
+	/* read, send and their cancellations for every slot */
+	ring->socket.fd = syscall(__NR_io_uring_setup, nslots * 4, &params);
+	if (ring->socket.fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	ring->entries = params.sq_entries;
+	ring->sqmapsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqmapsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqmap = mmap(NULL, ring->sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->socket.fd, IORING_OFF_SQ_RING);
+	ring->cqmap = mmap(NULL, ring->cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->socket.fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->socket.fd, IORING_OFF_SQES);
+	if (ring->sqmap == MAP_FAILED || ring->cqmap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		goto error;
+	}
+	ring->sqhead = (unsigned int *) ((char *) ring->sqmap + params.sq_off.head);
+	ring->sqtail = (unsigned int *) ((char *) ring->sqmap + params.sq_off.tail);
+	ring->sqmask = (unsigned int *) ((char *) ring->sqmap + params.sq_off.ring_mask);
+	ring->sqarray = (unsigned int *) ((char *) ring->sqmap + params.sq_off.array);
+	ring->cqhead = (unsigned int *) ((char *) ring->cqmap + params.cq_off.head);
+	ring->cqtail = (unsigned int *) ((char *) ring->cqmap + params.cq_off.tail);
+	ring->cqmask = (unsigned int *) ((char *) ring->cqmap + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqmap + params.cq_off.cqes);
+	if (posix_memalign((void **) &ring->buffers, 4096, (size_t) nslots * size) != 0) {
+		ring->buffers = NULL;
+		goto error;
+	}
+	iovecs = (struct iovec *) malloc(sizeof(struct iovec) * nslots);
+	if (iovecs == NULL) {
+		goto error;
+	}
+	for (i = 0; i < nslots; i++) {
+		iovecs[i].iov_base = ring->buffers + (size_t) i * size;
+		iovecs[i].iov_len = size;
+	}
+	/* registration is limited by locked memory, plain reads work as well */
+	ring->fixed = (syscall(__NR_io_uring_register, ring->socket.fd, IORING_REGISTER_BUFFERS, iovecs, nslots) == 0);
+	free(iovecs);
+	return ring;
+error:
+	upnpd_socket_ring_uninit(ring);
+	return NULL;
+}
+
+socket_t * upnpd_socket_ring_socket (socket_ring_t *ring)
+{
+	return &ring->socket;
+}
+
+int upnpd_socket_ring_stream (socket_ring_t *ring, unsigned int slot, socket_t *socket, int fd, unsigned long long offset, unsigned int length)
+{
+	struct io_uring_sqe *sqe;
+	if (slot >= ring->nslots || length > ring->size) {
+		return -1;
+	}
+	sqe = socket_ring_sqe(ring, 2);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = (ring->fixed) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) (ring->buffers + (size_t) slot * ring->size);
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->buf_index = (ring->fixed) ? slot : 0;
+	sqe->user_data = SOCKET_RING_DATA(slot, SOCKET_RING_READ);
+	sqe = &ring->sqes[(*ring->sqtail + 1) & *ring->sqmask];
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = socket->fd;
+	sqe->addr = (unsigned long) (ring->buffers + (size_t) slot * ring->size);
+	sqe->len = length;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = SOCKET_RING_DATA(slot, SOCKET_RING_SEND);
+	return socket_ring_submit(ring, 2);
+}
+
+int upnpd_socket_ring_send (socket_ring_t *ring, unsigned int slot, socket_t *socket, unsigned int offset, unsigned int length)
+{
+	struct io_uring_sqe *sqe;
+	if (slot >= ring->nslots || offset + length > ring->size) {
+		return -1;
+	}
+	sqe = socket_ring_sqe(ring, 1);
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = socket->fd;
+	sqe->addr = (unsigned long) (ring->buffers + (size_t) slot * ring->size + offset);
+	sqe->len = length;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = SOCKET_RING_DATA(slot, SOCKET_RING_SEND);
+	return socket_ring_submit(ring, 1);
+}
+
+int upnpd_socket_ring_cancel (socket_ring_t *ring, unsigned int slot)
+{
+	unsigned int i;
+	struct io_uring_sqe *sqe;
+	if (slot >= ring->nslots) {
+		return -1;
+	}
+	sqe = socket_ring_sqe(ring, 2);
+	if (sqe == NULL) {
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		sqe = &ring->sqes[(*ring->sqtail + i) & *ring->sqmask];
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = SOCKET_RING_DATA(slot, (i == 0) ? SOCKET_RING_READ : SOCKET_RING_SEND);
+		sqe->user_data = SOCKET_RING_DATA(slot, SOCKET_RING_CANCEL);
+	}
+	return socket_ring_submit(ring, 2);
+}
+
+int upnpd_socket_ring_reap (socket_ring_t *ring, socket_ring_item_t *items, unsigned int nitems, int wait)
+{
+	unsigned int n;
+	unsigned int head;
+	unsigned int tail;
+	struct io_uring_cqe *cqe;
+	head = *ring->cqhead;
+	tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+	if (head == tail && wait) {
+		if (socket_ring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+			return -1;
+		}
+		tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+	}
+	for (n = 0; n < nitems && head != tail; n++, head++) {
+		cqe = &ring->cqes[head & *ring->cqmask];
+		items[n].slot = (unsigned int) (cqe->user_data >> 2);
+		items[n].op = (socket_ring_op_t) (cqe->user_data & 0x03);
+		if (cqe->res == -ECANCELED || cqe->res == -EAGAIN || cqe->res == -EINTR) {
+			items[n].result = SOCKET_AGAIN;
+		} else {
+			items[n].result = (cqe->res < 0) ? -1 : cqe->res;
+		}
+	}
+	__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+int upnpd_socket_ring_uninit (socket_ring_t *ring)
+{
+	if (ring == NULL) {
+		return 0;
+	}
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqessize);
+	}
+	if (ring->cqmap != NULL && ring->cqmap != MAP_FAILED) {
+		munmap(ring->cqmap, ring->cqmapsize);
+	}
+	if (ring->sqmap != NULL && ring->sqmap != MAP_FAILED) {
+		munmap(ring->sqmap, ring->sqmapsize);
+	}
+	close(ring->socket.fd);
+	free(ring->buffers);
+	free(ring);
+	return 0;
+}
+
+#else
+
+socket_ring_t * upnpd_socket_ring_init (unsigned int nslots, unsigned int size)
+{
+	return NULL;
+}
+
+socket_t * upnpd_socket_ring_socket (socket_ring_t *ring)
+{
+	return NULL;
+}
+
+int upnpd_socket_ring_stream (socket_ring_t *ring, unsigned int slot, socket_t *socket, int fd, unsigned long long offset, unsigned int length)
+{
+	return -1;
+}
+
+int upnpd_socket_ring_send (socket_ring_t *ring, unsigned int slot, socket_t *socket, unsigned int offset, unsigned int length)
+{
+	return -1;
+}
+
+int upnpd_socket_ring_cancel (socket_ring_t *ring, unsigned int slot)
+{
+	return -1;
+}
+
+int upnpd_socket_ring_reap (socket_ring_t *ring, socket_ring_item_t *items, unsigned int nitems, int wait)
+{
+	return -1;
+}
+
+int upnpd_socket_ring_uninit (socket_ring_t *ring)
+{
+	return 0;
+}
+
+#endif
+
 int upnpd_socket_close (socket_t *socket)
 {
 	if (socket) {
@@ -241,6 +908,76 @@ int upnpd_socket_option_reuseaddr (socket_t *socket, int on)
 	return setsockopt(socket->fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on));
 }
 
+int upnpd_socket_option_reuseport (socket_t *socket, int on)
+{
+#if defined(SO_REUSEPORT)
+	return setsockopt(socket->fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int upnpd_socket_option_nonblock (socket_t *socket, int on)
+{
+	int flags;
+	flags = fcntl(socket->fd, F_GETFL);
+	if (flags < 0) {
+		return -1;
+	}
+	if (on) {
+		flags |= O_NONBLOCK;
+	} else {
+		flags &= ~O_NONBLOCK;
+	}
+	if (fcntl(socket->fd, F_SETFL, flags) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+int upnpd_socket_option_nodelay (socket_t *socket, int on)
+{
+	return setsockopt(socket->fd, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+}
+
+int upnpd_socket_option_cork (socket_t *socket, int on)
+{
+#if defined(TCP_CORK)
+	return setsockopt(socket->fd, IPPROTO_TCP, TCP_CORK, (char *) &on, sizeof(on));
+#elif defined(TCP_NOPUSH)
+	return setsockopt(socket->fd, IPPROTO_TCP, TCP_NOPUSH, (char *) &on, sizeof(on));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int upnpd_socket_option_sndbuf (socket_t *socket, int size)
+{
+	return setsockopt(socket->fd, SOL_SOCKET, SO_SNDBUF, (char *) &size, sizeof(size));
+}
+
+int upnpd_socket_option_rcvbuf (socket_t *socket, int size)
+{
+	return setsockopt(socket->fd, SOL_SOCKET, SO_RCVBUF, (char *) &size, sizeof(size));
+}
+
+int upnpd_socket_option_keepalive (socket_t *socket, int on)
+{
+	return setsockopt(socket->fd, SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on));
+}
+
+int upnpd_socket_option_deferaccept (socket_t *socket, int seconds)
+{
+#if defined(TCP_DEFER_ACCEPT)
+	return setsockopt(socket->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (char *) &seconds, sizeof(seconds));
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 int upnpd_socket_option_membership (socket_t *socket, const char *address, int on)
 {
 	struct hostent *h;
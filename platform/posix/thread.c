@@ -68,6 +68,11 @@ struct thread_mutex_s {
         pthread_mutex_t mutex;
 };
 
+struct thread_rwlock_s {
+	char *name;
+	pthread_rwlock_t rwlock;
+};
+
 thread_cond_t * upnpd_thread_cond_init (const char *name)
 {
         thread_cond_t *c;
@@ -196,6 +201,46 @@ int upnpd_thread_mutex_unlock (thread_mutex_t *mutex)
 	return r;
 }
 
+thread_rwlock_t * upnpd_thread_rwlock_init (const char *name)
+{
+	thread_rwlock_t *l;
+	l = (thread_rwlock_t *) malloc(sizeof(thread_rwlock_t));
+	if (l == NULL) {
+		return NULL;
+	}
+	memset(l, 0, sizeof(thread_rwlock_t));
+	l->name = strdup(name);
+	if (pthread_rwlock_init(&l->rwlock, NULL) != 0) {
+		free(l->name);
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+int upnpd_thread_rwlock_destroy (thread_rwlock_t *rwlock)
+{
+	pthread_rwlock_destroy(&rwlock->rwlock);
+	free(rwlock->name);
+	free(rwlock);
+	return 0;
+}
+
+int upnpd_thread_rwlock_rdlock (thread_rwlock_t *rwlock)
+{
+	return pthread_rwlock_rdlock(&rwlock->rwlock);
+}
+
+int upnpd_thread_rwlock_wrlock (thread_rwlock_t *rwlock)
+{
+	return pthread_rwlock_wrlock(&rwlock->rwlock);
+}
+
+int upnpd_thread_rwlock_unlock (thread_rwlock_t *rwlock)
+{
+	return pthread_rwlock_unlock(&rwlock->rwlock);
+}
+
 static void * thread_run (void *farg)
 {
         thread_arg_t *arg = (thread_arg_t *) farg;
@@ -262,6 +307,45 @@ unsigned int upnpd_thread_self (void)
 	return (unsigned int) pthread_self();
 }
 
+int upnpd_thread_affinity (thread_t *thread, unsigned int cpu)
+{
+#if defined(__linux__)
+	long n;
+	cpu_set_t set;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0) {
+		return -1;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu % n, &set);
+	return (pthread_setaffinity_np(thread->thread, sizeof(cpu_set_t), &set) == 0) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+#if !defined(__GNUC__)
+static pthread_mutex_t upnpd_atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+unsigned long long upnpd_atomic_add (volatile unsigned long long *counter, unsigned long long value)
+{
+#if defined(__GNUC__)
+	return __sync_add_and_fetch(counter, value);
+#else
+	unsigned long long result;
+	pthread_mutex_lock(&upnpd_atomic_mutex);
+	result = (*counter += value);
+	pthread_mutex_unlock(&upnpd_atomic_mutex);
+	return result;
+#endif
+}
+
+unsigned long long upnpd_atomic_get (volatile unsigned long long *counter)
+{
+	return upnpd_atomic_add(counter, 0);
+}
+
 int upnpd_thread_sched_yield (void)
 {
         return sched_yield();
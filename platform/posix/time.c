@@ -27,6 +27,7 @@
 
 #include <config.h>
 
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
@@ -54,6 +55,17 @@ unsigned long long upnpd_time_gettimeofday (void)
 	return tsec + tusec;
 }
 
+unsigned long long upnpd_time_monotonic (void)
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return ((unsigned long long) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+	}
+#endif
+	return upnpd_time_gettimeofday() * 1000;
+}
+
 int upnpd_time_strftime (char *str, int max, const char *format, unsigned long long tm, int local)
 {
 	time_t t;
@@ -62,6 +74,21 @@ int upnpd_time_strftime (char *str, int max, const char *format, unsigned long l
 	if (local) {
 		return strftime(str, max, format, localtime_r(&t, &tl));
 	} else {
-		return strftime(str, max, format, gmtime(&t));
+		return strftime(str, max, format, gmtime_r(&t, &tl));
+	}
+}
+
+unsigned long long upnpd_time_strptime (const char *str, const char *format)
+{
+	time_t t;
+	struct tm tl;
+	memset(&tl, 0, sizeof(struct tm));
+	if (strptime(str, format, &tl) == NULL) {
+		return 0;
+	}
+	t = timegm(&tl);
+	if (t == (time_t) -1) {
+		return 0;
 	}
+	return ((unsigned long long) t) * 1000;
 }
@@ -0,0 +1,169 @@
+/*
+ * upnpavd - UPNP AV Daemon
+ *
+ * Copyright (C) 2010 Alper Akcan, alper.akcan@gmail.com
+ * Copyright (C) 2010 CoreCodec, Inc., http://www.CoreCodec.com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Any non-LGPL usage of this software or parts of this software is strictly
+ * forbidden.
+ *
+ * Commercial non-LGPL licensing of this software is possible.
+ * For more info contact CoreCodec through info@corecodec.com
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "platform.h"
+
+int upnpd_strbuf_init (strbuf_t *strbuf, unsigned int size)
+{
+	memset(strbuf, 0, sizeof(strbuf_t));
+	return upnpd_strbuf_reserve(strbuf, size);
+}
+
+void upnpd_strbuf_uninit (strbuf_t *strbuf)
+{
+	free(strbuf->buffer);
+	memset(strbuf, 0, sizeof(strbuf_t));
+}
+
+int upnpd_strbuf_reserve (strbuf_t *strbuf, unsigned int length)
+{
+	char *buffer;
+	unsigned int size;
+	if (strbuf->error != 0) {
+		return -1;
+	}
+	if (strbuf->length + length + 1 <= strbuf->size) {
+		return 0;
+	}
+	size = (strbuf->size > 0) ? strbuf->size : 64;
+	while (size < strbuf->length + length + 1) {
+		size *= 2;
+	}
+	buffer = (char *) realloc(strbuf->buffer, size);
+	if (buffer == NULL) {
+		strbuf->error = 1;
+		return -1;
+	}
+	strbuf->buffer = buffer;
+	strbuf->buffer[strbuf->length] = '\0';
+	strbuf->size = size;
+	return 0;
+}
+
+int upnpd_strbuf_appendn (strbuf_t *strbuf, const char *string, unsigned int length)
+{
+	if (upnpd_strbuf_reserve(strbuf, length) != 0) {
+		return -1;
+	}
+	memcpy(strbuf->buffer + strbuf->length, string, length);
+	strbuf->length += length;
+	strbuf->buffer[strbuf->length] = '\0';
+	return 0;
+}
+
+int upnpd_strbuf_append (strbuf_t *strbuf, const char *string)
+{
+	return upnpd_strbuf_appendn(strbuf, string, strlen(string));
+}
+
+int upnpd_strbuf_printf (strbuf_t *strbuf, const char *format, ...)
+{
+	int rc;
+	va_list args;
+	if (upnpd_strbuf_reserve(strbuf, 0) != 0) {
+		return -1;
+	}
+	va_start(args, format);
+	rc = vsnprintf(strbuf->buffer + strbuf->length, strbuf->size - strbuf->length, format, args);
+	va_end(args);
+	if (rc < 0) {
+		strbuf->error = 1;
+		strbuf->buffer[strbuf->length] = '\0';
+		return -1;
+	}
+	if ((unsigned int) rc >= strbuf->size - strbuf->length) {
+		if (upnpd_strbuf_reserve(strbuf, rc) != 0) {
+			return -1;
+		}
+		va_start(args, format);
+		rc = vsnprintf(strbuf->buffer + strbuf->length, strbuf->size - strbuf->length, format, args);
+		va_end(args);
+	}
+	strbuf->length += rc;
+	return 0;
+}
+
+unsigned int upnpd_strbuf_escape_length (const char *string)
+{
+	unsigned int length;
+	for (length = 0; *string != '\0'; string++) {
+		switch (*string) {
+			case '<':  length += 4; break;
+			case '>':  length += 4; break;
+			case '&':  length += 5; break;
+			case '\'': length += 6; break;
+			case '\"': length += 6; break;
+			default:   length += 1; break;
+		}
+	}
+	return length;
+}
+
+int upnpd_strbuf_escape (strbuf_t *strbuf, const char *string)
+{
+	char *buffer;
+	const char *entity;
+	if (upnpd_strbuf_reserve(strbuf, upnpd_strbuf_escape_length(string)) != 0) {
+		return -1;
+	}
+	buffer = strbuf->buffer + strbuf->length;
+	for (; *string != '\0'; string++) {
+		switch (*string) {
+			case '<':  entity = "&lt;"; break;
+			case '>':  entity = "&gt;"; break;
+			case '&':  entity = "&amp;"; break;
+			case '\'': entity = "&apos;"; break;
+			case '\"': entity = "&quot;"; break;
+			default:   *buffer++ = *string; continue;
+		}
+		while (*entity != '\0') {
+			*buffer++ = *entity++;
+		}
+	}
+	*buffer = '\0';
+	strbuf->length = buffer - strbuf->buffer;
+	return 0;
+}
+
+char * upnpd_strbuf_detach (strbuf_t *strbuf)
+{
+	char *buffer;
+	if (strbuf->error != 0 || upnpd_strbuf_reserve(strbuf, 0) != 0) {
+		upnpd_strbuf_uninit(strbuf);
+		return NULL;
+	}
+	buffer = strbuf->buffer;
+	memset(strbuf, 0, sizeof(strbuf_t));
+	return buffer;
+}
@@ -0,0 +1,127 @@
+/*
+ * upnpavd - UPNP AV Daemon
+ *
+ * Copyright (C) 2010 Alper Akcan, alper.akcan@gmail.com
+ * Copyright (C) 2010 CoreCodec, Inc., http://www.CoreCodec.com
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Any non-LGPL usage of this software or parts of this software is strictly
+ * forbidden.
+ *
+ * Commercial non-LGPL licensing of this software is possible.
+ * For more info contact CoreCodec through info@corecodec.com
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+
+typedef struct strmap_slot_s {
+	const char *key;
+	unsigned int hash;
+	void *value;
+} strmap_slot_t;
+
+struct strmap_s {
+	/** power of two, at least twice the count given at init */
+	unsigned int size;
+	unsigned int count;
+	unsigned int limit;
+	strmap_slot_t *slots;
+};
+
+static unsigned int strmap_hash (const char *key)
+{
+	unsigned int hash;
+	hash = 5381;
+	while (*key != '\0') {
+		hash = ((hash << 5) + hash) + (unsigned char) *key++;
+	}
+	return hash;
+}
+
+strmap_t * upnpd_strmap_init (unsigned int count)
+{
+	strmap_t *strmap;
+	strmap = (strmap_t *) malloc(sizeof(strmap_t));
+	if (strmap == NULL) {
+		return NULL;
+	}
+	memset(strmap, 0, sizeof(strmap_t));
+	strmap->size = 8;
+	while (strmap->size < count * 2) {
+		strmap->size <<= 1;
+	}
+	strmap->limit = (count > 0) ? count : 1;
+	strmap->slots = (strmap_slot_t *) malloc(sizeof(strmap_slot_t) * strmap->size);
+	if (strmap->slots == NULL) {
+		free(strmap);
+		return NULL;
+	}
+	memset(strmap->slots, 0, sizeof(strmap_slot_t) * strmap->size);
+	return strmap;
+}
+
+void upnpd_strmap_uninit (strmap_t *strmap)
+{
+	if (strmap == NULL) {
+		return;
+	}
+	free(strmap->slots);
+	free(strmap);
+}
+
+int upnpd_strmap_add (strmap_t *strmap, const char *key, void *value)
+{
+	unsigned int i;
+	unsigned int hash;
+	strmap_slot_t *slot;
+	if (strmap == NULL || key == NULL || strmap->count >= strmap->limit) {
+		return -1;
+	}
+	hash = strmap_hash(key);
+	for (i = hash & (strmap->size - 1); (slot = &strmap->slots[i])->key != NULL; i = (i + 1) & (strmap->size - 1)) {
+		if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+			return -1;
+		}
+	}
+	slot->key = key;
+	slot->hash = hash;
+	slot->value = value;
+	strmap->count++;
+	return 0;
+}
+
+void * upnpd_strmap_find (const strmap_t *strmap, const char *key)
+{
+	unsigned int i;
+	unsigned int hash;
+	const strmap_slot_t *slot;
+	if (strmap == NULL || key == NULL) {
+		return NULL;
+	}
+	hash = strmap_hash(key);
+	for (i = hash & (strmap->size - 1); (slot = &strmap->slots[i])->key != NULL; i = (i + 1) & (strmap->size - 1)) {
+		if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+			return slot->value;
+		}
+	}
+	return NULL;
+}
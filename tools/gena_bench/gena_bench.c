@@ -0,0 +1,826 @@
+/*
+ * loopback benchmark of the gena server. the server is started on
+ * 127.0.0.1 with synthetic vfs and event callbacks, client threads drive
+ * one workload at a time over keep-alive connections and latencies of
+ * all requests are collected for percentiles.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "gena.h"
+
+#define BENCH_ADDRESS		"127.0.0.1"
+#define BENCH_PATH_LARGE	"/bench/large"
+#define BENCH_PATH_CONTROL	"/bench/control"
+#define BENCH_PATH_EVENT	"/bench/event"
+#define BENCH_CLIENTS		16
+#define BENCH_TIME		5
+#define BENCH_SIZE		(1024ULL * 1024 * 64)
+#define BENCH_BROWSE		(1024 * 16)
+#define BENCH_RANGE		(1024 * 64)
+#define BENCH_BUFFER		(1024 * 64)
+#define BENCH_REQUEST		(1024 * 2)
+#define BENCH_TIMEOUT		10000
+#define BENCH_SPARE_WORKERS	4
+#define BENCH_LATENCIES		4096
+
+typedef enum {
+	BENCH_WORKLOAD_BROWSE    = 0x00,
+	BENCH_WORKLOAD_GET       = 0x01,
+	BENCH_WORKLOAD_RANGE     = 0x02,
+	BENCH_WORKLOAD_SUBSCRIBE = 0x03,
+	BENCH_WORKLOADS,
+} bench_workload_t;
+
+static const char *bench_workload_names[BENCH_WORKLOADS] = {
+	"browse",
+	"get",
+	"range",
+	"subscribe",
+};
+
+static const char *bench_browse_request =
+	"<?xml version=\"1.0\"?>"
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	"<s:Body><u:Browse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+	"<ObjectID>0</ObjectID><BrowseFlag>BrowseDirectChildren</BrowseFlag><Filter>*</Filter>"
+	"<StartingIndex>0</StartingIndex><RequestedCount>0</RequestedCount><SortCriteria></SortCriteria>"
+	"</u:Browse></s:Body></s:Envelope>";
+
+typedef struct bench_s {
+	unsigned int clients;
+	unsigned int time;
+	unsigned long long size;
+	unsigned int browse;
+	unsigned int range;
+	char *file;
+	char *response;
+	unsigned short port;
+	volatile unsigned long long sids;
+	char pattern[BENCH_BUFFER];
+} bench_t;
+
+typedef struct bench_file_s {
+	file_t *file;
+	unsigned long long size;
+	unsigned long long offset;
+} bench_file_t;
+
+typedef struct bench_client_s {
+	bench_t *bench;
+	bench_workload_t workload;
+	unsigned long long deadline;
+	unsigned int seed;
+	socket_t *socket;
+	char *buffer;
+	unsigned int start;
+	unsigned int end;
+	unsigned long long requests;
+	unsigned long long errors;
+	unsigned long long bytes;
+	unsigned int *latencies;
+	unsigned int nlatencies;
+	unsigned int slatencies;
+	thread_t *thread;
+} bench_client_t;
+
+static const struct option bench_options[] = {
+	{"help", 0, 0, 'h'},
+	{"clients", 1, 0, 'c'},
+	{"time", 1, 0, 't'},
+	{"workload", 1, 0, 'w'},
+	{"mode", 1, 0, 'm'},
+	{"size", 1, 0, 's'},
+	{"browse", 1, 0, 'b'},
+	{"range", 1, 0, 'r'},
+	{"file", 1, 0, 'f'},
+	{"verbose", 0, 0, 'v'},
+	{0, 0, 0, 0},
+};
+
+static int bench_help (char *pname)
+{
+	printf("\n"
+	"%s [options]\n"
+	"  -h, --help              show this message\n"
+	"  -c, --clients <n>       concurrent client connections (default: %d)\n"
+	"  -t, --time <seconds>    duration of each workload (default: %d)\n"
+	"  -w, --workload <list>   comma separated workloads to run (default: all)\n"
+	"                          browse    : soap browse posts\n"
+	"                          get       : sequential gets of the large file\n"
+	"                          range     : random range gets of the large file\n"
+	"                          subscribe : subscription requests\n"
+	"  -m, --mode <mode>       server mode, thread or reactor (default: thread)\n"
+	"  -s, --size <bytes>      size of the synthetic large file (default: %llu)\n"
+	"  -b, --browse <bytes>    size of browse responses (default: %d)\n"
+	"  -r, --range <bytes>     size of range requests (default: %d)\n"
+	"  -f, --file <path>       serve a regular file as the large file, enables sendfile\n"
+	"  -v, --verbose           noisy debug\n"
+	"\n",
+	pname, BENCH_CLIENTS, BENCH_TIME, BENCH_SIZE, BENCH_BROWSE, BENCH_RANGE);
+	return 0;
+}
+
+static int bench_vfsinfo (void *cookie, char *path, gena_fileinfo_t *info)
+{
+	bench_t *bench;
+	file_stat_t stat;
+	bench = (bench_t *) cookie;
+	if (strcmp(path, BENCH_PATH_LARGE) != 0) {
+		return -1;
+	}
+	if (bench->file != NULL) {
+		if (upnpd_file_stat(bench->file, &stat) != 0) {
+			return -1;
+		}
+		info->size = stat.size;
+		info->mtime = stat.mtime;
+	} else {
+		info->size = bench->size;
+		info->mtime = 0;
+	}
+	info->mimetype = strdup("application/octet-stream");
+	info->seekable = 1;
+	return 0;
+}
+
+static void * bench_vfsopen (void *cookie, char *path, gena_filemode_t mode)
+{
+	bench_t *bench;
+	bench_file_t *file;
+	file_stat_t stat;
+	bench = (bench_t *) cookie;
+	if (strcmp(path, BENCH_PATH_LARGE) != 0) {
+		return NULL;
+	}
+	file = (bench_file_t *) malloc(sizeof(bench_file_t));
+	if (file == NULL) {
+		return NULL;
+	}
+	memset(file, 0, sizeof(bench_file_t));
+	file->size = bench->size;
+	if (bench->file != NULL) {
+		if (upnpd_file_stat(bench->file, &stat) != 0) {
+			free(file);
+			return NULL;
+		}
+		file->size = stat.size;
+		file->file = upnpd_file_open(bench->file, FILE_MODE_READ);
+		if (file->file == NULL) {
+			free(file);
+			return NULL;
+		}
+	}
+	return file;
+}
+
+static int bench_vfsread (void *cookie, void *handle, char *buffer, unsigned int length)
+{
+	int rc;
+	bench_t *bench;
+	bench_file_t *file;
+	unsigned int n;
+	unsigned int p;
+	unsigned int l;
+	bench = (bench_t *) cookie;
+	file = (bench_file_t *) handle;
+	if (file->file != NULL) {
+		rc = upnpd_file_read(file->file, buffer, length);
+		if (rc > 0) {
+			file->offset += rc;
+		}
+		return rc;
+	}
+	if (file->offset >= file->size) {
+		return 0;
+	}
+	if (length > file->size - file->offset) {
+		length = file->size - file->offset;
+	}
+	for (n = 0; n < length; n += l) {
+		p = (file->offset + n) % BENCH_BUFFER;
+		l = BENCH_BUFFER - p;
+		if (l > length - n) {
+			l = length - n;
+		}
+		memcpy(buffer + n, bench->pattern + p, l);
+	}
+	file->offset += length;
+	return length;
+}
+
+static int bench_vfswrite (void *cookie, void *handle, char *buffer, unsigned int length)
+{
+	return -1;
+}
+
+static unsigned long long bench_vfsseek (void *cookie, void *handle, unsigned long long offset, gena_seek_t whence)
+{
+	bench_file_t *file;
+	file = (bench_file_t *) handle;
+	switch (whence) {
+		case GENA_SEEK_SET: file->offset = offset; break;
+		case GENA_SEEK_CUR: file->offset += offset; break;
+		case GENA_SEEK_END: file->offset = file->size + offset; break;
+	}
+	if (file->offset > file->size) {
+		file->offset = file->size;
+	}
+	if (file->file != NULL) {
+		return upnpd_file_seek(file->file, file->offset, FILE_SEEK_SET);
+	}
+	return file->offset;
+}
+
+static int bench_vfsclose (void *cookie, void *handle)
+{
+	bench_file_t *file;
+	file = (bench_file_t *) handle;
+	if (file->file != NULL) {
+		upnpd_file_close(file->file);
+	}
+	free(file);
+	return 0;
+}
+
+static int bench_vfsfd (void *cookie, void *handle, unsigned long long *offset)
+{
+	bench_file_t *file;
+	file = (bench_file_t *) handle;
+	if (file->file == NULL) {
+		return -1;
+	}
+	*offset = file->offset;
+	return upnpd_file_descriptor(file->file);
+}
+
+static int bench_event (void *cookie, gena_event_t *event)
+{
+	bench_t *bench;
+	bench = (bench_t *) cookie;
+	switch (event->type) {
+		case GENA_EVENT_TYPE_ACTION:
+			event->event.action.valid = 1;
+			event->event.action.response = strdup(bench->response);
+			return (event->event.action.response != NULL) ? 0 : -1;
+		case GENA_EVENT_TYPE_SUBSCRIBE_REQUEST:
+			if (asprintf(&event->event.subscribe.sid, "uuid:bench-%llu", upnpd_atomic_add(&bench->sids, 1)) < 0) {
+				event->event.subscribe.sid = NULL;
+				return -1;
+			}
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+static char * bench_response (unsigned int size)
+{
+	unsigned int l;
+	char *response;
+	const char *head =
+		"<?xml version=\"1.0\"?>\n"
+		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+		"<s:Body>\n"
+		"<u:BrowseResponse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">\n"
+		"<Result>";
+	const char *tail =
+		"</Result>\n"
+		"<NumberReturned>0</NumberReturned>\n"
+		"<TotalMatches>0</TotalMatches>\n"
+		"<UpdateID>0</UpdateID>\n"
+		"</u:BrowseResponse>\n"
+		"</s:Body>\n"
+		"</s:Envelope>\n";
+	l = strlen(head) + strlen(tail);
+	if (size < l) {
+		size = l;
+	}
+	response = (char *) malloc(size + 1);
+	if (response == NULL) {
+		return NULL;
+	}
+	strcpy(response, head);
+	memset(response + strlen(head), 'x', size - l);
+	strcpy(response + size - strlen(tail), tail);
+	return response;
+}
+
+static void bench_client_disconnect (bench_client_t *client)
+{
+	if (client->socket != NULL) {
+		upnpd_socket_close(client->socket);
+		client->socket = NULL;
+	}
+	client->start = 0;
+	client->end = 0;
+}
+
+static int bench_client_connect (bench_client_t *client)
+{
+	client->socket = upnpd_socket_open(SOCKET_TYPE_STREAM, 0);
+	if (client->socket == NULL) {
+		return -1;
+	}
+	if (upnpd_socket_connect(client->socket, BENCH_ADDRESS, client->bench->port, BENCH_TIMEOUT) < 0) {
+		bench_client_disconnect(client);
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_client_send (bench_client_t *client, const char *buffer, unsigned int length)
+{
+	int rc;
+	unsigned int t;
+	poll_item_t pitem;
+	for (t = 0; t < length; ) {
+		pitem.item = client->socket;
+		pitem.events = POLL_EVENT_OUT;
+		rc = upnpd_socket_poll(&pitem, 1, BENCH_TIMEOUT);
+		if (rc <= 0 || (pitem.revents & POLL_EVENT_OUT) == 0) {
+			return -1;
+		}
+		rc = upnpd_socket_send(client->socket, buffer + t, length - t);
+		if (rc == SOCKET_AGAIN) {
+			continue;
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+		t += rc;
+	}
+	return 0;
+}
+
+/* returns number of bytes received, 0 when peer closed the connection */
+static int bench_client_fill (bench_client_t *client)
+{
+	int rc;
+	poll_item_t pitem;
+	if (client->start > 0) {
+		memmove(client->buffer, client->buffer + client->start, client->end - client->start);
+		client->end -= client->start;
+		client->start = 0;
+	}
+	if (client->end >= BENCH_BUFFER - 1) {
+		return -1;
+	}
+	while (1) {
+		pitem.item = client->socket;
+		pitem.events = POLL_EVENT_IN;
+		rc = upnpd_socket_poll(&pitem, 1, BENCH_TIMEOUT);
+		if (rc <= 0 || (pitem.revents & POLL_EVENT_IN) == 0) {
+			return -1;
+		}
+		rc = upnpd_socket_recv(client->socket, client->buffer + client->end, BENCH_BUFFER - 1 - client->end);
+		if (rc == SOCKET_AGAIN) {
+			continue;
+		}
+		if (rc < 0) {
+			return -1;
+		}
+		client->end += rc;
+		client->buffer[client->end] = '\0';
+		return rc;
+	}
+}
+
+/* reads one response, body is counted and dropped */
+static int bench_client_response (bench_client_t *client, int *status, int *keepalive)
+{
+	int rc;
+	int contentlength;
+	char *end;
+	char *line;
+	char *next;
+	unsigned int n;
+	unsigned long long length;
+
+	while ((end = strstr(client->buffer + client->start, "\r\n\r\n")) == NULL) {
+		if (bench_client_fill(client) <= 0) {
+			return -1;
+		}
+	}
+	*end = '\0';
+	line = client->buffer + client->start;
+	client->start = end + 4 - client->buffer;
+	if (strncmp(line, "HTTP/1.", strlen("HTTP/1.")) != 0 || strchr(line, ' ') == NULL) {
+		return -1;
+	}
+	*status = atoi(strchr(line, ' ') + 1);
+	*keepalive = (strncmp(line, "HTTP/1.1", strlen("HTTP/1.1")) == 0) ? 1 : 0;
+	length = 0;
+	contentlength = 0;
+	for (; line != NULL; line = next) {
+		next = strstr(line, "\r\n");
+		if (next != NULL) {
+			*next = '\0';
+			next += 2;
+		}
+		if (strncasecmp(line, "Content-Length:", strlen("Content-Length:")) == 0) {
+			length = strtoull(line + strlen("Content-Length:"), NULL, 10);
+			contentlength = 1;
+		} else if (strncasecmp(line, "Connection:", strlen("Connection:")) == 0) {
+			*keepalive = (strstr(line, "close") == NULL) ? 1 : 0;
+		}
+	}
+	if (contentlength == 0) {
+		*keepalive = 0;
+		length = ~0ULL;
+	}
+	while (length > 0) {
+		if (client->start == client->end) {
+			rc = bench_client_fill(client);
+			if (rc < 0) {
+				return -1;
+			}
+			if (rc == 0) {
+				return (contentlength == 0) ? 0 : -1;
+			}
+		}
+		n = client->end - client->start;
+		if (n > length) {
+			n = length;
+		}
+		client->start += n;
+		client->bytes += n;
+		length -= n;
+	}
+	if (client->start == client->end) {
+		client->start = 0;
+		client->end = 0;
+		client->buffer[0] = '\0';
+	}
+	return 0;
+}
+
+static int bench_client_latency (bench_client_t *client, unsigned int latency)
+{
+	unsigned int *latencies;
+	if (client->nlatencies == client->slatencies) {
+		latencies = (unsigned int *) realloc(client->latencies, sizeof(unsigned int) * (client->slatencies + BENCH_LATENCIES) * 2);
+		if (latencies == NULL) {
+			return -1;
+		}
+		client->latencies = latencies;
+		client->slatencies = (client->slatencies + BENCH_LATENCIES) * 2;
+	}
+	client->latencies[client->nlatencies++] = latency;
+	return 0;
+}
+
+static int bench_client_request (bench_client_t *client)
+{
+	int len;
+	int status;
+	int keepalive;
+	bench_t *bench;
+	char request[BENCH_REQUEST];
+	unsigned long long start;
+	unsigned long long started;
+
+	bench = client->bench;
+	switch (client->workload) {
+		case BENCH_WORKLOAD_BROWSE:
+			len = snprintf(request, sizeof(request),
+				"POST " BENCH_PATH_CONTROL " HTTP/1.1\r\n"
+				"Host: " BENCH_ADDRESS ":%u\r\n"
+				"Content-Type: text/xml; charset=\"utf-8\"\r\n"
+				"SOAPACTION: \"urn:schemas-upnp-org:service:ContentDirectory:1#Browse\"\r\n"
+				"Content-Length: %u\r\n"
+				"\r\n"
+				"%s",
+				bench->port, (unsigned int) strlen(bench_browse_request), bench_browse_request);
+			break;
+		case BENCH_WORKLOAD_GET:
+			len = snprintf(request, sizeof(request),
+				"GET " BENCH_PATH_LARGE " HTTP/1.1\r\n"
+				"Host: " BENCH_ADDRESS ":%u\r\n"
+				"\r\n",
+				bench->port);
+			break;
+		case BENCH_WORKLOAD_RANGE:
+			client->seed = client->seed * 1103515245 + 12345;
+			start = ((((unsigned long long) client->seed) << 16) ^ (client->seed >> 8)) % ((bench->size > bench->range) ? bench->size - bench->range : 1);
+			len = snprintf(request, sizeof(request),
+				"GET " BENCH_PATH_LARGE " HTTP/1.1\r\n"
+				"Host: " BENCH_ADDRESS ":%u\r\n"
+				"Range: bytes=%llu-%llu\r\n"
+				"\r\n",
+				bench->port, start, start + bench->range - 1);
+			break;
+		case BENCH_WORKLOAD_SUBSCRIBE:
+			len = snprintf(request, sizeof(request),
+				"SUBSCRIBE " BENCH_PATH_EVENT " HTTP/1.1\r\n"
+				"Host: " BENCH_ADDRESS ":%u\r\n"
+				"CALLBACK: <http://" BENCH_ADDRESS ":9/>\r\n"
+				"NT: upnp:event\r\n"
+				"TIMEOUT: Second-1800\r\n"
+				"\r\n",
+				bench->port);
+			break;
+		default:
+			return -1;
+	}
+	if (len < 0 || len >= (int) sizeof(request)) {
+		return -1;
+	}
+	started = upnpd_time_monotonic();
+	if (client->socket == NULL && bench_client_connect(client) != 0) {
+		client->errors++;
+		return -1;
+	}
+	if (bench_client_send(client, request, len) != 0 ||
+	    bench_client_response(client, &status, &keepalive) != 0) {
+		client->errors++;
+		bench_client_disconnect(client);
+		return -1;
+	}
+	client->requests++;
+	if (status >= 400) {
+		client->errors++;
+	}
+	if (keepalive == 0) {
+		bench_client_disconnect(client);
+	}
+	return bench_client_latency(client, upnpd_time_monotonic() - started);
+}
+
+static void * bench_client_loop (void *arg)
+{
+	bench_client_t *client;
+	client = (bench_client_t *) arg;
+	while (upnpd_time_monotonic() < client->deadline) {
+		bench_client_request(client);
+	}
+	bench_client_disconnect(client);
+	return NULL;
+}
+
+static int bench_compare (const void *a, const void *b)
+{
+	unsigned int x;
+	unsigned int y;
+	x = *(const unsigned int *) a;
+	y = *(const unsigned int *) b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+static double bench_percentile (unsigned int *latencies, unsigned int count, unsigned int permille)
+{
+	unsigned long long i;
+	if (count == 0) {
+		return 0;
+	}
+	i = ((unsigned long long) count * permille + 999) / 1000;
+	if (i > 0) {
+		i--;
+	}
+	return latencies[i] / 1000.0;
+}
+
+static int bench_run (bench_t *bench, bench_workload_t workload)
+{
+	int rc;
+	unsigned int i;
+	unsigned int n;
+	unsigned int count;
+	unsigned int *latencies;
+	unsigned long long bytes;
+	unsigned long long errors;
+	unsigned long long requests;
+	unsigned long long started;
+	double elapsed;
+	bench_client_t *clients;
+
+	rc = -1;
+	latencies = NULL;
+	clients = (bench_client_t *) malloc(sizeof(bench_client_t) * bench->clients);
+	if (clients == NULL) {
+		return -1;
+	}
+	memset(clients, 0, sizeof(bench_client_t) * bench->clients);
+	started = upnpd_time_monotonic();
+	for (i = 0; i < bench->clients; i++) {
+		clients[i].bench = bench;
+		clients[i].workload = workload;
+		clients[i].deadline = started + bench->time * 1000000ULL;
+		clients[i].seed = i + 1;
+		clients[i].buffer = (char *) malloc(BENCH_BUFFER);
+		if (clients[i].buffer == NULL) {
+			goto out;
+		}
+		clients[i].buffer[0] = '\0';
+	}
+	for (i = 0; i < bench->clients; i++) {
+		clients[i].thread = upnpd_thread_create("bench_client", bench_client_loop, &clients[i]);
+	}
+	for (i = 0; i < bench->clients; i++) {
+		if (clients[i].thread != NULL) {
+			upnpd_thread_join(clients[i].thread);
+		}
+	}
+	elapsed = (upnpd_time_monotonic() - started) / 1000000.0;
+
+	count = 0;
+	bytes = 0;
+	errors = 0;
+	requests = 0;
+	for (i = 0; i < bench->clients; i++) {
+		count += clients[i].nlatencies;
+		bytes += clients[i].bytes;
+		errors += clients[i].errors;
+		requests += clients[i].requests;
+	}
+	latencies = (unsigned int *) malloc(sizeof(unsigned int) * (count + 1));
+	if (latencies == NULL) {
+		goto out;
+	}
+	for (i = 0, n = 0; i < bench->clients; i++) {
+		memcpy(latencies + n, clients[i].latencies, sizeof(unsigned int) * clients[i].nlatencies);
+		n += clients[i].nlatencies;
+	}
+	qsort(latencies, count, sizeof(unsigned int), bench_compare);
+	printf("%-10s %7u %10llu %8llu %11.1f %9.1f %9.3f %9.3f %9.3f\n",
+		bench_workload_names[workload],
+		bench->clients,
+		requests,
+		errors,
+		requests / elapsed,
+		bytes / elapsed / (1024 * 1024),
+		bench_percentile(latencies, count, 500),
+		bench_percentile(latencies, count, 990),
+		bench_percentile(latencies, count, 999));
+	fflush(stdout);
+	rc = 0;
+out:
+	for (i = 0; i < bench->clients; i++) {
+		free(clients[i].latencies);
+		free(clients[i].buffer);
+	}
+	free(latencies);
+	free(clients);
+	return rc;
+}
+
+int main (int argc, char *argv[])
+{
+	int opt;
+	int rc;
+	int opt_index;
+	unsigned int i;
+	char *tok;
+	char *save;
+	char *workload;
+	int workloads[BENCH_WORKLOADS];
+	bench_t *bench;
+	gena_t *gena;
+	gena_config_t config;
+	gena_callbacks_t callbacks;
+
+	bench = (bench_t *) malloc(sizeof(bench_t));
+	if (bench == NULL) {
+		return -1;
+	}
+	memset(bench, 0, sizeof(bench_t));
+	memset(&config, 0, sizeof(gena_config_t));
+	bench->clients = BENCH_CLIENTS;
+	bench->time = BENCH_TIME;
+	bench->size = BENCH_SIZE;
+	bench->browse = BENCH_BROWSE;
+	bench->range = BENCH_RANGE;
+	workload = NULL;
+	opt_index = 0;
+
+	while ((opt = getopt_long(argc, argv, "hvc:t:w:m:s:b:r:f:", bench_options, &opt_index)) != -1) {
+		switch (opt) {
+			case 'c': bench->clients = strtoul(optarg, NULL, 10); break;
+			case 't': bench->time = strtoul(optarg, NULL, 10); break;
+			case 'w': workload = optarg; break;
+			case 's': bench->size = strtoull(optarg, NULL, 10); break;
+			case 'b': bench->browse = strtoul(optarg, NULL, 10); break;
+			case 'r': bench->range = strtoul(optarg, NULL, 10); break;
+			case 'f': bench->file = optarg; break;
+			case 'v': platform_debug = 1; break;
+			case 'm':
+				if (strcmp(optarg, "reactor") == 0) {
+					config.mode = GENA_MODE_REACTOR;
+				} else if (strcmp(optarg, "thread") == 0) {
+					config.mode = GENA_MODE_THREAD;
+				} else {
+					bench_help(argv[0]);
+					free(bench);
+					return -1;
+				}
+				break;
+			case 'h':
+			default:
+				bench_help(argv[0]);
+				free(bench);
+				return 0;
+		}
+	}
+	if (bench->clients == 0 || bench->time == 0 || bench->range == 0) {
+		bench_help(argv[0]);
+		free(bench);
+		return -1;
+	}
+
+	for (i = 0; i < BENCH_WORKLOADS; i++) {
+		workloads[i] = (workload == NULL) ? 1 : 0;
+	}
+	if (workload != NULL) {
+		workload = strdup(workload);
+		for (tok = strtok_r(workload, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+			for (i = 0; i < BENCH_WORKLOADS; i++) {
+				if (strcmp(tok, bench_workload_names[i]) == 0) {
+					workloads[i] = 1;
+					break;
+				}
+			}
+			if (i == BENCH_WORKLOADS) {
+				fprintf(stderr, "unknown workload '%s'\n", tok);
+				free(workload);
+				free(bench);
+				return -1;
+			}
+		}
+		free(workload);
+	}
+
+	if (platform_init() < 0) {
+		debugf(_DBG, "platform init failed");
+		free(bench);
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < BENCH_BUFFER; i++) {
+		bench->pattern[i] = 'a' + (i % 26);
+	}
+	bench->response = bench_response(bench->browse);
+	if (bench->response == NULL) {
+		platform_uninit();
+		free(bench);
+		return -1;
+	}
+	if (bench->file != NULL) {
+		file_stat_t stat;
+		if (upnpd_file_stat(bench->file, &stat) != 0) {
+			fprintf(stderr, "can not stat '%s'\n", bench->file);
+			free(bench->response);
+			platform_uninit();
+			free(bench);
+			return -1;
+		}
+		bench->size = stat.size;
+	}
+
+	/* every client holds a worker in thread mode, leave room for the rest */
+	config.workers = bench->clients + BENCH_SPARE_WORKERS;
+	config.streams = bench->clients;
+	memset(&callbacks, 0, sizeof(gena_callbacks_t));
+	callbacks.vfs.info = bench_vfsinfo;
+	callbacks.vfs.open = bench_vfsopen;
+	callbacks.vfs.read = bench_vfsread;
+	callbacks.vfs.write = bench_vfswrite;
+	callbacks.vfs.seek = bench_vfsseek;
+	callbacks.vfs.close = bench_vfsclose;
+	callbacks.vfs.fd = bench_vfsfd;
+	callbacks.vfs.cookie = bench;
+	callbacks.gena.event = bench_event;
+	callbacks.gena.cookie = bench;
+
+	gena = upnpd_upnp_gena_init(BENCH_ADDRESS, 0, &callbacks, &config);
+	if (gena == NULL) {
+		fprintf(stderr, "can not start gena server\n");
+		free(bench->response);
+		platform_uninit();
+		free(bench);
+		return -1;
+	}
+	bench->port = upnpd_upnp_gena_getport(gena);
+
+	printf("gena server on %s:%u, %s mode, %u clients, %u seconds per workload\n",
+		BENCH_ADDRESS, bench->port, (config.mode == GENA_MODE_REACTOR) ? "reactor" : "thread", bench->clients, bench->time);
+	printf("%-10s %7s %10s %8s %11s %9s %9s %9s %9s\n",
+		"workload", "clients", "requests", "errors", "req/s", "MB/s", "p50 ms", "p99 ms", "p999 ms");
+	rc = 0;
+	for (i = 0; i < BENCH_WORKLOADS; i++) {
+		if (workloads[i] == 1 && bench_run(bench, i) != 0) {
+			rc = -1;
+		}
+	}
+
+	upnpd_upnp_gena_uninit(gena);
+	free(bench->response);
+	platform_uninit();
+	free(bench);
+	return rc;
+}
@@ -0,0 +1,363 @@
+/*
+ * microbenchmark of the response builders. a browse response with a large
+ * escaped Result and a propertyset with many variables are built with the
+ * former asprintf / strcat code and with the string builder, and the time
+ * of one build is reported for both.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+
+#define BENCH_RESULT		(1024 * 200)
+#define BENCH_VARIABLES		32
+#define BENCH_ITERATIONS	200
+
+typedef struct bench_node_s {
+	const char *variable;
+	const char *value;
+} bench_node_t;
+
+static const char *bench_envelope_head =
+	"<s:Envelope "
+	"xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+	"<s:Body>\n";
+
+static const char *bench_envelope_tail =
+	"</s:Body>\n"
+	"</s:Envelope>\n";
+
+static const char *bench_service = "urn:schemas-upnp-org:service:ContentDirectory:1";
+
+static const struct option bench_options[] = {
+	{ "help",       no_argument,       0, 'h' },
+	{ "result",     required_argument, 0, 's' },
+	{ "variables",  required_argument, 0, 'n' },
+	{ "iterations", required_argument, 0, 'i' },
+	{ 0, 0, 0, 0 },
+};
+
+static void bench_usage (const char *name)
+{
+	printf("%s [options]\n"
+	       "  -s, --result <bytes>    size of the browse Result (default: %d)\n"
+	       "  -n, --variables <count> variables of the propertyset (default: %d)\n"
+	       "  -i, --iterations <n>    builds per measurement (default: %d)\n"
+	       "  -h, --help              this text\n",
+	       name, BENCH_RESULT, BENCH_VARIABLES, BENCH_ITERATIONS);
+}
+
+/* the former escaping, counts and then copies */
+static char * bench_escape_old (const char *p)
+{
+	int i;
+	int j;
+	int plen;
+	int dlen;
+	char *buf;
+	dlen = 0;
+	plen = strlen(p);
+	for (i = 0; i < plen; i++) {
+		switch (p[i]) {
+			case '<':  dlen += 4; break;
+			case '>':  dlen += 4; break;
+			case '&':  dlen += 5; break;
+			case '\'': dlen += 6; break;
+			case '\"': dlen += 6; break;
+			default:   dlen += 1; break;
+		}
+	}
+	buf = (char *) malloc(dlen + 1);
+	if (buf == NULL) {
+		return NULL;
+	}
+	for (j = 0, i = 0; i < plen; i++) {
+		switch (p[i]) {
+			case '<':  memcpy(&buf[j], "&lt;", 4); j += 4; break;
+			case '>':  memcpy(&buf[j], "&gt;", 4); j += 4; break;
+			case '&':  memcpy(&buf[j], "&amp;", 5); j += 5; break;
+			case '\'': memcpy(&buf[j], "&apos;", 6); j += 6; break;
+			case '\"': memcpy(&buf[j], "&quot;", 6); j += 6; break;
+			default:   buf[j++] = p[i]; break;
+		}
+	}
+	buf[j] = '\0';
+	return buf;
+}
+
+static char * bench_escape_new (const char *p)
+{
+	strbuf_t buf;
+	upnpd_strbuf_init(&buf, upnpd_strbuf_escape_length(p));
+	upnpd_strbuf_escape(&buf, p);
+	return upnpd_strbuf_detach(&buf);
+}
+
+/* the former action response, the whole response is printed again for
+ * every output argument and once more into the envelope */
+static char * bench_action_old (const char *action, bench_node_t *nodes, unsigned int count)
+{
+	char *tmp;
+	char *body;
+	char *envelope;
+	unsigned int i;
+	if (asprintf(&body, "<u:%sResponse xmlns:u=\"%s\">\n", action, bench_service) < 0) {
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		if (asprintf(&tmp, "%s<%s>%s</%s>\n", body, nodes[i].variable, nodes[i].value, nodes[i].variable) < 0) {
+			free(body);
+			return NULL;
+		}
+		free(body);
+		body = tmp;
+	}
+	if (asprintf(&tmp, "%s</u:%sResponse>", body, action) < 0) {
+		free(body);
+		return NULL;
+	}
+	free(body);
+	if (asprintf(&envelope, "%s%s%s", bench_envelope_head, tmp, bench_envelope_tail) < 0) {
+		envelope = NULL;
+	}
+	free(tmp);
+	return envelope;
+}
+
+static char * bench_action_new (const char *action, bench_node_t *nodes, unsigned int count)
+{
+	strbuf_t buf;
+	unsigned int i;
+	unsigned int size;
+	size = strlen(bench_envelope_head) + strlen(bench_envelope_tail);
+	size += strlen("<u:Response xmlns:u=\"\">\n</u:Response>") + 2 * strlen(action) + strlen(bench_service);
+	for (i = 0; i < count; i++) {
+		size += strlen("<></>\n") + 2 * strlen(nodes[i].variable) + strlen(nodes[i].value);
+	}
+	upnpd_strbuf_init(&buf, size);
+	upnpd_strbuf_append(&buf, bench_envelope_head);
+	upnpd_strbuf_printf(&buf, "<u:%sResponse xmlns:u=\"%s\">\n", action, bench_service);
+	for (i = 0; i < count; i++) {
+		upnpd_strbuf_append(&buf, "<");
+		upnpd_strbuf_append(&buf, nodes[i].variable);
+		upnpd_strbuf_append(&buf, ">");
+		upnpd_strbuf_append(&buf, nodes[i].value);
+		upnpd_strbuf_append(&buf, "</");
+		upnpd_strbuf_append(&buf, nodes[i].variable);
+		upnpd_strbuf_append(&buf, ">\n");
+	}
+	upnpd_strbuf_printf(&buf, "</u:%sResponse>", action);
+	upnpd_strbuf_append(&buf, bench_envelope_tail);
+	return upnpd_strbuf_detach(&buf);
+}
+
+/* the former propertyset, every append walks the buffer for its end */
+static char * bench_propertyset_old (const char **names, const char **values, unsigned int count)
+{
+	char *buffer;
+	unsigned int i;
+	unsigned int size;
+	size = strlen("<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">") + strlen("</e:propertyset>\n\n");
+	for (i = 0; i < count; i++) {
+		size += strlen("<e:property></e:property>") + 2 * strlen(names[i]) + strlen(values[i]) + strlen("<></>");
+	}
+	buffer = (char *) malloc(size + 1);
+	if (buffer == NULL) {
+		return NULL;
+	}
+	strcpy(buffer, "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">");
+	for (i = 0; i < count; i++) {
+		strcat(buffer, "<e:property>");
+		sprintf(&buffer[strlen(buffer)], "<%s>%s</%s></e:property>", names[i], values[i], names[i]);
+	}
+	strcat(buffer, "</e:propertyset>\n\n");
+	return buffer;
+}
+
+static char * bench_propertyset_new (const char **names, const char **values, unsigned int count)
+{
+	strbuf_t buf;
+	unsigned int i;
+	unsigned int size;
+	size = strlen("<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">") + strlen("</e:propertyset>\n\n");
+	for (i = 0; i < count; i++) {
+		size += strlen("<e:property><></></e:property>") + 2 * strlen(names[i]) + strlen(values[i]);
+	}
+	upnpd_strbuf_init(&buf, size);
+	upnpd_strbuf_append(&buf, "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">");
+	for (i = 0; i < count; i++) {
+		upnpd_strbuf_append(&buf, "<e:property><");
+		upnpd_strbuf_append(&buf, names[i]);
+		upnpd_strbuf_append(&buf, ">");
+		upnpd_strbuf_append(&buf, values[i]);
+		upnpd_strbuf_append(&buf, "</");
+		upnpd_strbuf_append(&buf, names[i]);
+		upnpd_strbuf_append(&buf, "></e:property>");
+	}
+	upnpd_strbuf_append(&buf, "</e:propertyset>\n\n");
+	return upnpd_strbuf_detach(&buf);
+}
+
+/* a didl-lite like text, one in eight characters needs an entity */
+static char * bench_result (unsigned int size)
+{
+	char *result;
+	unsigned int i;
+	const char *pattern = "<item id=\"0$1\">&title</item>";
+	result = (char *) malloc(size + 1);
+	if (result == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < size; i++) {
+		result[i] = pattern[i % strlen(pattern)];
+	}
+	result[size] = '\0';
+	return result;
+}
+
+static int bench_action (const char *result, unsigned int iterations, int old, unsigned int *length)
+{
+	char *value;
+	char *response;
+	unsigned int i;
+	bench_node_t nodes[4];
+	for (i = 0; i < iterations; i++) {
+		value = (old == 1) ? bench_escape_old(result) : bench_escape_new(result);
+		if (value == NULL) {
+			return -1;
+		}
+		nodes[0].variable = "Result";
+		nodes[0].value = value;
+		nodes[1].variable = "NumberReturned";
+		nodes[1].value = "100";
+		nodes[2].variable = "TotalMatches";
+		nodes[2].value = "100";
+		nodes[3].variable = "UpdateID";
+		nodes[3].value = "0";
+		response = (old == 1) ? bench_action_old("Browse", nodes, 4) : bench_action_new("Browse", nodes, 4);
+		free(value);
+		if (response == NULL) {
+			return -1;
+		}
+		*length = strlen(response);
+		free(response);
+	}
+	return 0;
+}
+
+static int bench_propertyset (const char **names, const char **values, unsigned int count, unsigned int iterations, int old, unsigned int *length)
+{
+	char *propset;
+	unsigned int i;
+	for (i = 0; i < iterations; i++) {
+		propset = (old == 1) ? bench_propertyset_old(names, values, count) : bench_propertyset_new(names, values, count);
+		if (propset == NULL) {
+			return -1;
+		}
+		*length = strlen(propset);
+		free(propset);
+	}
+	return 0;
+}
+
+static void bench_report (const char *name, unsigned long long elapsed[2], unsigned int length[2], unsigned int iterations)
+{
+	printf("%-12s %8u bytes  asprintf/strcat %10.2f us  strbuf %10.2f us  speedup %5.2fx%s\n",
+	       name,
+	       length[1],
+	       (double) elapsed[0] / iterations,
+	       (double) elapsed[1] / iterations,
+	       (elapsed[1] > 0) ? (double) elapsed[0] / elapsed[1] : 0.0,
+	       (length[0] != length[1]) ? "  (length mismatch)" : "");
+}
+
+int main (int argc, char *argv[])
+{
+	int c;
+	int opt;
+	int opt_index;
+	char *result;
+	char **names;
+	char **values;
+	unsigned int i;
+	unsigned int size;
+	unsigned int count;
+	unsigned int iterations;
+	unsigned int length[2];
+	unsigned long long start;
+	unsigned long long elapsed[2];
+
+	size = BENCH_RESULT;
+	count = BENCH_VARIABLES;
+	iterations = BENCH_ITERATIONS;
+	while ((opt = getopt_long(argc, argv, "hs:n:i:", bench_options, &opt_index)) != -1) {
+		switch (opt) {
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'i':
+				iterations = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				bench_usage(argv[0]);
+				return (opt == 'h') ? 0 : -1;
+		}
+	}
+	if (iterations == 0) {
+		bench_usage(argv[0]);
+		return -1;
+	}
+
+	result = bench_result(size);
+	names = (char **) malloc(sizeof(char *) * (count + 1));
+	values = (char **) malloc(sizeof(char *) * (count + 1));
+	if (result == NULL || names == NULL || values == NULL) {
+		printf("out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (asprintf(&names[i], "StateVariable%u", i) < 0 ||
+		    asprintf(&values[i], "value of state variable number %u", i) < 0) {
+			printf("out of memory\n");
+			return -1;
+		}
+	}
+
+	for (c = 0; c < 2; c++) {
+		start = upnpd_time_monotonic();
+		if (bench_action(result, iterations, (c == 0) ? 1 : 0, &length[c]) != 0) {
+			printf("action build failed\n");
+			return -1;
+		}
+		elapsed[c] = upnpd_time_monotonic() - start;
+	}
+	bench_report("action", elapsed, length, iterations);
+
+	for (c = 0; c < 2; c++) {
+		start = upnpd_time_monotonic();
+		if (bench_propertyset((const char **) names, (const char **) values, count, iterations, (c == 0) ? 1 : 0, &length[c]) != 0) {
+			printf("propertyset build failed\n");
+			return -1;
+		}
+		elapsed[c] = upnpd_time_monotonic() - start;
+	}
+	bench_report("propertyset", elapsed, length, iterations);
+
+	for (i = 0; i < count; i++) {
+		free(names[i]);
+		free(values[i]);
+	}
+	free(names);
+	free(values);
+	free(result);
+	return 0;
+}
@@ -483,7 +483,7 @@ int upnpd_client_init (client_t *client)
 	debugf(_DBG, "initializing devices list");
 	list_init(&client->devices);
 	debugf(_DBG, "initializing upnp stack");
-	upnp = upnpd_upnp_init(client->ipaddr, client->ifmask, 0, NULL, NULL);
+	upnp = upnpd_upnp_init(client->ipaddr, client->ifmask, 0, NULL, NULL, NULL);
 	if (upnp == NULL) {
 		debugf(_DBG, "upnpd_upnp_init() failed");
 		upnpd_thread_cond_destroy(client->cond);
@@ -36,6 +36,7 @@ typedef struct icon_s icon_t;
 typedef struct device_service_s device_service_t;
 typedef struct service_action_s service_action_t;
 typedef struct service_variable_s service_variable_t;
+typedef struct device_route_s device_route_t;
 
 typedef enum {
 	RENDER_STATE_UNKNOWN,
@@ -63,6 +64,8 @@ struct upnp_file_s {
 	off_t offset;
 	/** virtual buffer, only for virtual files */
 	void *buf;
+	/** in memory copy, only for files served from service cache */
+	void *cache;
 };
 
 /**
@@ -315,6 +318,13 @@ typedef struct action_argument_s {
 	char *relatedstatevariable;
 } action_argument_t;
 
+/** action concurrency
+  */
+typedef enum {
+	ACTION_SERIALIZED,
+	ACTION_CONCURRENT,
+} action_concurrency_t;
+
 /** service action struct
   */
 struct service_action_s {
@@ -324,6 +334,8 @@ struct service_action_s {
 	action_argument_t *arguments;
         /** */
 	int (*function) (device_service_t *service, upnp_event_action_t *request);
+	/** concurrent actions may run in parallel, they must only read service state */
+	action_concurrency_t concurrency;
 };
 
 typedef enum {
@@ -353,6 +365,10 @@ struct service_variable_s {
 	char *defaultvalue;
 	/** */
 	char *value;
+	/** event moderation, miliseconds between events, 0 for no limit */
+	unsigned int maxrate;
+	/** event moderation, numeric change needed for an event, 0 for any */
+	unsigned int mindelta;
 };
 
 /** client variable struct
@@ -465,8 +481,10 @@ struct device_service_s {
 	/** */
 	int (*uninit) (device_service_t *service);
 
-        /** */
-	thread_mutex_t *mutex;
+	/** shared by concurrent actions, exclusive for the others */
+	thread_rwlock_t *rwlock;
+	/** action names to actions, built at init */
+	strmap_t *actionmap;
 	/** */
 	char *description;
 	/** */
@@ -510,8 +528,15 @@ struct device_s {
 	/** */
 	device_service_t **services;
 
+	/** services, icons and description are not changed after init,
+	  * taken exclusive only to tear them down */
+	thread_rwlock_t *rwlock;
+	/** scpd, icon and stats urls to fake files, built at init */
+	strmap_t *paths;
 	/** */
-	thread_mutex_t *mutex;
+	device_route_t *routes;
+	/** service ids to services, built at init */
+	strmap_t *serviceids;
 	/** */
 	char *ipaddress;
 	/** */
@@ -524,6 +549,10 @@ struct device_s {
 	char *description;
 	/** */
 	int daemonize;
+	/** gena http server configuration */
+	gena_config_t genaconfig;
+	/** modification time of generated files, in seconds */
+	unsigned long long timestamp;
 
 	/** */
 	upnp_t *upnp;
@@ -569,7 +598,8 @@ char * upnpd_entry_to_result (device_service_t *service, entry_t *entry, int met
 
 /* contentdir.c */
 
-device_service_t * upnpd_contentdirectory_init (const char *directory, int cached, int transcode, const char *fontfile, const char *codepage);
+device_service_t * upnpd_contentdirectory_init (const char *directory, int cached, int transcode, const char *fontfile, const char *codepage, int memcache, int memcachefile);
+int upnpd_contentdirectory_refresh (device_service_t *contentdir);
 
 /* connection.c */
 
@@ -603,6 +633,7 @@ device_service_t * upnpd_registrar_init (void);
 int upnpd_service_init (device_service_t *service);
 int upnpd_service_uninit (device_service_t *service);
 service_variable_t * upnpd_service_variable_find (device_service_t *service, char *name);
+int upnpd_service_variable_set (device_service_t *service, char *name, const char *value);
 service_action_t * upnpd_service_action_find (device_service_t *service, char *name);
 
 /* upnp.c */
@@ -40,6 +40,52 @@
 #include "upnp.h"
 #include "common.h"
 
+#define CONTENTDIR_CACHE_SIZE		(1024 * 1024 * 16)
+#define CONTENTDIR_CACHE_FILE		(1024 * 256)
+#define CONTENTDIR_CACHE_BUCKETS	256
+
+/**
+  */
+typedef struct contentdir_cache_entry_s {
+	/** least recently used order, most recent first */
+	list_t head;
+	/** hash bucket chain */
+	list_t bucket;
+	/** */
+	char *id;
+	/** */
+	char *path;
+	/** */
+	char *mimetype;
+	/** */
+	unsigned long long mtime;
+	/** */
+	unsigned long long size;
+	/** */
+	char *data;
+	/** references of cache and open files, freed with the last one */
+	unsigned int refcount;
+	/** */
+	int evicted;
+} contentdir_cache_entry_t;
+
+/**
+  */
+typedef struct contentdir_cache_s {
+	/** byte budget, 0 disables cache */
+	unsigned long long limit;
+	/** largest file size kept */
+	unsigned long long threshold;
+	/** */
+	unsigned long long size;
+	/** */
+	list_t lru;
+	/** */
+	list_t buckets[CONTENTDIR_CACHE_BUCKETS];
+	/** */
+	thread_mutex_t *mutex;
+} contentdir_cache_t;
+
 /**
   */
 typedef struct contentdir_s {
@@ -59,6 +105,8 @@ typedef struct contentdir_s {
 	char *fontfile;
 	/** */
 	char *codepage;
+	/** small hot files served from memory */
+	contentdir_cache_t cache;
 } contentdir_t;
 
 static int contentdirectory_get_search_capabilities (device_service_t *service, upnp_event_action_t *request)
@@ -457,11 +505,11 @@ static action_argument_t arguments_search[] = {
 
 static service_action_t contentdirectory_actions[] = {
 	/* required */
-	{"GetSearchCapabilities", arguments_get_search_capabilities, contentdirectory_get_search_capabilities},
-	{"GetSortCapabilities", arguments_get_sort_capabilities, contentdirectory_get_sort_capabilities},
-	{"GetSystemUpdateID", arguments_get_system_update_id, contentdirectory_get_system_update_id},
-	{"Browse", arguments_browse, contentdirectory_browse},
-	{"Search", arguments_search, contentdirectory_search},
+	{"GetSearchCapabilities", arguments_get_search_capabilities, contentdirectory_get_search_capabilities, ACTION_CONCURRENT},
+	{"GetSortCapabilities", arguments_get_sort_capabilities, contentdirectory_get_sort_capabilities, ACTION_CONCURRENT},
+	{"GetSystemUpdateID", arguments_get_system_update_id, contentdirectory_get_system_update_id, ACTION_CONCURRENT},
+	{"Browse", arguments_browse, contentdirectory_browse, ACTION_CONCURRENT},
+	{"Search", arguments_search, contentdirectory_search, ACTION_CONCURRENT},
 	{ NULL },
 };
 
@@ -947,6 +995,198 @@ static int contentdirectory_istranscode (const char *title)
 	return -1;
 }
 
+static unsigned int contentdirectory_cache_hash (const char *id)
+{
+	unsigned int hash;
+	hash = 5381;
+	while (*id != '\0') {
+		hash = ((hash << 5) + hash) + (unsigned char) *id++;
+	}
+	return hash % CONTENTDIR_CACHE_BUCKETS;
+}
+
+static void contentdirectory_cache_free (contentdir_cache_entry_t *entry)
+{
+	free(entry->id);
+	free(entry->path);
+	free(entry->mimetype);
+	free(entry->data);
+	free(entry);
+}
+
+/* drops reference, cache mutex should be held */
+static void contentdirectory_cache_unref (contentdir_cache_entry_t *entry)
+{
+	if (--entry->refcount == 0) {
+		contentdirectory_cache_free(entry);
+	}
+}
+
+/* removes entry from cache without dropping reference of cache, cache mutex should be held */
+static void contentdirectory_cache_unlink (contentdir_cache_t *cache, contentdir_cache_entry_t *entry)
+{
+	entry->evicted = 1;
+	list_del(&entry->head);
+	list_del(&entry->bucket);
+	cache->size -= entry->size;
+}
+
+/* returns referenced entry and marks it most recently used */
+static contentdir_cache_entry_t * contentdirectory_cache_get (contentdir_cache_t *cache, const char *id)
+{
+	contentdir_cache_entry_t *entry;
+	if (cache->limit == 0) {
+		return NULL;
+	}
+	upnpd_thread_mutex_lock(cache->mutex);
+	list_for_each_entry(entry, &cache->buckets[contentdirectory_cache_hash(id)], bucket, contentdir_cache_entry_t) {
+		if (strcmp(entry->id, id) == 0) {
+			list_del(&entry->head);
+			list_add(&entry->head, &cache->lru);
+			entry->refcount++;
+			upnpd_thread_mutex_unlock(cache->mutex);
+			return entry;
+		}
+	}
+	upnpd_thread_mutex_unlock(cache->mutex);
+	return NULL;
+}
+
+static void contentdirectory_cache_put (contentdir_cache_t *cache, contentdir_cache_entry_t *entry)
+{
+	upnpd_thread_mutex_lock(cache->mutex);
+	contentdirectory_cache_unref(entry);
+	upnpd_thread_mutex_unlock(cache->mutex);
+}
+
+/* reads whole file into a new entry, evicting least recently used ones to stay in budget */
+static void contentdirectory_cache_add (contentdir_cache_t *cache, const char *id, entry_t *didl, file_t *file)
+{
+	int rc;
+	unsigned long long size;
+	file_stat_t stat;
+	contentdir_cache_entry_t *entry;
+	contentdir_cache_entry_t *evict;
+
+	if (cache->limit == 0 ||
+	    upnpd_file_stat(didl->path, &stat) != 0 ||
+	    stat.size == 0 || stat.size > cache->threshold || stat.size > cache->limit) {
+		return;
+	}
+	entry = (contentdir_cache_entry_t *) malloc(sizeof(contentdir_cache_entry_t));
+	if (entry == NULL) {
+		return;
+	}
+	memset(entry, 0, sizeof(contentdir_cache_entry_t));
+	entry->id = strdup(id);
+	entry->path = strdup(didl->path);
+	entry->mimetype = strdup(didl->mime);
+	entry->data = (char *) malloc(stat.size);
+	entry->mtime = stat.mtime;
+	entry->size = stat.size;
+	entry->refcount = 1;
+	if (entry->id == NULL || entry->path == NULL || entry->mimetype == NULL || entry->data == NULL) {
+		contentdirectory_cache_free(entry);
+		return;
+	}
+	for (size = 0; size < entry->size; size += rc) {
+		rc = upnpd_file_read(file, entry->data + size, entry->size - size);
+		if (rc <= 0) {
+			break;
+		}
+	}
+	/* file is served from its start either way */
+	upnpd_file_seek(file, 0, FILE_SEEK_SET);
+	if (size != entry->size) {
+		debugf(_DBG, "reading '%s' failed, not cached", didl->path);
+		contentdirectory_cache_free(entry);
+		return;
+	}
+
+	upnpd_thread_mutex_lock(cache->mutex);
+	list_for_each_entry(evict, &cache->buckets[contentdirectory_cache_hash(id)], bucket, contentdir_cache_entry_t) {
+		if (strcmp(evict->id, id) == 0) {
+			/* added by a concurrent request */
+			upnpd_thread_mutex_unlock(cache->mutex);
+			contentdirectory_cache_free(entry);
+			return;
+		}
+	}
+	while (cache->size + entry->size > cache->limit) {
+		/* open files keep evicted entries alive */
+		evict = list_entry(cache->lru.prev, contentdir_cache_entry_t, head);
+		contentdirectory_cache_unlink(cache, evict);
+		contentdirectory_cache_unref(evict);
+	}
+	list_add(&entry->head, &cache->lru);
+	list_add(&entry->bucket, &cache->buckets[contentdirectory_cache_hash(id)]);
+	cache->size += entry->size;
+	upnpd_thread_mutex_unlock(cache->mutex);
+	debugf(_DBG, "cached '%s', %llu bytes", didl->path, entry->size);
+}
+
+/* fills info of a cached file, entry is dropped if file changed on disk
+ * or is no longer readable */
+static int contentdirectory_cache_info (contentdir_cache_t *cache, const char *id, gena_fileinfo_t *info)
+{
+	int rc;
+	file_stat_t stat;
+	contentdir_cache_entry_t *entry;
+	entry = contentdirectory_cache_get(cache, id);
+	if (entry == NULL) {
+		return -1;
+	}
+	rc = -1;
+	if (upnpd_file_access(entry->path, FILE_MODE_READ) == 0 &&
+	    upnpd_file_stat(entry->path, &stat) == 0 &&
+	    stat.mtime == entry->mtime &&
+	    stat.size == entry->size) {
+		info->size = entry->size;
+		info->mtime = entry->mtime;
+		info->mimetype = strdup(entry->mimetype);
+		rc = 0;
+	}
+	upnpd_thread_mutex_lock(cache->mutex);
+	if (rc != 0 && entry->evicted == 0) {
+		debugf(_DBG, "'%s' changed or not readable, dropping from cache", entry->path);
+		contentdirectory_cache_unlink(cache, entry);
+		/* reference of cache, ours is dropped below */
+		entry->refcount--;
+	}
+	contentdirectory_cache_unref(entry);
+	upnpd_thread_mutex_unlock(cache->mutex);
+	return rc;
+}
+
+static void contentdirectory_cache_init (contentdir_cache_t *cache, int limit, int threshold)
+{
+	int i;
+	memset(cache, 0, sizeof(contentdir_cache_t));
+	cache->limit = (limit < 0) ? CONTENTDIR_CACHE_SIZE : (unsigned long long) limit * 1024;
+	cache->threshold = (threshold < 0) ? CONTENTDIR_CACHE_FILE : (unsigned long long) threshold * 1024;
+	list_init(&cache->lru);
+	for (i = 0; i < CONTENTDIR_CACHE_BUCKETS; i++) {
+		list_init(&cache->buckets[i]);
+	}
+	cache->mutex = upnpd_thread_mutex_init("contentdir->cache.mutex", 0);
+}
+
+static void contentdirectory_cache_uninit (contentdir_cache_t *cache)
+{
+	contentdir_cache_entry_t *entry;
+	contentdir_cache_entry_t *next;
+	if (cache->mutex == NULL) {
+		return;
+	}
+	upnpd_thread_mutex_lock(cache->mutex);
+	list_for_each_entry_safe(entry, next, &cache->lru, head, contentdir_cache_entry_t) {
+		contentdirectory_cache_unlink(cache, entry);
+		contentdirectory_cache_unref(entry);
+	}
+	upnpd_thread_mutex_unlock(cache->mutex);
+	upnpd_thread_mutex_destroy(cache->mutex);
+}
+
 static int contentdirectory_vfsgetinfo (void *cookie, char *path, gena_fileinfo_t *info)
 {
 	char *ptr;
@@ -966,6 +1206,10 @@ static int contentdirectory_vfsgetinfo (void *cookie, char *path, gena_fileinfo_
 		*ptr = '\0';
 	}
 	debugf(_DBG, "entry name is '%s'", ename);
+	if (contentdirectory_cache_info(&contentdir->cache, ename, info) == 0) {
+		debugf(_DBG, "serving from cache '%s'", ename);
+		return 0;
+	}
 	entry = upnpd_entry_didl_from_id(contentdir->database, ename);
 	if (entry == NULL) {
 		debugf(_DBG, "no entry found '%s'", ename);
@@ -979,7 +1223,7 @@ static int contentdirectory_vfsgetinfo (void *cookie, char *path, gena_fileinfo_
 	debugf(_DBG, "checking file: '%s'", entry->path);
 	if (upnpd_file_access(entry->path, FILE_MODE_READ) == 0 &&
 	    upnpd_file_stat(entry->path, &stat) == 0) {
-		info->size = entry->didl.res.size;
+		info->size = (info->seekable == -1) ? GENA_FILESIZE_UNKNOWN : entry->didl.res.size;
 		info->mtime = stat.mtime;
 		info->mimetype = strdup(entry->mime);
 		upnpd_entry_uninit(entry);
@@ -993,6 +1237,7 @@ static int contentdirectory_vfsgetinfo (void *cookie, char *path, gena_fileinfo_
 static void * contentdirectory_vfsopen (void *cookie, char *path, gena_filemode_t mode)
 {
 	entry_t *entry;
+	contentdir_cache_entry_t *cache;
 	upnp_file_t *file;
 	const char *ename;
 	contentdir_t *contentdir;
@@ -1004,6 +1249,20 @@ static void * contentdirectory_vfsopen (void *cookie, char *path, gena_filemode_
 	}
 	ename = path + strlen("/upnp/contentdirectory?id=");
 	debugf(_DBG, "entry name is '%s'", ename);
+	cache = contentdirectory_cache_get(&contentdir->cache, ename);
+	if (cache != NULL) {
+		file = (upnp_file_t *) malloc(sizeof(upnp_file_t));
+		if (file == NULL) {
+			debugf(_DBG, "malloc failed");
+			contentdirectory_cache_put(&contentdir->cache, cache);
+			return NULL;
+		}
+		memset(file, 0, sizeof(upnp_file_t));
+		file->cache = cache;
+		file->size = cache->size;
+		file->service = &contentdir->service;
+		return file;
+	}
 	entry = upnpd_entry_didl_from_id(contentdir->database, ename);
 	if (entry == NULL) {
 		debugf(_DBG, "no entry found '%s'", ename);
@@ -1060,6 +1319,8 @@ static void * contentdirectory_vfsopen (void *cookie, char *path, gena_filemode_
 			upnpd_entry_uninit(entry);
 			return NULL;
 		}
+		/* first request is served from disk, next ones from memory */
+		contentdirectory_cache_add(&contentdir->cache, ename, entry, file->file);
 	}
 	file->service = &contentdir->service;
 	upnpd_entry_uninit(entry);
@@ -1074,7 +1335,12 @@ static int contentdirectory_vfsread (void *cookie, void *handle, char *buffer, u
 	debugf(_DBG, "contentdirectory_vfsread: %u", length);
 	file = (upnp_file_t *) handle;
 	contentdir = (contentdir_t *) cookie;
-	if (file->transcode == 1) {
+	if (file->cache != NULL) {
+		contentdir_cache_entry_t *cache;
+		cache = (contentdir_cache_entry_t *) file->cache;
+		i = MIN((unsigned long long) length, cache->size - file->offset);
+		memcpy(buffer, cache->data + file->offset, i);
+	} else if (file->transcode == 1) {
 #if defined(ENABLE_TRANSCODE)
 		int l;
 		transcode_t *transcode;
@@ -1123,6 +1389,15 @@ static unsigned long long contentdirectory_vfsseek (void *cookie, void *handle,
 	debugf(_DBG, "contentdirectory_vfsseek");
 	file = (upnp_file_t *) handle;
 	contentdir = (contentdir_t *) cookie;
+	if (file->cache != NULL) {
+		switch (whence) {
+			case GENA_SEEK_SET: break;
+			case GENA_SEEK_CUR: offset += file->offset; break;
+			case GENA_SEEK_END: offset += file->size; break;
+		}
+		file->offset = MIN(offset, (unsigned long long) file->size);
+		return file->offset;
+	}
 	if (file->transcode == 1) {
 #if defined(ENABLE_TRANSCODE)
 		transcode_t *transcode;
@@ -1151,7 +1426,9 @@ static int contentdirectory_vfsclose (void *cookie, void *handle)
 	debugf(_DBG, "contentdirectory_vfsclose");
 	file = (upnp_file_t *) handle;
 	contentdir = (contentdir_t *) cookie;
-	if (file->transcode == 1) {
+	if (file->cache != NULL) {
+		contentdirectory_cache_put(&contentdir->cache, (contentdir_cache_entry_t *) file->cache);
+	} else if (file->transcode == 1) {
 #if defined(ENABLE_TRANSCODE)
 		contentdirectory_stoptranscode((transcode_t *) file->buf);
 #endif
@@ -1162,6 +1439,19 @@ static int contentdirectory_vfsclose (void *cookie, void *handle)
 	return 0;
 }
 
+static int contentdirectory_vfsfd (void *cookie, void *handle, unsigned long long *offset)
+{
+	upnp_file_t *file;
+	debugf(_DBG, "contentdirectory_vfsfd");
+	file = (upnp_file_t *) handle;
+	if (file->transcode == 1 || file->file == NULL) {
+		/* transcoded streams are produced on the fly */
+		return -1;
+	}
+	*offset = upnpd_file_seek(file->file, 0, FILE_SEEK_CUR);
+	return upnpd_file_descriptor(file->file);
+}
+
 static gena_callback_vfs_t contentdir_vfscallbacks = {
 	contentdirectory_vfsgetinfo,
 	contentdirectory_vfsopen,
@@ -1169,6 +1459,7 @@ static gena_callback_vfs_t contentdir_vfscallbacks = {
 	contentdirectory_vfswrite,
 	contentdirectory_vfsseek,
 	contentdirectory_vfsclose,
+	contentdirectory_vfsfd,
 };
 
 static int contentdirectory_uninit (device_service_t *contentdir)
@@ -1186,11 +1477,26 @@ static int contentdirectory_uninit (device_service_t *contentdir)
 	}
 	free(((contentdir_t *) contentdir)->fontfile);
 	free(((contentdir_t *) contentdir)->codepage);
+	contentdirectory_cache_uninit(&((contentdir_t *) contentdir)->cache);
 	free(contentdir);
 	return 0;
 }
 
-device_service_t * upnpd_contentdirectory_init (const char *directory, int cached, int transcode, const char *fontfile, const char *codepage)
+int upnpd_contentdirectory_refresh (device_service_t *service)
+{
+	int rc;
+	char str[23];
+	contentdir_t *contentdir;
+	contentdir = (contentdir_t *) service;
+	upnpd_thread_rwlock_wrlock(service->rwlock);
+	contentdir->updateid++;
+	debugf(_DBG, "content directory system update id: %u", contentdir->updateid);
+	rc = upnpd_service_variable_set(service, "SystemUpdateID", upnpd_uint32tostr(str, contentdir->updateid));
+	upnpd_thread_rwlock_unlock(service->rwlock);
+	return rc;
+}
+
+device_service_t * upnpd_contentdirectory_init (const char *directory, int cached, int transcode, const char *fontfile, const char *codepage, int memcache, int memcachefile)
 {
 	contentdir_t *contentdir;
 	service_variable_t *variable;
@@ -1228,10 +1534,13 @@ device_service_t * upnpd_contentdirectory_init (const char *directory, int cache
 	variable = upnpd_service_variable_find(&contentdir->service, "SystemUpdateID");
 	if (variable != NULL) {
 		variable->value = strdup("0");
+		/* moderated to one event per 2 seconds by the content directory spec */
+		variable->maxrate = 2000;
 	}
 	debugf(_DBG, "initializing entry database");
 	contentdir->rootpath = strdup(directory);
 	contentdir->cached = cached;
+	contentdirectory_cache_init(&contentdir->cache, memcache, memcachefile);
 
 #if !defined(ENABLE_TRANSCODE)
 	transcode = 0;
@@ -45,100 +45,131 @@
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
+#define DEVICE_STATS_URL "/upnp/stats"
+
+typedef enum {
+	DEVICE_ROUTE_SCPD,
+	DEVICE_ROUTE_ICON,
+	DEVICE_ROUTE_STATS,
+} device_route_type_t;
+
+struct device_route_s {
+	device_route_type_t type;
+	device_service_t *service;
+	icon_t *icon;
+};
+
+/* called with device->rwlock held */
+static device_route_t * device_route_find (device_t *device, const char *path)
+{
+	device_route_t *route;
+	route = (device_route_t *) upnpd_strmap_find(device->paths, path);
+	if (route != NULL && route->type == DEVICE_ROUTE_STATS && device->upnp == NULL) {
+		return NULL;
+	}
+	return route;
+}
+
 static int device_vfsgetinfo (void *cookie, char *path, gena_fileinfo_t *info)
 {
-	int c;
 	int s;
-	icon_t *icon;
 	device_t *device;
+	device_route_t *route;
 	device_service_t *service;
 	debugf(_DBG, "device vfs get info (%s)", path);
 	device = (device_t *) cookie;
-	upnpd_thread_mutex_lock(device->mutex);
-	/* is fake file */
-	for (s = 0; (service = device->services[s]) != NULL; s++) {
-		if (strcmp(path, service->scpdurl) == 0) {
-			info->size = strlen(service->description);
-			info->mtime = (upnpd_time_gettimeofday() / 1000);
-			info->mimetype = strdup("text/xml");
-			debugf(_DBG, "found service scpd url (%d)", info->size);
-			upnpd_thread_mutex_unlock(device->mutex);
-			return 0;
-		}
-	}
-	/* is icon file */
-	for (c = 0; (icon = &device->icons[c])->url != NULL; c++) {
-		if (strcmp(path, icon->url) == 0) {
-			info->size = icon->size;
-			info->mtime = (upnpd_time_gettimeofday() / 1000);
-			info->mimetype = strdup(icon->mimetype);
-			debugf(_DBG, "found icon url (%d)", info->size);
-			upnpd_thread_mutex_unlock(device->mutex);
-			return 0;
+	upnpd_thread_rwlock_rdlock(device->rwlock);
+	route = device_route_find(device, path);
+	if (route != NULL) {
+		switch (route->type) {
+			case DEVICE_ROUTE_SCPD:
+				info->size = strlen(route->service->description);
+				info->mtime = device->timestamp;
+				info->mimetype = strdup("text/xml");
+				debugf(_DBG, "found service scpd url (%d)", info->size);
+				break;
+			case DEVICE_ROUTE_ICON:
+				info->size = route->icon->size;
+				info->mtime = device->timestamp;
+				info->mimetype = strdup(route->icon->mimetype);
+				debugf(_DBG, "found icon url (%d)", info->size);
+				break;
+			case DEVICE_ROUTE_STATS:
+				/* generated when opened */
+				info->size = GENA_FILESIZE_UNKNOWN;
+				info->mtime = upnpd_time_gettimeofday() / 1000;
+				info->mimetype = strdup("text/plain; version=0.0.4");
+				info->seekable = -1;
+				break;
 		}
+		upnpd_thread_rwlock_unlock(device->rwlock);
+		return 0;
 	}
 	/* check services */
 	for (s = 0; (service = device->services[s]) != NULL; s++) {
 		if (service->vfscallbacks != NULL && service->vfscallbacks->info != NULL) {
 			if (service->vfscallbacks->info(service, path, info) == 0) {
 				debugf(_DBG, "found service file");
-				upnpd_thread_mutex_unlock(device->mutex);
+				upnpd_thread_rwlock_unlock(device->rwlock);
 				return 0;
 			}
 		}
 	}
-	upnpd_thread_mutex_unlock(device->mutex);
+	upnpd_thread_rwlock_unlock(device->rwlock);
 	return -1;
 }
 
+/* fake files, called with device->rwlock held */
+static upnp_file_t * device_vfsopen_route (device_t *device, device_route_t *route)
+{
+	upnp_file_t *file;
+	file = (upnp_file_t *) malloc(sizeof(upnp_file_t));
+	if (file == NULL) {
+		return NULL;
+	}
+	memset(file, 0, sizeof(upnp_file_t));
+	file->virtual = 1;
+	switch (route->type) {
+		case DEVICE_ROUTE_SCPD:
+			file->size = strlen(route->service->description);
+			file->buf = strdup(route->service->description);
+			break;
+		case DEVICE_ROUTE_ICON:
+			file->size = route->icon->size;
+			file->buf = (char *) malloc(route->icon->size);
+			if (file->buf != NULL) {
+				memcpy(file->buf, route->icon->buffer, route->icon->size);
+			}
+			break;
+		case DEVICE_ROUTE_STATS:
+			file->buf = upnpd_upnp_stats(device->upnp);
+			if (file->buf != NULL) {
+				file->size = strlen(file->buf);
+			}
+			break;
+	}
+	if (file->buf == NULL) {
+		free(file);
+		return NULL;
+	}
+	return file;
+}
+
 static void * device_vfsopen (void *cookie, char *path, gena_filemode_t mode)
 {
-	int c;
 	int s;
-	icon_t *icon;
-	device_t *device;
 	upnp_file_t *file;
+	device_t *device;
+	device_route_t *route;
 	device_service_t *service;
 	debugf(_DBG, "device vfs open (%s)", path);
 	device = (device_t *) cookie;
-	upnpd_thread_mutex_lock(device->mutex);
-	/* is fake file */
-	for (s = 0; (service = device->services[s]) != NULL; s++) {
-		if (strcmp(path, service->scpdurl) == 0) {
-			file = (upnp_file_t *) malloc(sizeof(upnp_file_t));
-			if (file == NULL) {
-				upnpd_thread_mutex_unlock(device->mutex);
-				return NULL;
-			}
-			memset(file, 0, sizeof(upnp_file_t));
-			file->virtual = 1;
-			file->size = strlen(service->description);
-			file->buf = strdup(service->description);
-			upnpd_thread_mutex_unlock(device->mutex);
-			return file;
-		}
-	}
-	/* is icon file */
-	for (c = 0; (icon = &device->icons[c])->url != NULL; c++) {
-		if (strcmp(path, icon->url) == 0) {
-			file = (upnp_file_t *) malloc(sizeof(upnp_file_t));
-			if (file == NULL) {
-				upnpd_thread_mutex_unlock(device->mutex);
-				return NULL;
-			}
-			memset(file, 0, sizeof(upnp_file_t));
-			file->virtual = 1;
-			file->size = icon->size;
-			file->buf = (char *) malloc(icon->size);
-			if (file->buf == NULL) {
-				free(file);
-				upnpd_thread_mutex_unlock(device->mutex);
-				return NULL;
-			}
-			memcpy(file->buf, icon->buffer, icon->size);
-			upnpd_thread_mutex_unlock(device->mutex);
-			return file;
-		}
+	upnpd_thread_rwlock_rdlock(device->rwlock);
+	route = device_route_find(device, path);
+	if (route != NULL) {
+		file = device_vfsopen_route(device, route);
+		upnpd_thread_rwlock_unlock(device->rwlock);
+		return file;
 	}
 	/* check services */
 	for (s = 0; (service = device->services[s]) != NULL; s++) {
@@ -146,12 +177,12 @@ static void * device_vfsopen (void *cookie, char *path, gena_filemode_t mode)
 			file = service->vfscallbacks->open(service, path, mode);
 			if (file != NULL) {
 				debugf(_DBG, "found service file");
-				upnpd_thread_mutex_unlock(device->mutex);
+				upnpd_thread_rwlock_unlock(device->rwlock);
 				return file;
 			}
 		}
 	}
-	upnpd_thread_mutex_unlock(device->mutex);
+	upnpd_thread_rwlock_unlock(device->rwlock);
 	return NULL;
 }
 
@@ -167,7 +198,8 @@ static int device_vfsread (void *cookie, void *handle, char *buffer, unsigned in
 	/* is fake file */
 	if (file->virtual == 1) {
 		if (file->offset >= file->size) {
-			return -1;
+			/* end of file, stats file has no size known in advance */
+			return 0;
 		}
 		len = (size_t) (((file->size - file->offset) < length) ? (file->size - file->offset) : length);
 		memcpy(buffer, (const char *) file->buf + file->offset, len);
@@ -249,6 +281,24 @@ static int device_vfsclose (void *cookie, void *handle)
 	return 0;
 }
 
+static int device_vfsfd (void *cookie, void *handle, unsigned long long *offset)
+{
+	upnp_file_t *file;
+	debugf(_DBG, "device vfs fd");
+	file = (upnp_file_t *) handle;
+	if (file == NULL || file->virtual == 1) {
+		return -1;
+	}
+	/* check services */
+	if (file->service != NULL &&
+	    file->service->vfscallbacks != NULL &&
+	    file->service->vfscallbacks->fd != NULL) {
+		debugf(_DBG, "calling service fd function");
+		return file->service->vfscallbacks->fd(file->service, handle, offset);
+	}
+	return -1;
+}
+
 static gena_callback_vfs_t device_vfscallbacks = {
 	device_vfsgetinfo,
 	device_vfsopen,
@@ -256,6 +306,7 @@ static gena_callback_vfs_t device_vfscallbacks = {
 	device_vfswrite,
 	device_vfsseek,
 	device_vfsclose,
+	device_vfsfd,
 };
 
 static void device_event_action_request (device_t *device, upnp_event_action_t *event)
@@ -285,14 +336,19 @@ static void device_event_action_request (device_t *device, upnp_event_action_t *
 		event->errcode = UPNP_ERROR_INVALID_ACTION;
 		return;
 	}
-	upnpd_thread_mutex_lock(service->mutex);
 	action = upnpd_service_action_find(service, event->action);
 	if (action == NULL) {
 		debugf(_DBG, "unknown action '%s' for service '%s'", event->action, event->serviceid);
 		event->errcode = UPNP_ERROR_INVALID_ACTION;
-		upnpd_thread_mutex_unlock(service->mutex);
 		return;
 	}
+	/* concurrent actions only read service state and run side by side,
+	 * the others have the service to themselves */
+	if (action->concurrency == ACTION_CONCURRENT) {
+		upnpd_thread_rwlock_rdlock(service->rwlock);
+	} else {
+		upnpd_thread_rwlock_wrlock(service->rwlock);
+	}
 	if (action->function != NULL) {
 		event->errcode = UPNP_ERROR_ACTION_FAILED;
 		rc = action->function(service, event);
@@ -303,7 +359,7 @@ static void device_event_action_request (device_t *device, upnp_event_action_t *
 	} else {
 		debugf(_DBG, "got valid action '%s', but no handler defined", action->name);
 	}
-	upnpd_thread_mutex_unlock(service->mutex);
+	upnpd_thread_rwlock_unlock(service->rwlock);
 }
 
 static void device_event_subscription_request (device_t *device, upnp_event_subscribe_t *event)
@@ -333,7 +389,7 @@ static void device_event_subscription_request (device_t *device, upnp_event_subs
 		debugf(_DBG, "discarding event - serviceid '%s' not recognized", event->serviceid);
 		return;
 	}
-	upnpd_thread_mutex_lock(service->mutex);
+	upnpd_thread_rwlock_rdlock(service->rwlock);
 	variable_count = 0;
 	for (i = 0; (variable = &service->variables[i])->name != NULL; i++) {
 		if (variable->sendevent == VARIABLE_SENDEVENT_YES) {
@@ -344,13 +400,13 @@ static void device_event_subscription_request (device_t *device, upnp_event_subs
 	variable_names = (char **) malloc(sizeof(char *) * (variable_count + 1));
 	if (variable_names == NULL) {
 		debugf(_DBG, "malloc(sizeof(char *) * (variable_count + 1)) failed");
-		upnpd_thread_mutex_unlock(service->mutex);
+		upnpd_thread_rwlock_unlock(service->rwlock);
 		return;
 	}
 	variable_values = (char **) malloc(sizeof(char *) * (variable_count + 1));
 	if (variable_values == NULL) {
 		debugf(_DBG, "malloc(sizeof(char *) * (variable_count + 1)) failed");
-		upnpd_thread_mutex_unlock(service->mutex);
+		upnpd_thread_rwlock_unlock(service->rwlock);
 		return;
 	}
 	memset(variable_names, 0, sizeof(char *) * (variable_count + 1));
@@ -370,14 +426,14 @@ static void device_event_subscription_request (device_t *device, upnp_event_subs
 	}
 	free(variable_names);
 	free(variable_values);
-	upnpd_thread_mutex_unlock(service->mutex);
+	upnpd_thread_rwlock_unlock(service->rwlock);
 }
 
 static int device_event_handler (void *cookie, upnp_event_t *event)
 {
 	device_t *device;
 	device = (device_t *) cookie;
-	upnpd_thread_mutex_lock(device->mutex);
+	upnpd_thread_rwlock_rdlock(device->rwlock);
 	switch (event->type) {
 		case UPNP_EVENT_TYPE_SUBSCRIBE_REQUEST:
 			device_event_subscription_request(device, &event->event.subscribe);
@@ -388,8 +444,69 @@ static int device_event_handler (void *cookie, upnp_event_t *event)
 		default:
 			break;
 	}
-	upnpd_thread_mutex_unlock(device->mutex);
+	upnpd_thread_rwlock_unlock(device->rwlock);
+	return 0;
+}
+
+/* fake file urls and service ids do not change once the services are
+ * added, so they are hashed once here and looked up without walking the
+ * service and icon lists. on duplicates the first one added wins, as it
+ * did with the list walks */
+static int device_routes_init (device_t *device)
+{
+	int c;
+	int s;
+	device_route_t *route;
+	for (s = 0; device->services && device->services[s] != NULL; s++) {
+		;
+	}
+	for (c = 0; device->icons && device->icons[c].url != NULL; c++) {
+		;
+	}
+	device->routes = (device_route_t *) malloc(sizeof(device_route_t) * (s + c + 1));
+	device->paths = upnpd_strmap_init(s + c + 1);
+	device->serviceids = upnpd_strmap_init(s);
+	if (device->routes == NULL || device->paths == NULL || device->serviceids == NULL) {
+		goto error;
+	}
+	memset(device->routes, 0, sizeof(device_route_t) * (s + c + 1));
+	route = device->routes;
+	for (s = 0; device->services && device->services[s] != NULL; s++) {
+		route->type = DEVICE_ROUTE_SCPD;
+		route->service = device->services[s];
+		if (upnpd_strmap_add(device->paths, route->service->scpdurl, route) == 0) {
+			route++;
+		}
+		upnpd_strmap_add(device->serviceids, device->services[s]->id, device->services[s]);
+	}
+	for (c = 0; device->icons && device->icons[c].url != NULL; c++) {
+		route->type = DEVICE_ROUTE_ICON;
+		route->icon = &device->icons[c];
+		if (upnpd_strmap_add(device->paths, route->icon->url, route) == 0) {
+			route++;
+		}
+	}
+	route->type = DEVICE_ROUTE_STATS;
+	upnpd_strmap_add(device->paths, DEVICE_STATS_URL, route);
 	return 0;
+error:
+	upnpd_strmap_uninit(device->paths);
+	upnpd_strmap_uninit(device->serviceids);
+	free(device->routes);
+	device->paths = NULL;
+	device->serviceids = NULL;
+	device->routes = NULL;
+	return -1;
+}
+
+static void device_routes_uninit (device_t *device)
+{
+	upnpd_strmap_uninit(device->paths);
+	upnpd_strmap_uninit(device->serviceids);
+	free(device->routes);
+	device->paths = NULL;
+	device->serviceids = NULL;
+	device->routes = NULL;
 }
 
 int upnpd_device_init (device_t *device)
@@ -399,17 +516,25 @@ int upnpd_device_init (device_t *device)
 	uuid_gen_t uuid;
 	ret = -1;
 	debugf(_DBG, "initializing device '%s'", device->name);
-	device->mutex = upnpd_thread_mutex_init("device->mutex", 0);
-	if (device->mutex == NULL) {
-		debugf(_DBG, "upnpd_thread_mutex_init(device->mutex, 0) failed");
+	device->timestamp = upnpd_time_gettimeofday() / 1000;
+	device->rwlock = upnpd_thread_rwlock_init("device->rwlock");
+	if (device->rwlock == NULL) {
+		debugf(_DBG, "upnpd_thread_rwlock_init(device->rwlock) failed");
+		goto out;
+	}
+	if (device_routes_init(device) != 0) {
+		debugf(_DBG, "device_routes_init(device) failed");
+		upnpd_thread_rwlock_destroy(device->rwlock);
+		device->rwlock = NULL;
 		goto out;
 	}
 	debugf(_DBG, "initializing upnp stack");
-	device->upnp = upnpd_upnp_init(device->ipaddr, device->ifmask, 0, &device_vfscallbacks, device);
+	device->upnp = upnpd_upnp_init(device->ipaddr, device->ifmask, 0, &device_vfscallbacks, device, &device->genaconfig);
 	if (device->upnp == NULL) {
 		debugf(_DBG, "upnpd_upnp_init('%s') failed", device->ipaddr);
-		upnpd_thread_mutex_destroy(device->mutex);
-		device->mutex = NULL;
+		device_routes_uninit(device);
+		upnpd_thread_rwlock_destroy(device->rwlock);
+		device->rwlock = NULL;
 		goto out;
 	}
 	device->port = upnpd_upnp_getport(device->upnp);
@@ -470,20 +595,23 @@ int upnpd_device_uninit (device_t *device)
 	device_service_t *service;
 	ret = -1;
 	debugf(_DBG, "uninitializing device '%s'", device->name);
-	if (device->mutex) {
-		upnpd_thread_mutex_lock(device->mutex);
+	/* stops the request and notifier threads, services are not used after */
+	debugf(_DBG, "unregistering device '%s'", device->name);
+	upnpd_upnp_uninit(device->upnp);
+	device->upnp = NULL;
+	if (device->rwlock) {
+		upnpd_thread_rwlock_wrlock(device->rwlock);
 	}
+	device_routes_uninit(device);
 	debugf(_DBG, "uninitializing services");
 	for (i = 0; device->services && ((service = device->services[i]) != NULL); i++) {
 		debugf(_DBG, "uninitializing service '%s'", service->name);
 		device->services[i] = NULL;
 		upnpd_service_uninit(service);
 	}
-	debugf(_DBG, "unregistering device '%s'", device->name);
-	upnpd_upnp_uninit(device->upnp);
-	if (device->mutex) {
-		upnpd_thread_mutex_unlock(device->mutex);
-		upnpd_thread_mutex_destroy(device->mutex);
+	if (device->rwlock) {
+		upnpd_thread_rwlock_unlock(device->rwlock);
+		upnpd_thread_rwlock_destroy(device->rwlock);
 	}
 	free(device->services);
 	free(device->description);
@@ -521,12 +649,5 @@ out:	return ret;
 
 device_service_t * upnpd_device_service_find (device_t *device, char *serviceid)
 {
-	int s;
-	device_service_t *service;
-	for (s = 0; (service = device->services[s]) != NULL; s++) {
-		if (strcmp(service->id, serviceid) == 0) {
-			return service;
-		}
-	}
-	return NULL;
+	return (device_service_t *) upnpd_strmap_find(device->serviceids, serviceid);
 }
@@ -526,7 +526,7 @@ static int upnpd_entry_scan_path (database_t *database, const char *path, const
 			} else if (entry->didl.upnp.type == DIDL_UPNP_OBJECT_TYPE_MOVIE) {
 				if (transcode == 1) {
 					debugf(_DBG, "adding transcode mirror");
-					size = ~0ULL >> 1;
+					size = GENA_FILESIZE_UNKNOWN;
 					if (asprintf(&tmp, "%s%s", TRANSCODE_PREFIX, entry->didl.dc.title) > 0) {
 						objectid = upnpd_database_insert(database,
 								entry->didl.upnp.object.class,
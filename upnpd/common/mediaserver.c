@@ -54,7 +54,17 @@ typedef enum {
 	OPT_FRIENDLYNAME = 7,
 	OPT_DAEMONIZE    = 8,
 	OPT_UUID         = 9,
-	OPT_HELP         = 10,
+	OPT_REACTOR      = 10,
+	OPT_WORKERS      = 11,
+	OPT_STREAMS      = 12,
+	OPT_BUFFERS      = 13,
+	OPT_STREAMRATE   = 14,
+	OPT_CLIENTRATE   = 15,
+	OPT_TOTALRATE    = 16,
+	OPT_LISTENERS    = 17,
+	OPT_MEMCACHE     = 18,
+	OPT_MEMCACHEFILE = 19,
+	OPT_HELP         = 20,
 } mediaserver_options_t;
 
 static char *mediaserver_options[] = {
@@ -68,6 +78,16 @@ static char *mediaserver_options[] = {
 	"friendlyname",
 	"daemonize",
 	"uuid",
+	"reactor",
+	"workers",
+	"streams",
+	"buffers",
+	"streamrate",
+	"clientrate",
+	"totalrate",
+	"listeners",
+	"memcache",
+	"memcachefile",
 	"help",
 	NULL,
 };
@@ -85,6 +105,16 @@ static int mediaserver_help (void)
 	       "\tfriendlyname=<device friendlyname>\n"
 	       "\tdaemonize=<1, 0>\n"
 	       "\tuuid=<xxxx>\n"
+	       "\treactor=<0, number of event driven http threads>\n"
+	       "\tworkers=<number of http worker threads>\n"
+	       "\tstreams=<maximum number of concurrent media streams>\n"
+	       "\tbuffers=<kbytes of idle http buffers kept for reuse>\n"
+	       "\tstreamrate=<kbytes per second limit of each media stream>\n"
+	       "\tclientrate=<kbytes per second limit of all streams to one client>\n"
+	       "\ttotalrate=<kbytes per second limit of all streams, shared equally>\n"
+	       "\tlisteners=<number of accepting threads sharing the http port>\n"
+	       "\tmemcache=<kbytes of memory for small hot files, 0 disables>\n"
+	       "\tmemcachefile=<kbytes, largest file size kept in memory>\n"
 	       "\thelp\n");
 	return 0;
 }
@@ -120,6 +150,16 @@ device_t * upnpd_mediaserver_init (char *options)
 	int cached;
 	char *uuid;
 	char *value;
+	int reactor;
+	int workers;
+	int streams;
+	int buffers;
+	int streamrate;
+	int clientrate;
+	int totalrate;
+	int listeners;
+	int memcache;
+	int memcachefile;
 	int transcode = 0;
 	int daemonize = 0;
 	char *netmask;
@@ -136,6 +176,16 @@ device_t * upnpd_mediaserver_init (char *options)
 
 	err = 0;
 	cached = 0;
+	reactor = 0;
+	workers = 0;
+	streams = 0;
+	buffers = 0;
+	streamrate = 0;
+	clientrate = 0;
+	totalrate = 0;
+	listeners = 0;
+	memcache = -1;
+	memcachefile = -1;
 	daemonize = 0;
 	transcode = 0;
 	uuid = NULL;
@@ -228,6 +278,86 @@ device_t * upnpd_mediaserver_init (char *options)
 				}
 				uuid = value;
 				break;
+			case OPT_REACTOR:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for reactor option");
+					err = 1;
+					continue;
+				}
+				reactor = atoi(value);
+				break;
+			case OPT_WORKERS:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for workers option");
+					err = 1;
+					continue;
+				}
+				workers = atoi(value);
+				break;
+			case OPT_STREAMS:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for streams option");
+					err = 1;
+					continue;
+				}
+				streams = atoi(value);
+				break;
+			case OPT_BUFFERS:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for buffers option");
+					err = 1;
+					continue;
+				}
+				buffers = atoi(value);
+				break;
+			case OPT_STREAMRATE:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for streamrate option");
+					err = 1;
+					continue;
+				}
+				streamrate = atoi(value);
+				break;
+			case OPT_CLIENTRATE:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for clientrate option");
+					err = 1;
+					continue;
+				}
+				clientrate = atoi(value);
+				break;
+			case OPT_TOTALRATE:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for totalrate option");
+					err = 1;
+					continue;
+				}
+				totalrate = atoi(value);
+				break;
+			case OPT_LISTENERS:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for listeners option");
+					err = 1;
+					continue;
+				}
+				listeners = atoi(value);
+				break;
+			case OPT_MEMCACHE:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for memcache option");
+					err = 1;
+					continue;
+				}
+				memcache = atoi(value);
+				break;
+			case OPT_MEMCACHEFILE:
+				if (value == NULL) {
+					debugf(_DBG, "value is missing for memcachefile option");
+					err = 1;
+					continue;
+				}
+				memcachefile = atoi(value);
+				break;
 			default:
 				break;
 			case OPT_HELP:
@@ -246,6 +376,16 @@ device_t * upnpd_mediaserver_init (char *options)
 	       "\ttranscode   : %d\n"
 	       "\tfontfile    : %s\n"
 	       "\tcodepage    : %s\n"
+	       "\treactor     : %d\n"
+	       "\tworkers     : %d\n"
+	       "\tstreams     : %d\n"
+	       "\tbuffers     : %d\n"
+	       "\tstreamrate  : %d\n"
+	       "\tclientrate  : %d\n"
+	       "\ttotalrate   : %d\n"
+	       "\tlisteners   : %d\n"
+	       "\tmemcache    : %d\n"
+	       "\tmemcachefile: %d\n"
 	       "\tfriendlyname: %s\n",
 	       (uuid) ? uuid : "(default)",
 	       (daemonize) ? "yes" : "no",
@@ -256,6 +396,16 @@ device_t * upnpd_mediaserver_init (char *options)
 	       transcode,
 	       (fontfile) ? fontfile : "null",
 	       (codepage) ? codepage : "null",
+	       reactor,
+	       workers,
+	       streams,
+	       buffers,
+	       streamrate,
+	       clientrate,
+	       totalrate,
+	       listeners,
+	       memcache,
+	       memcachefile,
 	       (friendlyname) ? friendlyname : "mediaserver");
 
 	debugf(_DBG, "initializing mediaserver device struct");
@@ -282,8 +432,19 @@ device_t * upnpd_mediaserver_init (char *options)
 	device->icons = mediaserver_icons;
 	device->daemonize = daemonize;
 	device->uuid = uuid;
+	if (reactor > 0) {
+		device->genaconfig.mode = GENA_MODE_REACTOR;
+		device->genaconfig.reactors = reactor;
+	}
+	device->genaconfig.listeners = (listeners > 0) ? listeners : 0;
+	device->genaconfig.workers = (workers > 0) ? workers : 0;
+	device->genaconfig.streams = (streams > 0) ? streams : 0;
+	device->genaconfig.buffers = (buffers > 0) ? buffers * 1024 : 0;
+	device->genaconfig.streamrate = (streamrate > 0) ? streamrate * 1024 : 0;
+	device->genaconfig.clientrate = (clientrate > 0) ? clientrate * 1024 : 0;
+	device->genaconfig.totalrate = (totalrate > 0) ? totalrate * 1024 : 0;
 
-	service = upnpd_contentdirectory_init(directory, cached, transcode, fontfile, codepage);
+	service = upnpd_contentdirectory_init(directory, cached, transcode, fontfile, codepage, memcache, memcachefile);
 	if (service == NULL) {
 		debugf(_DBG, "contendirectory_init() failed");
 		goto error;
@@ -328,9 +489,14 @@ error:	upnpd_mediaserver_uninit(device);
 
 int upnpd_mediaserver_refresh (device_t *mediaserver)
 {
+	device_service_t *service;
 	debugf(_DBG, "refreshing content directory service");
-	// empty? rescan path and refresh db maybe?
-	return 0;
+	service = upnpd_device_service_find(mediaserver, "urn:upnp-org:serviceId:ContentDirectory");
+	if (service == NULL) {
+		return -1;
+	}
+	/* the cached database is not rescanned, control points are only told to browse again */
+	return upnpd_contentdirectory_refresh(service);
 }
 
 int upnpd_mediaserver_uninit (device_t *mediaserver)
@@ -39,21 +39,46 @@
 #include "upnp.h"
 #include "common.h"
 
+/* action tables are static and never change, hash the names once */
+static int service_actions_init (device_service_t *service)
+{
+	int i;
+	for (i = 0; service->actions && service->actions[i].name != NULL; i++) {
+		;
+	}
+	service->actionmap = upnpd_strmap_init(i);
+	if (service->actionmap == NULL) {
+		return -1;
+	}
+	for (i = 0; service->actions && service->actions[i].name != NULL; i++) {
+		if (upnpd_strmap_add(service->actionmap, service->actions[i].name, &service->actions[i]) != 0) {
+			debugf(_DBG, "duplicate action '%s' in service '%s'", service->actions[i].name, service->name);
+		}
+	}
+	return 0;
+}
+
 int upnpd_service_init (device_service_t *service)
 {
 	int ret;
 	ret = -1;
 	debugf(_DBG, "initializing service '%s'", service->name);
-	service->mutex = upnpd_thread_mutex_init("service->mutex", 0);
-	if (service->mutex == NULL) {
-		debugf(_DBG, "upnpd_thread_mutex_init(service->mutex, 0) failed");
+	service->rwlock = upnpd_thread_rwlock_init("service->rwlock");
+	if (service->rwlock == NULL) {
+		debugf(_DBG, "upnpd_thread_rwlock_init(service->rwlock) failed");
+		goto out;
+	}
+	if (service_actions_init(service) != 0) {
+		debugf(_DBG, "service_actions_init(service) failed");
+		upnpd_thread_rwlock_destroy(service->rwlock);
 		goto out;
 	}
 	debugf(_DBG, "generating service '%s' description", service->name);
 	service->description = upnpd_description_generate_from_service(service);
 	if (service->description == NULL) {
 		debugf(_DBG, "upnpd_description_generate_from_service(service) failed");
-		upnpd_thread_mutex_destroy(service->mutex);
+		upnpd_strmap_uninit(service->actionmap);
+		upnpd_thread_rwlock_destroy(service->rwlock);
 		goto out;
 	}
 	ret = 0;
@@ -67,7 +92,8 @@ out:	return ret;
 
 int upnpd_service_uninit (device_service_t *service)
 {
-	upnpd_thread_mutex_destroy(service->mutex);
+	upnpd_strmap_uninit(service->actionmap);
+	upnpd_thread_rwlock_destroy(service->rwlock);
 	free(service->description);
 	return service->uninit(service);
 }
@@ -84,14 +110,38 @@ service_variable_t * upnpd_service_variable_find (device_service_t *service, cha
 	return NULL;
 }
 
-service_action_t * upnpd_service_action_find (device_service_t *service, char *name)
+/* called with service->rwlock held exclusive, evented variables are handed to the
+ * upnp stack which moderates and coalesces them */
+int upnpd_service_variable_set (device_service_t *service, char *name, const char *value)
 {
-	int i;
-	service_action_t *action;
-	for (i = 0; (action = &service->actions[i])->name != NULL; i++) {
-		if (strcmp(action->name, name) == 0) {
-			return action;
-		}
+	char *tmp;
+	char *escaped;
+	service_variable_t *variable;
+	variable = upnpd_service_variable_find(service, name);
+	if (variable == NULL) {
+		return -1;
 	}
-	return NULL;
+	tmp = strdup(value);
+	if (tmp == NULL) {
+		return -1;
+	}
+	free(variable->value);
+	variable->value = tmp;
+	if (variable->sendevent != VARIABLE_SENDEVENT_YES ||
+	    service->device == NULL ||
+	    service->device->upnp == NULL) {
+		return 0;
+	}
+	escaped = upnpd_xml_escape(variable->value, 0);
+	if (escaped == NULL) {
+		return -1;
+	}
+	upnpd_upnp_event_variable(service->device->upnp, service->device->uuid, service->id, variable->name, escaped, variable->maxrate, variable->mindelta);
+	free(escaped);
+	return 0;
+}
+
+service_action_t * upnpd_service_action_find (device_service_t *service, char *name)
+{
+	return (service_action_t *) upnpd_strmap_find(service->actionmap, name);
 }
@@ -29,6 +29,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <ctype.h>
 
 #include <string.h>
@@ -42,13 +44,61 @@
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
 
 #define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
 #define GENA_LISTEN_PORT	10000
 #define GENA_LISTEN_MAX		100
-#define GENA_HEADER_SIZE	(1024 * 4)
+#define GENA_LISTENERS		1
+#define GENA_HEADER_SIZE	(1024 * 8)
+/* largest action body buffered, soap requests are a few kilobytes */
+#define GENA_CONTENT_MAX	(1024 * 256)
 #define GENA_DATA_SIZE		(1024 * 1024)
 #define GENA_SOCKET_TIMEOUT	20000
+#define GENA_REACTOR_THREADS	2
+#define GENA_REACTOR_DATA_SIZE	(1024 * 64)
+#define GENA_REACTOR_EVENTS	64
+#define GENA_REACTOR_TIMEOUT	500
+#define GENA_REACTOR_BUDGET	(1024 * 256)
+#define GENA_WORKERS		16
+#define GENA_WORKERS_CONTROL	4
+#define GENA_QUEUE_MAX		64
+#define GENA_STREAM_SIZE	(1024 * 1024)
+#define GENA_SENDFILE_SIZE	(1024 * 1024)
+#define GENA_RETRY_AFTER	5
+#define GENA_KEEPALIVE_TIMEOUT	15000
+#define GENA_KEEPALIVE_REQUESTS	100
+#define GENA_KEEPALIVE_POLL	500
+#define GENA_BUFFERS_LIMIT	(1024 * 1024 * 8)
+#define GENA_BUFFER_CACHE	2
+#define GENA_RANGES_MAX		8
+#define GENA_ETAG_SIZE		48
+#define GENA_BOUNDARY		"upnpd-byteranges-7e1b3c59a2d4"
+#define GENA_MULTIPART_HEADER	"\r\n--" GENA_BOUNDARY "\r\nContent-Type: %s\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n"
+#define GENA_MULTIPART_END	"\r\n--" GENA_BOUNDARY "--\r\n"
+#define GENA_DEFER_ACCEPT	5
+#define GENA_STREAM_SNDBUF	(1024 * 1024)
+#define GENA_READAHEAD_WINDOW	(1024 * 1024 * 4)
+#define GENA_DROPBEHIND_SIZE	(1024ULL * 1024 * 256)
+#define GENA_RING_SLOTS		64
+#define GENA_RING_SIZE		(1024 * 64)
+#define GENA_SHAPER_BURST	250
+#define GENA_SHAPER_QUANTUM	(1024 * 4)
+#define GENA_SHAPER_TICK	10
+#define GENA_CHUNK_HEADER	"%08x\r\n"
+#define GENA_CHUNK_HEADER_SIZE	10
+#define GENA_CHUNK_TRAILER	"\r\n"
+#define GENA_CHUNK_END		"0\r\n\r\n"
+#define GENA_PEER_IDLE		10000
+#define GENA_PEER_HOST_MAX	4
+#define GENA_PEER_MAX		32
+#define GENA_READER_SIZE	(1024 * 16)
+#define GENA_STATS_BUCKETS	13
+#define GENA_STATS_ACTIONS	32
+#define GENA_STATS_NAME		48
+#define GENA_STATS_LINE		256
 
 typedef struct gena_filerange_s {
 	unsigned long long start;
@@ -58,19 +108,246 @@ typedef struct gena_filerange_s {
 
 typedef struct gena_fileino_internal_s {
 	gena_fileinfo_t fileinfo;
+	/* range being sent */
 	gena_filerange_t filerange;
+	/* requested ranges, none for the whole file */
+	gena_filerange_t ranges[GENA_RANGES_MAX];
+	unsigned int nranges;
+	unsigned int range;
+	/* response body length */
+	unsigned long long length;
+	char etag[GENA_ETAG_SIZE];
+	char lastmodified[80];
+	/* body is sent with chunked transfer coding */
+	int chunked;
 } gena_fileinfo_internal_t;
 
-typedef struct gena_thread_s {
+typedef enum {
+	GENA_BUFFER_SMALL  = 0x00,
+	GENA_BUFFER_MEDIUM = 0x01,
+	GENA_BUFFER_LARGE  = 0x02,
+	GENA_BUFFER_CLASSES,
+} gena_buffer_class_t;
+
+static const unsigned int gena_buffer_sizes[GENA_BUFFER_CLASSES] = {
+	GENA_HEADER_SIZE,
+	GENA_REACTOR_DATA_SIZE,
+	GENA_DATA_SIZE,
+};
+
+typedef enum {
+	GENA_TRAFFIC_CONTROL = 0x00,
+	GENA_TRAFFIC_STREAM  = 0x01,
+	GENA_TRAFFIC_CLASSES,
+} gena_traffic_class_t;
+
+/* socket tuning per traffic class, 0 keeps kernel default for buffer sizes */
+typedef struct gena_socket_profile_s {
+	int nodelay;
+	int keepalive;
+	int sndbuf;
+	int rcvbuf;
+} gena_socket_profile_t;
+
+static const gena_socket_profile_t gena_socket_profiles[GENA_TRAFFIC_CLASSES] = {
+	/* small soap replies and descriptions must not wait for nagle */
+	{1, 1, 0, 0},
+	/* media streams need room for high bandwidth delay product links */
+	{1, 1, GENA_STREAM_SNDBUF, 0},
+};
+
+typedef struct gena_buffers_s {
+	unsigned int limit;
+	unsigned int size;
+	void *free[GENA_BUFFER_CLASSES];
+	thread_mutex_t *mutex;
+} gena_buffers_t;
+
+typedef struct gena_buffer_cache_s {
+	gena_buffers_t *buffers;
+	unsigned int count[GENA_BUFFER_CLASSES];
+	void *cache[GENA_BUFFER_CLASSES][GENA_BUFFER_CACHE];
+} gena_buffer_cache_t;
+
+typedef enum {
+	GENA_METHOD_UNKNOWN     = 0x00,
+	GENA_METHOD_GET         = 0x01,
+	GENA_METHOD_HEAD        = 0x02,
+	GENA_METHOD_POST        = 0x03,
+	GENA_METHOD_SUBSCRIBE   = 0x04,
+	GENA_METHOD_UNSUBSCRIBE = 0x05,
+} gena_method_t;
+
+typedef struct gena_method_name_s {
+	gena_method_t method;
+	const char *name;
+} gena_method_name_t;
+
+typedef struct gena_request_s {
+	gena_method_t method;
+	int version;
+	int close;
+	int keepalive;
+	char *path;
+	char *host;
+	char *range;
+	char *nt;
+	char *callback;
+	char *scope;
+	char *timeout;
+	char *sid;
+	char *soapaction;
+	char *ifmodifiedsince;
+	char *ifnonematch;
+	char *ifrange;
+	char *newsid;
+	unsigned int length;
+	char *content;
+} gena_request_t;
+
+typedef struct gena_header_name_s {
+	const char *name;
+	unsigned int length;
+	size_t offset;
+	int quoted;
+} gena_header_name_t;
+
+/* token bucket, rate in bytes per second and holds at most GENA_SHAPER_BURST ms worth of tokens */
+typedef struct gena_bucket_s {
+	unsigned long long rate;
+	unsigned long long tokens;
+	unsigned long long timestamp;
+} gena_bucket_t;
+
+/* streams of one remote address share a bucket */
+typedef struct gena_client_s {
+	list_t head;
+	char address[SOCKET_IP_LENGTH];
+	unsigned int streams;
+	gena_bucket_t bucket;
+} gena_client_t;
+
+typedef struct gena_shaper_s {
+	int enabled;
+	unsigned int streams;
+	gena_bucket_t bucket;
+	list_t clients;
+	thread_mutex_t *mutex;
+} gena_shaper_t;
+
+/* idle outbound connection, kept for the next request to the same peer */
+typedef struct gena_peer_s {
+	list_t head;
+	char *host;
+	unsigned short port;
+	socket_t *socket;
+	unsigned long long idle;
+} gena_peer_t;
+
+typedef struct gena_peers_s {
+	list_t idle;
+	unsigned int count;
+	thread_mutex_t *mutex;
+} gena_peers_t;
+
+typedef enum {
+	GENA_STATE_HEADER  = 0x00,
+	GENA_STATE_CONTENT = 0x01,
+	GENA_STATE_SEND    = 0x02,
+} gena_state_t;
+
+typedef struct gena_connection_s {
 	list_t head;
+	gena_state_t state;
+	gena_t *gena;
+	socket_t *socket;
+	gena_buffer_cache_t *cache;
+	gena_callbacks_t *callbacks;
+	gena_request_t request;
+	unsigned int requests;
+	int keepalive;
+	poll_event_t events;
+	char *header;
+	unsigned int headerlength;
+	unsigned int headerused;
+	unsigned int contentlength;
+	char *data;
+	gena_buffer_class_t dataclass;
+	gena_buffer_class_t streamclass;
+	unsigned int datasize;
+	unsigned int datalength;
+	unsigned int dataoffset;
+	char *response;
+	unsigned int responselength;
+	unsigned int responseoffset;
+	void *filehandle;
+	int filefd;
+	unsigned long long fileoffset;
+	unsigned long long filesent;
+	/* page cache hints of file backed bodies, file offsets */
+	int advisefd;
+	unsigned long long advised;
+	unsigned long long dropped;
+	gena_fileinfo_internal_t fileinfo;
+	int subscribed;
+	int streaming;
+	/* shaping of media streams, client is set while shaped */
+	gena_client_t *client;
+	gena_bucket_t bucket;
+	unsigned int quota;
+	unsigned long long resume;
+	/* stream engine of reactor, slot is -1 when not in use */
+	struct gena_reactor_s *reactor;
+	int slot;
+	int ringing;
+	int ringerror;
+	int ringread;
+	unsigned int ringsent;
+	unsigned long long timestamp;
+	/* request being served, for stats; started is 0 between requests */
+	unsigned long long started;
+	int status;
+	int action;
+	/* Date header, formatted at most once a second */
+	unsigned long long datesecond;
+	char date[40];
+} gena_connection_t;
+
+typedef struct gena_pool_s {
+	gena_buffers_t *buffers;
+	int running;
+	unsigned int started;
+	unsigned int nthreads;
+	thread_t **threads;
+	unsigned int npending;
+	list_t pending;
+	thread_cond_t *cond;
+	thread_mutex_t *mutex;
+} gena_pool_t;
+
+typedef struct gena_reactor_s {
 	int running;
 	int stopped;
-	socket_t *socket;
+	socket_event_t *event;
+	gena_buffer_cache_t cache;
+	list_t connections;
+	/* file reads and socket sends of streams, NULL if not available */
+	socket_ring_t *ring;
+	gena_connection_t *slots[GENA_RING_SLOTS];
+	unsigned int pending[GENA_RING_SLOTS];
 	thread_t *thread;
 	thread_cond_t *cond;
 	thread_mutex_t *mutex;
-	gena_callbacks_t *callbacks;
-} gena_thread_t;
+} gena_reactor_t;
+
+/* accepting thread, several of them share the port with SO_REUSEPORT */
+typedef struct gena_listener_s {
+	gena_t *gena;
+	unsigned int index;
+	socket_t *socket;
+	thread_t *thread;
+	unsigned int reactor;
+} gena_listener_t;
 
 typedef enum {
 	GENA_RESPONSE_TYPE_OK,
@@ -80,6 +357,10 @@ typedef enum {
 	GENA_RESPONSE_TYPE_NOT_FOUND,
 	GENA_RESPONSE_TYPE_PRECONDITION_FAILED,
 	GENA_RESPONSE_TYPE_NOT_IMPLEMENTED,
+	GENA_RESPONSE_TYPE_SERVICE_UNAVAILABLE,
+	GENA_RESPONSE_TYPE_NOT_MODIFIED,
+	GENA_RESPONSE_TYPE_RANGE_NOT_SATISFIABLE,
+	GENA_RESPONSE_TYPE_ENTITY_TOO_LARGE,
 	GENA_RESPONSE_TYPES,
 } gena_response_type_t;
 
@@ -88,32 +369,134 @@ typedef struct gena_response_s {
 	int code;
 	char *name;
 	char *info;
+	/* status line, prebuilt */
+	char *status;
 } gena_response_t;
 
+#define GENA_RESPONSE(type, code, name, info) {type, code, name, info, "HTTP/1.1 " #code " " name "\r\n"}
+
+typedef enum {
+	GENA_STATS_GET         = 0x00,
+	GENA_STATS_HEAD        = 0x01,
+	GENA_STATS_POST        = 0x02,
+	GENA_STATS_SUBSCRIBE   = 0x03,
+	GENA_STATS_UNSUBSCRIBE = 0x04,
+	GENA_STATS_NOTIFY      = 0x05,
+	GENA_STATS_OTHER       = 0x06,
+	GENA_STATS_TYPES,
+} gena_stats_type_t;
+
+static const char *gena_stats_names[GENA_STATS_TYPES] = {
+	"GET",
+	"HEAD",
+	"POST",
+	"SUBSCRIBE",
+	"UNSUBSCRIBE",
+	"NOTIFY",
+	"OTHER",
+};
+
+/* upper bounds of latency buckets in microseconds, the implicit last one is +Inf */
+static const unsigned long long gena_stats_bounds[GENA_STATS_BUCKETS] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+/* buckets are not cumulative, they are summed up when printed */
+typedef struct gena_histogram_s {
+	volatile unsigned long long buckets[GENA_STATS_BUCKETS];
+	volatile unsigned long long count;
+	volatile unsigned long long sum;
+} gena_histogram_t;
+
+typedef struct gena_stats_action_s {
+	char name[GENA_STATS_NAME];
+	gena_histogram_t latency;
+} gena_stats_action_t;
+
+/*
+ * counters are updated with atomic operations only, the mutex is taken
+ * when an action is seen for the first time. the last action slot
+ * collects everything that does not fit into the table.
+ */
+typedef struct gena_stats_s {
+	gena_histogram_t requests[GENA_STATS_TYPES];
+	gena_histogram_t outbound[GENA_STATS_TYPES];
+	volatile unsigned long long outerrors[GENA_STATS_TYPES];
+	volatile unsigned long long responses[GENA_RESPONSE_TYPES];
+	volatile unsigned long long aborted;
+	volatile unsigned long long bytes;
+	volatile unsigned long long ranges;
+	volatile unsigned long long connections;
+	volatile unsigned long long active;
+	volatile unsigned long long nactions;
+	gena_stats_action_t actions[GENA_STATS_ACTIONS];
+	thread_mutex_t *mutex;
+} gena_stats_t;
+
 struct gena_s {
 	int running;
 	int stopped;
-	socket_t *socket;
 	char *address;
 	unsigned short port;
+	gena_config_t config;
 	gena_callbacks_t *callbacks;
-	thread_t *thread;
+	gena_listener_t *listeners;
+	unsigned int started;
 	thread_cond_t *cond;
 	thread_mutex_t *mutex;
-	list_t threads;
+	gena_pool_t pool;
+	gena_buffers_t buffers;
+	gena_shaper_t shaper;
+	gena_peers_t peers;
+	gena_stats_t stats;
+	unsigned int streams;
+	gena_reactor_t *reactors;
 };
 
-static const gena_response_t gena_responses[] = {
-	{GENA_RESPONSE_TYPE_OK, 200, "OK", NULL},
-	{GENA_RESPONSE_TYPE_PARTIAL_CONTENT, 206, "Partial Content", NULL},
-	{GENA_RESPONSE_TYPE_BAD_REQUEST, 400, "Bad Request", "Unsupported method"},
-	{GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR, 500, "Internal Server Error", "Internal Server Error"},
-	{GENA_RESPONSE_TYPE_NOT_FOUND, 404, "Not Found", "The requested URL was not found"},
-	{GENA_RESPONSE_TYPE_PRECONDITION_FAILED, 412, "Precondition Failed", "Precondition Failed"},
-	{GENA_RESPONSE_TYPE_NOT_IMPLEMENTED, 501, "Not implemented", "Not implemented"},
+/* indexed by gena_response_type_t */
+static const gena_response_t gena_responses[GENA_RESPONSE_TYPES] = {
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_OK, 200, "OK", NULL),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_PARTIAL_CONTENT, 206, "Partial Content", NULL),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_BAD_REQUEST, 400, "Bad Request", "Unsupported method"),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR, 500, "Internal Server Error", "Internal Server Error"),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_NOT_FOUND, 404, "Not Found", "The requested URL was not found"),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_PRECONDITION_FAILED, 412, "Precondition Failed", "Precondition Failed"),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_NOT_IMPLEMENTED, 501, "Not implemented", "Not implemented"),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_SERVICE_UNAVAILABLE, 503, "Service Unavailable", "Service Unavailable"),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_NOT_MODIFIED, 304, "Not Modified", NULL),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_RANGE_NOT_SATISFIABLE, 416, "Requested Range Not Satisfiable", "Requested Range Not Satisfiable"),
+	GENA_RESPONSE(GENA_RESPONSE_TYPE_ENTITY_TOO_LARGE, 413, "Request Entity Too Large", "Request Entity Too Large"),
 };
 
-static char * gena_trim (char *buffer)
+static const gena_method_name_t gena_methods[] = {
+	{GENA_METHOD_GET, "GET"},
+	{GENA_METHOD_HEAD, "HEAD"},
+	{GENA_METHOD_POST, "POST"},
+	{GENA_METHOD_SUBSCRIBE, "SUBSCRIBE"},
+	{GENA_METHOD_UNSUBSCRIBE, "UNSUBSCRIBE"},
+};
+
+#define GENA_HEADER_NAME(n, f) {n, sizeof(n) - 1, offsetof(gena_request_t, f), 0}
+/* entity tags keep their quotes */
+#define GENA_HEADER_QUOTED(n, f) {n, sizeof(n) - 1, offsetof(gena_request_t, f), 1}
+
+/* request header values point into the connection header buffer */
+static const gena_header_name_t gena_headers[] = {
+	GENA_HEADER_NAME("HOST", host),
+	GENA_HEADER_NAME("RANGE", range),
+	GENA_HEADER_NAME("NT", nt),
+	GENA_HEADER_NAME("CALLBACK", callback),
+	GENA_HEADER_NAME("SCOPE", scope),
+	GENA_HEADER_NAME("TIMEOUT", timeout),
+	GENA_HEADER_NAME("SID", sid),
+	GENA_HEADER_NAME("SOAPACTION", soapaction),
+	GENA_HEADER_NAME("IF-MODIFIED-SINCE", ifmodifiedsince),
+	GENA_HEADER_QUOTED("IF-NONE-MATCH", ifnonematch),
+	GENA_HEADER_QUOTED("IF-RANGE", ifrange),
+};
+
+static char * gena_trim_space (char *buffer)
 {
 	int l;
 	char *out;
@@ -126,6 +509,14 @@ static char * gena_trim (char *buffer)
 			break;
 		}
 	}
+	return out;
+}
+
+static char * gena_trim (char *buffer)
+{
+	int l;
+	char *out;
+	out = gena_trim_space(buffer);
 	for (; *out && (*out == '"' || *out == '\''); out++) {
 	}
 	for (l = strlen(out) - 1; l >= 0; l--) {
@@ -151,26 +542,33 @@ static int gena_connect (socket_t *socket, int timeout, const char *host, const
 	}
 }
 
-static int gena_send (socket_t *socket, int timeout, const void *buf, unsigned int len)
+static int gena_send (socket_t *socket, int timeout, const void *buf, unsigned int len, int more)
 {
 	int t;
 	int s;
 	int rc;
 	poll_item_t pitem;
 	t = 0;
-	while (1) {
+	while (t < len) {
 		pitem.item = socket;
 		pitem.events = POLL_EVENT_OUT;
 		rc = upnpd_socket_poll(&pitem, 1, timeout);
 		if (rc == 0) {
 			debugf(_DBG, "poll timeout");
-			continue;
+			break;
 		}
-		if (rc <= 0 || (pitem.revents & POLL_EVENT_OUT) == 0) {
+		if (rc < 0 || (pitem.revents & POLL_EVENT_OUT) == 0) {
 			debugf(_DBG, "poll failed (%d, 0x%x)", rc, pitem.revents);
 			break;
 		}
-		s = upnpd_socket_send(socket, (const char *) buf + t, len - t);
+		if (more == 1) {
+			s = upnpd_socket_send_more(socket, (const char *) buf + t, len - t);
+		} else {
+			s = upnpd_socket_send(socket, (const char *) buf + t, len - t);
+		}
+		if (s == SOCKET_AGAIN) {
+			continue;
+		}
 		if (s <= 0) {
 			break;
 		}
@@ -179,354 +577,904 @@ static int gena_send (socket_t *socket, int timeout, const void *buf, unsigned i
 	return t;
 }
 
-static int gena_getcontent (socket_t *socket, int timeout, char *buf, int buflen)
+static int gena_hexvalue (char c)
 {
-	char c;
-	int rc;
-	int count;
-	poll_item_t pitem;
-	count = 0;
-	while (1) {
-		pitem.item = socket;
-		pitem.events = POLL_EVENT_IN;
-		rc = upnpd_socket_poll(&pitem, 1, timeout);
-		if (rc <= 0 || (pitem.revents & POLL_EVENT_IN) == 0) {
-			debugf(_DBG, "poll failed rc:%d(0x%x)", rc, pitem.revents);
-			return 0;
-		}
-		if (upnpd_socket_recv(socket, &c, 1) <= 0) {
-			break;
-		}
-		buf[count++] = c;
-		if (count >= buflen) {
-			break;
-		}
+	if (c >= '0' && c <= '9') {
+		return c - '0';
 	}
-	return count;
+	return tolower(c) - 'a' + 10;
 }
 
-static int gena_getline (socket_t *socket, int timeout, char *buf, int buflen)
+static int gena_remove_escaped_chars (char *in)
 {
-	char c;
-	int rc;
-	int count;
-	poll_item_t pitem;
-	count = 0;
-	while (1) {
-		pitem.item = socket;
-		pitem.events = POLL_EVENT_IN;
-		rc = upnpd_socket_poll(&pitem, 1, timeout);
-		if (rc <= 0 || (pitem.revents & POLL_EVENT_IN) == 0) {
-			debugf(_DBG, "poll failed rc:%d(0x%x)", rc, pitem.revents);
-			return 0;
+	char *out;
+	for (out = in; *in != '\0'; in++, out++) {
+		if (in[0] == '%' && in[1] == '2' && in[2] == 'M') {
+			*out = ',';
+			in += 2;
+		} else if (in[0] == '%' && in[1] == '2' && in[2] == 'N') {
+			*out = '-';
+			in += 2;
+		} else if (in[0] == '%' && isxdigit((unsigned char) in[1]) && isxdigit((unsigned char) in[2])) {
+			*out = (char) ((gena_hexvalue(in[1]) << 4) | gena_hexvalue(in[2]));
+			in += 2;
+		} else {
+			*out = *in;
 		}
-		if (upnpd_socket_recv(socket, &c, 1) <= 0) {
+	}
+	*out = '\0';
+	return 0;
+}
+
+static void gena_request_uninit (gena_request_t *request)
+{
+	free(request->newsid);
+	free(request->content);
+	memset(request, 0, sizeof(gena_request_t));
+}
+
+static gena_response_type_t gena_request_start (gena_request_t *request, char *line)
+{
+	char *tmpptr;
+	char *urlptr;
+	unsigned int i;
+
+	/* parse method */
+	urlptr = strpbrk(line, " \t");
+	if (urlptr == NULL) {
+		return GENA_RESPONSE_TYPE_BAD_REQUEST;
+	}
+	*urlptr++ = '\0';
+	request->method = GENA_METHOD_UNKNOWN;
+	for (i = 0; i < ARRAY_SIZE(gena_methods); i++) {
+		if (strcasecmp(line, gena_methods[i].name) == 0) {
+			request->method = gena_methods[i].method;
 			break;
 		}
-		buf[count] = c;
-		if (c == '\r') {
-			continue;
-		}
-		if (c == '\n') {
-			buf[count] = '\0';
-			debugf(_DBG, "%s", buf);
-			return count;
-		}
-		if (count < buflen - 1) {
-			count++;
+	}
+	if (request->method == GENA_METHOD_UNKNOWN) {
+		debugf(_DBG, "unsupported header: '%s'", line);
+		return GENA_RESPONSE_TYPE_NOT_IMPLEMENTED;
+	}
+	debugf(_DBG, "header: %s", line);
+	while (*urlptr && (*urlptr == ' ' || *urlptr == '\t')) {
+		urlptr++;
+	}
+	if (urlptr[0] != '/') {
+		return GENA_RESPONSE_TYPE_BAD_REQUEST;
+	}
+	tmpptr = urlptr;
+	while (*tmpptr && (*tmpptr != ' ' && *tmpptr != '\t')) {
+		tmpptr++;
+	}
+	if (*tmpptr != '\0') {
+		*tmpptr++ = '\0';
+		while (*tmpptr && (*tmpptr == ' ' || *tmpptr == '\t')) {
+			tmpptr++;
 		}
 	}
-	return count;
+	request->version = (strncasecmp(tmpptr, "HTTP/1.", strlen("HTTP/1.")) == 0) ? 10 + atoi(tmpptr + strlen("HTTP/1.")) : 10;
+	request->path = urlptr;
+	gena_remove_escaped_chars(request->path);
+	debugf(_DBG, "requested url is: %s", request->path);
+	return GENA_RESPONSE_TYPE_OK;
 }
 
-static int gena_replace_escaped (char *in, int index, size_t *max)
+static gena_response_type_t gena_request_header (gena_request_t *request, char *line)
 {
-	int tempInt = 0;
-	char tempChar = 0;
-	size_t i = 0;
-	size_t j = 0;
+	char *end;
+	char *value;
+	unsigned int i;
+	unsigned int length;
+	unsigned long long contentlength;
 
-	if (in[index] && in[index + 1] && in[index + 2]) {
-		if (in[index] == '%' && in[index + 1] == '2' && in[index + 2] == 'M') {
-			tempChar = ',';
-			for (i = index + 3, j = index; j < (*max); i++, j++) {
-				in[j] = tempChar;
-				if (i < (*max)) {
-					tempChar = in[i];
-				} else {
-					tempChar = 0;
-				}
-			}
-			(*max) -= 2;
-			return 1;
-		} else if (in[index] == '%' && in[index + 1] == '2' && in[index + 2] == 'N') {
-			tempChar = '-';
-			for (i = index + 3, j = index; j < (*max); i++, j++) {
-				in[j] = tempChar;
-				if (i < (*max)) {
-					tempChar = in[i];
-				} else {
-					tempChar = 0;
-				}
-			}
-			(*max) -= 2;
-			return 1;
+	value = strchr(line, ':');
+	if (value == NULL) {
+		return GENA_RESPONSE_TYPE_OK;
+	}
+	for (length = value - line; length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t'); length--) {
+	}
+	value = gena_trim_space(value + 1);
+	for (i = 0; i < ARRAY_SIZE(gena_headers); i++) {
+		if (gena_headers[i].length == length &&
+		    strncasecmp(line, gena_headers[i].name, length) == 0) {
+			*(char **) ((char *) request + gena_headers[i].offset) = (gena_headers[i].quoted) ? value : gena_trim(value);
+			return GENA_RESPONSE_TYPE_OK;
 		}
 	}
-	if ((in[index] == '%') && (isxdigit(in[index + 1])) && isxdigit(in[index + 2])) {
-		if (sscanf(&in[index + 1], "%2x", &tempInt) != 1) {
-			return 0;
+	value = gena_trim(value);
+	if (length == strlen("CONTENT-LENGTH") && strncasecmp(line, "CONTENT-LENGTH", length) == 0) {
+		if (!isdigit((unsigned char) *value)) {
+			return GENA_RESPONSE_TYPE_BAD_REQUEST;
 		}
-		tempChar = (char) tempInt;
-		for (i = index + 3, j = index; j < (*max); i++, j++) {
-			in[j] = tempChar;
-			if (i < (*max)) {
-				tempChar = in[i];
-			} else {
-				tempChar = 0;
-			}
+		contentlength = strtoull(value, &end, 10);
+		if (*end != '\0') {
+			return GENA_RESPONSE_TYPE_BAD_REQUEST;
+		}
+		if (contentlength > GENA_CONTENT_MAX) {
+			return GENA_RESPONSE_TYPE_ENTITY_TOO_LARGE;
+		}
+		request->length = (unsigned int) contentlength;
+	} else if (length == strlen("CONNECTION") && strncasecmp(line, "CONNECTION", length) == 0) {
+		if (strcasestr(value, "close") != NULL) {
+			request->close = 1;
+		} else if (strcasestr(value, "keep-alive") != NULL) {
+			request->keepalive = 1;
 		}
-		(*max) -= 2;
-		return 1;
-	} else {
-		return 0;
 	}
+	return GENA_RESPONSE_TYPE_OK;
 }
 
-static int gena_remove_escaped_chars (char *in)
+static int gena_buffers_init (gena_buffers_t *buffers, unsigned int limit)
 {
-	size_t i = 0;
-	size_t size;
-	size = strlen(in);
-	for( i = 0; i < size; i++ ) {
-		if (gena_replace_escaped(in, i, &size) != 0) {
-			i--;
-		}
+	memset(buffers, 0, sizeof(gena_buffers_t));
+	buffers->limit = limit;
+	buffers->mutex = upnpd_thread_mutex_init("buffers->mutex", 0);
+	if (buffers->mutex == NULL) {
+		debugf(_DBG, "upnpd_thread_mutex_init() failed");
+		return -1;
 	}
 	return 0;
 }
 
-static void gena_senderrorheader (socket_t *socket, gena_response_type_t type)
+static void gena_buffers_uninit (gena_buffers_t *buffers)
 {
-	int len;
-	char *header;
+	void *buffer;
 	unsigned int i;
-	char tmpstr[80];
-	int responseNum = 0;
-	unsigned long long timer;
-	const char *mimetype = NULL;
-	const char *infoString = NULL;
-	const char *responseString = "";
-
-	timer = upnpd_time_gettimeofday();
-	header = (char *) malloc(GENA_HEADER_SIZE);
-	if (header == NULL) {
-		return;
-	}
-
-	for (i = 0; i < ARRAY_SIZE(gena_responses); i++) {
-		if (gena_responses[i].type == type) {
-			responseNum = gena_responses[i].code;
-			responseString = gena_responses[i].name;
-			infoString = gena_responses[i].info;
-			break;
+	for (i = 0; i < GENA_BUFFER_CLASSES; i++) {
+		while ((buffer = buffers->free[i]) != NULL) {
+			buffers->free[i] = *(void **) buffer;
+			free(buffer);
 		}
 	}
-	mimetype = "text/html";
-
-	upnpd_time_strftime(tmpstr, sizeof(tmpstr), TIME_FORMAT_RFC1123, timer, 0);
-	len = sprintf(header, "HTTP/1.0 %d %s\r\nContent-type: %s\r\n"
-			      "Date: %s\r\nConnection: close\r\n",
-			      responseNum, responseString, mimetype, tmpstr);
+	if (buffers->mutex != NULL) {
+		upnpd_thread_mutex_destroy(buffers->mutex);
+	}
+	memset(buffers, 0, sizeof(gena_buffers_t));
+}
 
-	header[len++] = '\r';
-	header[len++] = '\n';
-	if (infoString) {
-		len += sprintf(header + len,
-				"<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\n"
-				"<BODY><H1>%d %s</H1>\n%s\n</BODY></HTML>\n",
-				responseNum, responseString,
-				responseNum, responseString, infoString);
+static void * gena_buffer_get (gena_buffers_t *buffers, gena_buffer_cache_t *cache, gena_buffer_class_t class)
+{
+	void *buffer;
+	if (cache != NULL && cache->count[class] > 0) {
+		return cache->cache[class][--cache->count[class]];
 	}
-	header[len] = '\0';
-	debugf(_DBG, "sending header: %s", header);
-	if (gena_send(socket, GENA_SOCKET_TIMEOUT, header, len) != len) {
-		debugf(_DBG, "send() failed");
+	upnpd_thread_mutex_lock(buffers->mutex);
+	buffer = buffers->free[class];
+	if (buffer != NULL) {
+		buffers->free[class] = *(void **) buffer;
+		buffers->size -= gena_buffer_sizes[class];
 	}
-	free(header);
+	upnpd_thread_mutex_unlock(buffers->mutex);
+	if (buffer == NULL) {
+		buffer = malloc(gena_buffer_sizes[class]);
+	}
+	return buffer;
 }
 
-static void gena_sendfileheader (socket_t *socket, gena_fileinfo_internal_t *fileinfo)
+static void gena_buffer_put (gena_buffers_t *buffers, gena_buffer_cache_t *cache, gena_buffer_class_t class, void *buffer)
 {
-	int len;
-	char *header;
-	unsigned int i;
-	char tmpstr[80];
-	int responseNum = 0;
-	unsigned long long t;
-	unsigned long long timer;
-	const char *infoString = NULL;
-	const char *responseString = "";
-
-	gena_response_type_t type;
-
-	timer = upnpd_time_gettimeofday();
-	header = (char *) malloc(GENA_HEADER_SIZE);
-	if (header == NULL) {
+	if (buffer == NULL) {
 		return;
 	}
-
-	if (fileinfo->filerange.start == 0 && fileinfo->filerange.stop == 0) {
-		type = GENA_RESPONSE_TYPE_OK;
-	} else {
-		type = GENA_RESPONSE_TYPE_PARTIAL_CONTENT;
+	if (cache != NULL && cache->count[class] < GENA_BUFFER_CACHE) {
+		cache->cache[class][cache->count[class]++] = buffer;
+		return;
+	}
+	upnpd_thread_mutex_lock(buffers->mutex);
+	if (buffers->size + gena_buffer_sizes[class] <= buffers->limit) {
+		*(void **) buffer = buffers->free[class];
+		buffers->free[class] = buffer;
+		buffers->size += gena_buffer_sizes[class];
+		buffer = NULL;
 	}
+	upnpd_thread_mutex_unlock(buffers->mutex);
+	free(buffer);
+}
 
-	for (i = 0; i < ARRAY_SIZE(gena_responses); i++) {
-		if (gena_responses[i].type == type) {
-			responseNum = gena_responses[i].code;
-			responseString = gena_responses[i].name;
-			infoString = gena_responses[i].info;
-			break;
+static void gena_buffer_cache_flush (gena_buffer_cache_t *cache)
+{
+	unsigned int i;
+	for (i = 0; i < GENA_BUFFER_CLASSES; i++) {
+		while (cache->count[i] > 0) {
+			gena_buffer_put(cache->buffers, NULL, i, cache->cache[i][--cache->count[i]]);
 		}
 	}
+}
 
-	upnpd_time_strftime(tmpstr, sizeof(tmpstr), TIME_FORMAT_RFC1123, timer, 0);
-	len = sprintf(header, "HTTP/1.0 %d %s\r\n"
-	                      "Content-type: %s\r\n"
-			      "Date: %s\r\n"
-			      "Server: " SERVER_NAME "\r\n"
-			      "Connection: close\r\n",
-			      responseNum, responseString, fileinfo->fileinfo.mimetype, tmpstr);
-
-	t = fileinfo->fileinfo.mtime;
-	upnpd_time_strftime(tmpstr, sizeof(tmpstr), TIME_FORMAT_RFC1123, t * 1000, 0);
-	if (type == GENA_RESPONSE_TYPE_PARTIAL_CONTENT) {
-		len += sprintf(header + len,
-			"Accept-Ranges: bytes\r\n"
-			"Last-Modified: %s\r\n%s %llu\r\n",
-			tmpstr,
-			"Content-length:",
-			fileinfo->filerange.size);
-		len += sprintf(header + len,
-				"Content-Range: bytes %llu-%llu/%llu\r\n",
-				fileinfo->filerange.start,
-				fileinfo->filerange.stop,
-				fileinfo->fileinfo.size);
-	} else {
-		len += sprintf(header + len,
-			"%s"
-			"Last-Modified: %s\r\n"
-			"%s %llu\r\n",
-			(fileinfo->fileinfo.seekable != -1) ? "Accept-Ranges: bytes\r\n" : "",
-			tmpstr,
-			"Content-length:",
-			fileinfo->fileinfo.size);
+static void gena_socket_tune (socket_t *socket, gena_traffic_class_t class)
+{
+	const gena_socket_profile_t *profile;
+	profile = &gena_socket_profiles[class];
+	if (upnpd_socket_option_nodelay(socket, profile->nodelay) != 0) {
+		debugf(_DBG, "upnpd_socket_option_nodelay() failed");
+	}
+	if (upnpd_socket_option_keepalive(socket, profile->keepalive) != 0) {
+		debugf(_DBG, "upnpd_socket_option_keepalive() failed");
+	}
+	if (profile->sndbuf > 0 && upnpd_socket_option_sndbuf(socket, profile->sndbuf) != 0) {
+		debugf(_DBG, "upnpd_socket_option_sndbuf() failed");
 	}
+	if (profile->rcvbuf > 0 && upnpd_socket_option_rcvbuf(socket, profile->rcvbuf) != 0) {
+		debugf(_DBG, "upnpd_socket_option_rcvbuf() failed");
+	}
+}
 
-	header[len++] = '\r';
-	header[len++] = '\n';
-	if (infoString) {
-		len += sprintf(header + len,
-				"<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\n"
-				"<BODY><H1>%d %s</H1>\n%s\n</BODY></HTML>\n",
-				responseNum, responseString,
-				responseNum, responseString, infoString);
+static int gena_stats_init (gena_stats_t *stats)
+{
+	memset(stats, 0, sizeof(gena_stats_t));
+	strcpy(stats->actions[GENA_STATS_ACTIONS - 1].name, "other");
+	stats->mutex = upnpd_thread_mutex_init("stats->mutex", 0);
+	if (stats->mutex == NULL) {
+		debugf(_DBG, "upnpd_thread_mutex_init() failed");
+		return -1;
 	}
-	header[len] = '\0';
+	return 0;
+}
 
-	debugf(_DBG, "header: %s", header);
-	if (gena_send(socket, GENA_SOCKET_TIMEOUT, header, len) != len) {
-		debugf(_DBG, "send() failed");
+static void gena_stats_uninit (gena_stats_t *stats)
+{
+	if (stats->mutex != NULL) {
+		upnpd_thread_mutex_destroy(stats->mutex);
 	}
-	free(header);
 }
 
-static void gena_handler_unsubscribe (gena_thread_t *gena_thread, char *header, const char *path)
+static gena_stats_type_t gena_stats_type (gena_method_t method)
 {
-	gena_event_t event;
-	memset(&event, 0, sizeof(gena_event_t));
-	event.event.subscribe.path = strdup(path);
+	switch (method) {
+		case GENA_METHOD_GET:         return GENA_STATS_GET;
+		case GENA_METHOD_HEAD:        return GENA_STATS_HEAD;
+		case GENA_METHOD_POST:        return GENA_STATS_POST;
+		case GENA_METHOD_SUBSCRIBE:   return GENA_STATS_SUBSCRIBE;
+		case GENA_METHOD_UNSUBSCRIBE: return GENA_STATS_UNSUBSCRIBE;
+		default:                      return GENA_STATS_OTHER;
+	}
+}
 
-	while (1) {
-		if (gena_getline(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, GENA_HEADER_SIZE) <= 0) {
+static void gena_histogram_observe (gena_histogram_t *histogram, unsigned long long usecs)
+{
+	unsigned int i;
+	for (i = 0; i < GENA_STATS_BUCKETS && usecs > gena_stats_bounds[i]; i++) {
+	}
+	if (i < GENA_STATS_BUCKETS) {
+		upnpd_atomic_add(&histogram->buckets[i], 1);
+	}
+	upnpd_atomic_add(&histogram->sum, usecs);
+	upnpd_atomic_add(&histogram->count, 1);
+}
+
+/* returns the slot of action, names come from clients and are reduced to label safe characters */
+static int gena_stats_action (gena_stats_t *stats, const char *action)
+{
+	unsigned int i;
+	unsigned int n;
+	char name[GENA_STATS_NAME];
+	for (i = 0; i < GENA_STATS_NAME - 1 && action[i] != '\0'; i++) {
+		name[i] = (isalnum((unsigned char) action[i]) || action[i] == '_') ? action[i] : '_';
+	}
+	name[i] = '\0';
+	n = upnpd_atomic_get(&stats->nactions);
+	for (i = 0; i < n; i++) {
+		if (strcmp(stats->actions[i].name, name) == 0) {
+			return i;
+		}
+	}
+	upnpd_thread_mutex_lock(stats->mutex);
+	for (; i < stats->nactions; i++) {
+		if (strcmp(stats->actions[i].name, name) == 0) {
 			break;
 		}
-		if (strncasecmp(header, "HOST:", strlen("HOST:")) == 0) {
-			event.event.unsubscribe.host = strdup(gena_trim(header + strlen("HOST:")));
-		} else if (strncasecmp(header, "SID:", strlen("SID:")) == 0) {
-			event.event.unsubscribe.sid = strdup(gena_trim(header + strlen("SID:")));
+	}
+	if (i == stats->nactions) {
+		if (i < GENA_STATS_ACTIONS - 1) {
+			strcpy(stats->actions[i].name, name);
+			/* publishes the name to lookups without the mutex */
+			upnpd_atomic_add(&stats->nactions, 1);
+		} else {
+			i = GENA_STATS_ACTIONS - 1;
 		}
 	}
+	upnpd_thread_mutex_unlock(stats->mutex);
+	return i;
+}
 
-	debugf(_DBG, "unsubscribe event;\n"
-	       "  path    : '%s'\n"
-	       "  host    : '%s'\n"
-	       "  sid     : '%s'\n",
-	       event.event.unsubscribe.path,
-	       event.event.unsubscribe.host,
-	       event.event.unsubscribe.sid);
-
-	if (event.event.unsubscribe.path == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
+/* accounts the request once its response is sent completely, or the connection gave up on it */
+static void gena_connection_finish (gena_connection_t *connection, int complete)
+{
+	gena_stats_t *stats;
+	unsigned long long elapsed;
+	if (connection->started == 0) {
+		return;
 	}
-	if (gena_thread->callbacks == NULL ||
-	    gena_thread->callbacks->gena.event == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
-		goto out;
+	stats = &connection->gena->stats;
+	elapsed = upnpd_time_monotonic() - connection->started;
+	connection->started = 0;
+	if (complete == 0) {
+		upnpd_atomic_add(&stats->aborted, 1);
+		return;
 	}
+	upnpd_atomic_add(&stats->responses[connection->status], 1);
+	gena_histogram_observe(&stats->requests[gena_stats_type(connection->request.method)], elapsed);
+	if (connection->action >= 0) {
+		gena_histogram_observe(&stats->actions[connection->action].latency, elapsed);
+	}
+}
 
-	event.type = GENA_EVENT_TYPE_SUBSCRIBE_DROP;
-	if (gena_thread->callbacks->gena.event(gena_thread->callbacks->gena.cookie, &event) == 0) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_OK);
-		goto out;
+static void gena_connection_init (gena_connection_t *connection, gena_t *gena, socket_t *socket, gena_buffer_class_t streamclass)
+{
+	memset(connection, 0, sizeof(gena_connection_t));
+	connection->state = GENA_STATE_HEADER;
+	connection->gena = gena;
+	connection->socket = socket;
+	connection->callbacks = gena->callbacks;
+	connection->filefd = -1;
+	connection->advisefd = -1;
+	connection->slot = -1;
+	connection->streamclass = streamclass;
+	connection->timestamp = upnpd_time_gettimeofday();
+	connection->action = -1;
+	upnpd_atomic_add(&gena->stats.connections, 1);
+	upnpd_atomic_add(&gena->stats.active, 1);
+}
+
+/* buffers are taken from the cache of the thread serving the connection */
+static int gena_connection_buffers (gena_connection_t *connection, gena_buffer_cache_t *cache)
+{
+	gena_buffers_t *buffers;
+	buffers = &connection->gena->buffers;
+	connection->cache = cache;
+	connection->header = (char *) gena_buffer_get(buffers, cache, GENA_BUFFER_SMALL);
+	connection->data = (char *) gena_buffer_get(buffers, cache, GENA_BUFFER_SMALL);
+	if (connection->header == NULL || connection->data == NULL) {
+		gena_buffer_put(buffers, cache, GENA_BUFFER_SMALL, connection->header);
+		gena_buffer_put(buffers, cache, GENA_BUFFER_SMALL, connection->data);
+		connection->header = NULL;
+		connection->data = NULL;
+		return -1;
+	}
+	connection->header[0] = '\0';
+	connection->dataclass = GENA_BUFFER_SMALL;
+	connection->datasize = gena_buffer_sizes[GENA_BUFFER_SMALL];
+	return 0;
+}
+
+/* switches data buffer to the given size class, buffered bytes are dropped */
+static int gena_connection_data (gena_connection_t *connection, gena_buffer_class_t class)
+{
+	char *data;
+	gena_buffers_t *buffers;
+	if (connection->dataclass == class) {
+		return 0;
+	}
+	buffers = &connection->gena->buffers;
+	data = (char *) gena_buffer_get(buffers, connection->cache, class);
+	if (data == NULL) {
+		return -1;
+	}
+	/* keep queued bytes, buffers grow only while a response is being built */
+	if (connection->datalength > 0 && connection->datalength <= gena_buffer_sizes[class]) {
+		memcpy(data, connection->data, connection->datalength);
+	}
+	gena_buffer_put(buffers, connection->cache, connection->dataclass, connection->data);
+	connection->data = data;
+	connection->dataclass = class;
+	connection->datasize = gena_buffer_sizes[class];
+	return 0;
+}
+
+static int gena_stream_acquire (gena_t *gena)
+{
+	int rc;
+	rc = -1;
+	upnpd_thread_mutex_lock(gena->mutex);
+	if (gena->streams < gena->config.streams) {
+		gena->streams++;
+		rc = 0;
+	}
+	upnpd_thread_mutex_unlock(gena->mutex);
+	return rc;
+}
+
+static void gena_stream_release (gena_t *gena)
+{
+	upnpd_thread_mutex_lock(gena->mutex);
+	gena->streams--;
+	upnpd_thread_mutex_unlock(gena->mutex);
+}
+
+static unsigned long long gena_bucket_burst (unsigned long long rate)
+{
+	rate = rate * GENA_SHAPER_BURST / 1000;
+	return (rate < GENA_SHAPER_QUANTUM) ? GENA_SHAPER_QUANTUM : rate;
+}
+
+static void gena_bucket_init (gena_bucket_t *bucket, unsigned long long rate, unsigned long long now)
+{
+	bucket->rate = rate;
+	bucket->tokens = gena_bucket_burst(rate);
+	bucket->timestamp = now;
+}
+
+static void gena_bucket_refill (gena_bucket_t *bucket, unsigned long long now)
+{
+	unsigned long long burst;
+	if (bucket->rate == 0 || now <= bucket->timestamp) {
+		return;
+	}
+	burst = gena_bucket_burst(bucket->rate);
+	bucket->tokens += bucket->rate * (now - bucket->timestamp) / 1000;
+	if (bucket->tokens > burst) {
+		bucket->tokens = burst;
+	}
+	bucket->timestamp = now;
+}
+
+/* limits length to available tokens, returns ms to wait if less than need is available */
+static unsigned int gena_bucket_limit (gena_bucket_t *bucket, unsigned int *length, unsigned int need)
+{
+	if (bucket->rate == 0) {
+		return 0;
+	}
+	if (bucket->tokens < need) {
+		return (unsigned int) ((need - bucket->tokens) * 1000 / bucket->rate) + 1;
+	}
+	*length = MIN(*length, bucket->tokens);
+	return 0;
+}
+
+static void gena_bucket_consume (gena_bucket_t *bucket, unsigned int length)
+{
+	bucket->tokens = (bucket->tokens > length) ? bucket->tokens - length : 0;
+}
+
+static int gena_shaper_init (gena_shaper_t *shaper, gena_config_t *config)
+{
+	memset(shaper, 0, sizeof(gena_shaper_t));
+	list_init(&shaper->clients);
+	shaper->enabled = (config->streamrate > 0 || config->clientrate > 0 || config->totalrate > 0) ? 1 : 0;
+	gena_bucket_init(&shaper->bucket, config->totalrate, upnpd_time_gettimeofday());
+	shaper->mutex = upnpd_thread_mutex_init("shaper->mutex", 0);
+	if (shaper->mutex == NULL) {
+		debugf(_DBG, "upnpd_thread_mutex_init() failed");
+		return -1;
+	}
+	return 0;
+}
+
+static void gena_shaper_uninit (gena_shaper_t *shaper)
+{
+	gena_client_t *client;
+	gena_client_t *client_next;
+	list_for_each_entry_safe(client, client_next, &shaper->clients, head, gena_client_t) {
+		list_del(&client->head);
+		free(client);
+	}
+	if (shaper->mutex != NULL) {
+		upnpd_thread_mutex_destroy(shaper->mutex);
+	}
+	memset(shaper, 0, sizeof(gena_shaper_t));
+}
+
+static void gena_shaper_attach (gena_connection_t *connection)
+{
+	gena_client_t *client;
+	gena_shaper_t *shaper;
+	unsigned long long now;
+	char address[SOCKET_IP_LENGTH];
+
+	shaper = &connection->gena->shaper;
+	if (shaper->enabled == 0 || connection->client != NULL) {
+		return;
+	}
+	if (upnpd_socket_peername(connection->socket, address, NULL) != 0) {
+		debugf(_DBG, "upnpd_socket_peername() failed");
+		return;
+	}
+	now = upnpd_time_gettimeofday();
+	upnpd_thread_mutex_lock(shaper->mutex);
+	list_for_each_entry(client, &shaper->clients, head, gena_client_t) {
+		if (strcmp(client->address, address) == 0) {
+			goto found;
+		}
+	}
+	client = (gena_client_t *) malloc(sizeof(gena_client_t));
+	if (client == NULL) {
+		debugf(_DBG, "malloc(sizeof(gena_client_t)) failed");
+		upnpd_thread_mutex_unlock(shaper->mutex);
+		return;
+	}
+	memset(client, 0, sizeof(gena_client_t));
+	strcpy(client->address, address);
+	gena_bucket_init(&client->bucket, connection->gena->config.clientrate, now);
+	list_add(&client->head, &shaper->clients);
+found:
+	client->streams++;
+	shaper->streams++;
+	connection->client = client;
+	gena_bucket_init(&connection->bucket, connection->gena->config.streamrate, now);
+	upnpd_thread_mutex_unlock(shaper->mutex);
+}
+
+static void gena_shaper_detach (gena_connection_t *connection)
+{
+	gena_shaper_t *shaper;
+	if (connection->client == NULL) {
+		return;
+	}
+	shaper = &connection->gena->shaper;
+	upnpd_thread_mutex_lock(shaper->mutex);
+	shaper->streams--;
+	if (--connection->client->streams == 0) {
+		list_del(&connection->client->head);
+		free(connection->client);
+	}
+	upnpd_thread_mutex_unlock(shaper->mutex);
+	connection->client = NULL;
+	connection->resume = 0;
+}
+
+/*
+ * sets connection->quota to the bytes that may be sent now, returns 0, or
+ * ms to wait. every stream gets an equal share of client and total rates.
+ */
+static unsigned int gena_connection_throttle (gena_connection_t *connection)
+{
+	gena_t *gena;
+	unsigned int wait;
+	unsigned int need;
+	unsigned int length;
+	unsigned long long now;
+	unsigned long long rate;
+	gena_shaper_t *shaper;
+	gena_client_t *client;
+
+	length = MIN(connection->fileinfo.filerange.size - connection->filesent, GENA_SENDFILE_SIZE);
+	connection->quota = length;
+	if (connection->client == NULL) {
+		return 0;
+	}
+	gena = connection->gena;
+	shaper = &gena->shaper;
+	client = connection->client;
+	need = MIN(length, GENA_SHAPER_QUANTUM);
+	now = upnpd_time_gettimeofday();
+
+	upnpd_thread_mutex_lock(shaper->mutex);
+	rate = gena->config.streamrate;
+	if (gena->config.clientrate > 0 && (rate == 0 || gena->config.clientrate / client->streams < rate)) {
+		rate = gena->config.clientrate / client->streams;
+	}
+	if (gena->config.totalrate > 0 && (rate == 0 || gena->config.totalrate / shaper->streams < rate)) {
+		rate = gena->config.totalrate / shaper->streams;
+	}
+	connection->bucket.rate = rate;
+	gena_bucket_refill(&connection->bucket, now);
+	gena_bucket_refill(&client->bucket, now);
+	gena_bucket_refill(&shaper->bucket, now);
+	wait = gena_bucket_limit(&connection->bucket, &connection->quota, need);
+	length = gena_bucket_limit(&client->bucket, &connection->quota, need);
+	wait = MAX(wait, length);
+	length = gena_bucket_limit(&shaper->bucket, &connection->quota, need);
+	wait = MAX(wait, length);
+	upnpd_thread_mutex_unlock(shaper->mutex);
+
+	if (wait > 0) {
+		connection->quota = 0;
+		return MIN(wait, GENA_SHAPER_BURST);
+	}
+	return 0;
+}
+
+static void gena_connection_consume (gena_connection_t *connection, unsigned int length)
+{
+	gena_shaper_t *shaper;
+	connection->quota -= MIN(connection->quota, length);
+	upnpd_atomic_add(&connection->gena->stats.bytes, length);
+	if (connection->client == NULL) {
+		return;
+	}
+	shaper = &connection->gena->shaper;
+	upnpd_thread_mutex_lock(shaper->mutex);
+	gena_bucket_consume(&connection->bucket, length);
+	gena_bucket_consume(&connection->client->bucket, length);
+	gena_bucket_consume(&shaper->bucket, length);
+	upnpd_thread_mutex_unlock(shaper->mutex);
+}
+
+static void gena_connection_uninit (gena_connection_t *connection)
+{
+	if (connection->filehandle != NULL) {
+		debugf(_DBG, "closing file");
+		connection->callbacks->vfs.close(connection->callbacks->vfs.cookie, connection->filehandle);
+		connection->filehandle = NULL;
+	}
+	if (connection->streaming == 1) {
+		gena_shaper_detach(connection);
+		gena_stream_release(connection->gena);
+		connection->streaming = 0;
+	}
+	gena_request_uninit(&connection->request);
+	free(connection->fileinfo.fileinfo.mimetype);
+	free(connection->response);
+	upnpd_atomic_add(&connection->gena->stats.active, -1);
+	gena_buffer_put(&connection->gena->buffers, connection->cache, GENA_BUFFER_SMALL, connection->header);
+	gena_buffer_put(&connection->gena->buffers, connection->cache, connection->dataclass, connection->data);
+	connection->fileinfo.fileinfo.mimetype = NULL;
+	connection->response = NULL;
+	connection->header = NULL;
+	connection->data = NULL;
+}
+
+static int gena_connection_keepalive (gena_connection_t *connection)
+{
+	gena_request_t *request;
+	request = &connection->request;
+	if (connection->requests + 1 >= connection->gena->config.keepalive_requests) {
+		return 0;
+	}
+	if (request->close == 1) {
+		return 0;
+	}
+	if (request->version >= 11 || request->keepalive == 1) {
+		return 1;
+	}
+	return 0;
+}
+
+static void gena_connection_reset (gena_connection_t *connection)
+{
+	if (connection->filehandle != NULL) {
+		connection->callbacks->vfs.close(connection->callbacks->vfs.cookie, connection->filehandle);
+		connection->filehandle = NULL;
+	}
+	if (connection->streaming == 1) {
+		gena_shaper_detach(connection);
+		gena_stream_release(connection->gena);
+		connection->streaming = 0;
+	}
+	gena_request_uninit(&connection->request);
+	free(connection->fileinfo.fileinfo.mimetype);
+	free(connection->response);
+	memset(&connection->fileinfo, 0, sizeof(gena_fileinfo_internal_t));
+	connection->response = NULL;
+	connection->responselength = 0;
+	connection->responseoffset = 0;
+	connection->datalength = 0;
+	connection->dataoffset = 0;
+	if (connection->dataclass != GENA_BUFFER_SMALL) {
+		/* idle connections hold only small buffers */
+		gena_connection_data(connection, GENA_BUFFER_SMALL);
+	}
+	connection->filefd = -1;
+	connection->advisefd = -1;
+	connection->filesent = 0;
+	connection->subscribed = 0;
+	connection->contentlength = 0;
+	connection->keepalive = 0;
+	connection->status = GENA_RESPONSE_TYPE_OK;
+	connection->action = -1;
+	connection->state = GENA_STATE_HEADER;
+	/* keep pipelined bytes of the next request */
+	connection->headerlength -= connection->headerused;
+	memmove(connection->header, connection->header + connection->headerused, connection->headerlength);
+	connection->header[connection->headerlength] = '\0';
+	connection->headerused = 0;
+	connection->requests++;
+}
+
+static const char * gena_connection_header (gena_connection_t *connection)
+{
+	return (connection->keepalive == 1) ? "keep-alive" : "close";
+}
+
+static const char * gena_connection_date (gena_connection_t *connection)
+{
+	unsigned long long second;
+	second = upnpd_time_gettimeofday() / 1000;
+	if (connection->datesecond == second) {
+		return connection->date;
+	}
+	upnpd_time_strftime(connection->date, sizeof(connection->date), TIME_FORMAT_RFC1123, second * 1000, 0);
+	connection->datesecond = second;
+	return connection->date;
+}
+
+static int gena_connection_printf (gena_connection_t *connection, const char *format, ...)
+{
+	int len;
+	va_list ap;
+	va_start(ap, format);
+	len = vsnprintf(connection->data + connection->datalength, connection->datasize - connection->datalength, format, ap);
+	va_end(ap);
+	if (len < 0 || len >= (int) (connection->datasize - connection->datalength)) {
+		debugf(_DBG, "response does not fit into connection buffer");
+		return -1;
+	}
+	connection->datalength += len;
+	return len;
+}
+
+static void gena_senderrorheader (gena_connection_t *connection, gena_response_type_t type)
+{
+	int len;
+	char body[512];
+	int responseNum = 0;
+	const char *mimetype = NULL;
+	const char *infoString = NULL;
+	const char *responseString = "";
+
+	responseNum = gena_responses[type].code;
+	responseString = gena_responses[type].name;
+	infoString = gena_responses[type].info;
+	mimetype = "text/html";
+
+	/* an error response replaces anything queued so far */
+	connection->status = type;
+	connection->datalength = 0;
+	connection->dataoffset = 0;
+
+	len = 0;
+	if (infoString) {
+		len = snprintf(body, sizeof(body),
+				"<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\n"
+				"<BODY><H1>%d %s</H1>\n%s\n</BODY></HTML>\n",
+				responseNum, responseString,
+				responseNum, responseString, infoString);
+	}
+
+	gena_connection_printf(connection,
+			"%sContent-type: %s\r\n"
+			"Date: %s\r\nConnection: %s\r\n"
+			"Content-Length: %d\r\n",
+			gena_responses[type].status, mimetype,
+			gena_connection_date(connection),
+			gena_connection_header(connection), len);
+	if (type == GENA_RESPONSE_TYPE_SERVICE_UNAVAILABLE) {
+		gena_connection_printf(connection, "Retry-After: %d\r\n", GENA_RETRY_AFTER);
+	}
+	if (type == GENA_RESPONSE_TYPE_RANGE_NOT_SATISFIABLE) {
+		gena_connection_printf(connection, "Content-Range: bytes */%llu\r\n", connection->fileinfo.fileinfo.size);
+	}
+	gena_connection_printf(connection, "\r\n%s", (infoString) ? body : "");
+	debugf(_DBG, "sending header: %.*s", connection->datalength, connection->data);
+}
+
+static void gena_sendnotmodified (gena_connection_t *connection)
+{
+	gena_fileinfo_internal_t *fileinfo;
+
+	fileinfo = &connection->fileinfo;
+	connection->status = GENA_RESPONSE_TYPE_NOT_MODIFIED;
+	connection->datalength = 0;
+	connection->dataoffset = 0;
+
+	gena_connection_printf(connection,
+			"%s"
+			"Date: %s\r\n"
+			"Server: " SERVER_NAME "\r\n"
+			"Connection: %s\r\n"
+			"ETag: %s\r\n"
+			"Last-Modified: %s\r\n"
+			"\r\n",
+			gena_responses[GENA_RESPONSE_TYPE_NOT_MODIFIED].status,
+			gena_connection_date(connection),
+			gena_connection_header(connection),
+			fileinfo->etag,
+			fileinfo->lastmodified);
+	debugf(_DBG, "header: %.*s", connection->datalength, connection->data);
+}
+
+static void gena_sendfileheader (gena_connection_t *connection)
+{
+	gena_response_type_t type;
+	gena_fileinfo_internal_t *fileinfo;
+
+	fileinfo = &connection->fileinfo;
+	type = (fileinfo->nranges > 0) ? GENA_RESPONSE_TYPE_PARTIAL_CONTENT : GENA_RESPONSE_TYPE_OK;
+	connection->status = type;
+
+	gena_connection_printf(connection,
+			"%s"
+			"Date: %s\r\n"
+			"Server: " SERVER_NAME "\r\n"
+			"Connection: %s\r\n"
+			"Last-Modified: %s\r\n",
+			gena_responses[type].status,
+			gena_connection_date(connection),
+			gena_connection_header(connection),
+			fileinfo->lastmodified);
+	if (fileinfo->fileinfo.seekable != -1) {
+		gena_connection_printf(connection,
+				"Accept-Ranges: bytes\r\n"
+				"ETag: %s\r\n",
+				fileinfo->etag);
+	}
+	if (fileinfo->nranges > 1) {
+		gena_connection_printf(connection, "Content-type: multipart/byteranges; boundary=" GENA_BOUNDARY "\r\n");
 	} else {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
+		gena_connection_printf(connection, "Content-type: %s\r\n", fileinfo->fileinfo.mimetype);
+	}
+	if (fileinfo->nranges == 1) {
+		gena_connection_printf(connection,
+				"Content-Range: bytes %llu-%llu/%llu\r\n",
+				fileinfo->filerange.start,
+				fileinfo->filerange.stop,
+				fileinfo->fileinfo.size);
+	}
+	if (fileinfo->chunked == 1) {
+		gena_connection_printf(connection, "Transfer-Encoding: chunked\r\n\r\n");
+	} else if (fileinfo->fileinfo.size == GENA_FILESIZE_UNKNOWN) {
+		/* http/1.0 client, body ends when connection is closed */
+		gena_connection_printf(connection, "\r\n");
+	} else {
+		gena_connection_printf(connection, "Content-length: %llu\r\n\r\n", fileinfo->length);
+	}
+
+	debugf(_DBG, "header: %.*s", connection->datalength, connection->data);
+}
+
+static void gena_handler_unsubscribe (gena_connection_t *connection)
+{
+	gena_event_t event;
+	gena_request_t *request;
+
+	request = &connection->request;
+	memset(&event, 0, sizeof(gena_event_t));
+	event.event.unsubscribe.path = request->path;
+	event.event.unsubscribe.host = request->host;
+	event.event.unsubscribe.sid = request->sid;
+
+	debugf(_DBG, "unsubscribe event;\n"
+	       "  path    : '%s'\n"
+	       "  host    : '%s'\n"
+	       "  sid     : '%s'\n",
+	       event.event.unsubscribe.path,
+	       event.event.unsubscribe.host,
+	       event.event.unsubscribe.sid);
+
+	if (connection->callbacks == NULL ||
+	    connection->callbacks->gena.event == NULL) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
+		return;
 	}
 
-	gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
-out:
-	free(event.event.unsubscribe.path);
-	free(event.event.unsubscribe.host);
-	free(event.event.unsubscribe.sid);
+	if (event.event.unsubscribe.sid == NULL) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
+		return;
+	}
+	event.type = GENA_EVENT_TYPE_SUBSCRIBE_DROP;
+	if (connection->callbacks->gena.event(connection->callbacks->gena.cookie, &event) == 0) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_OK);
+	} else {
+		/* unknown or expired subscription */
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
+	}
 }
 
-static void gena_handler_subscribe (gena_thread_t *gena_thread, char *header, const char *path)
+static void gena_handler_subscribe (gena_connection_t *connection)
 {
+	int rc;
+	gena_event_t event;
+	gena_request_t *request;
 	const char *fmt =
 		"HTTP/1.1 200 OK\r\n"
 		"SID: %s\r\n"
 		"Timeout: Second-%d\r\n"
-		"Connection: close\r\n"
+		"Connection: %s\r\n"
 		"Content-Type: text/xml\r\n"
 		"Server: " SERVER_NAME "\r\n"
 		"Content-Length: 0\r\n"
 		"\r\n";
 
-	gena_event_t event;
+	request = &connection->request;
 	memset(&event, 0, sizeof(gena_event_t));
-	event.event.subscribe.path = strdup(path);
-
-	while (1) {
-		if (gena_getline(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, GENA_HEADER_SIZE) <= 0) {
-			break;
-		}
-		if (strncasecmp(header, "HOST:", strlen("HOST:")) == 0) {
-			event.event.subscribe.host = strdup(gena_trim(header + strlen("HOST:")));
-		} else if (strncasecmp(header, "NT:", strlen("NT:")) == 0) {
-			event.event.subscribe.nt = strdup(gena_trim(header + strlen("NT:")));
-		} else if (strncasecmp(header, "CALLBACK:", strlen("CALLBACK:")) == 0) {
-			event.event.subscribe.callback = strdup(gena_trim(header + strlen("CALLBACK:")));
-		} else if (strncasecmp(header, "SCOPE:", strlen("SCOPE:")) == 0) {
-			event.event.subscribe.scope = strdup(gena_trim(header + strlen("SCOPE:")));
-		} else if (strncasecmp(header, "TIMEOUT:", strlen("TIMEOUT:")) == 0) {
-			event.event.subscribe.timeout = strdup(gena_trim(header + strlen("TIMEOUT:")));
-		} else if (strncasecmp(header, "SID:", strlen("SID:")) == 0) {
-			event.event.subscribe.sid = strdup(gena_trim(header + strlen("SID:")));
-		}
-	}
+	event.event.subscribe.path = request->path;
+	event.event.subscribe.host = request->host;
+	event.event.subscribe.nt = request->nt;
+	event.event.subscribe.callback = request->callback;
+	event.event.subscribe.scope = request->scope;
+	event.event.subscribe.timeout = request->timeout;
+	event.event.subscribe.sid = request->sid;
 
 	debugf(_DBG, "subscribe event;\n"
 	       "  path    : '%s'\n"
@@ -544,126 +1492,135 @@ static void gena_handler_subscribe (gena_thread_t *gena_thread, char *header, co
 	       event.event.subscribe.timeout,
 	       event.event.subscribe.sid);
 
-	if (event.event.subscribe.path == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
-	}
-	if (gena_thread->callbacks == NULL ||
-	    gena_thread->callbacks->gena.event == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
-		goto out;
+	if (connection->callbacks == NULL ||
+	    connection->callbacks->gena.event == NULL) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
+		return;
 	}
 	if (event.event.subscribe.nt != NULL) {
 		/* Subscription */
 		if (strcasecmp(event.event.subscribe.nt, "upnp:event") != 0) {
-			gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
-			goto out;
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
+			return;
 		}
 		if (event.event.subscribe.sid != NULL) {
-			gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_BAD_REQUEST);
-			goto out;
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_BAD_REQUEST);
+			return;
 		}
 		if (event.event.subscribe.callback == NULL) {
-			gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
-			goto out;
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
+			return;
 		}
 		event.type = GENA_EVENT_TYPE_SUBSCRIBE_REQUEST;
-		if (gena_thread->callbacks->gena.event(gena_thread->callbacks->gena.cookie, &event) == 0) {
-			sprintf(header, fmt, event.event.subscribe.sid, 1800);
-			debugf(_DBG, "header:\n%s", header);
-			if (gena_send(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, strlen(header)) != strlen(header)) {
-				debugf(_DBG, "send() failed");
-			} else {
-				event.type = GENA_EVENT_TYPE_SUBSCRIBE_ACCEPT;
-				gena_thread->callbacks->gena.event(gena_thread->callbacks->gena.cookie, &event);
-			}
-			goto out;
-		} else {
-			gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-			goto out;
-		}
 	} else {
 		/* Renewal */
-		event.type = GENA_EVENT_TYPE_SUBSCRIBE_RENEW;
-		if (gena_thread->callbacks->gena.event(gena_thread->callbacks->gena.cookie, &event) == 0) {
-			sprintf(header, fmt, event.event.subscribe.sid, 1800);
-			debugf(_DBG, "header:\n%s", header);
-			if (gena_send(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, strlen(header)) != strlen(header)) {
-				debugf(_DBG, "send() failed");
-			} else {
-				event.type = GENA_EVENT_TYPE_SUBSCRIBE_ACCEPT;
-				gena_thread->callbacks->gena.event(gena_thread->callbacks->gena.cookie, &event);
-			}
-			goto out;
-		} else {
-			gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-			goto out;
+		if (event.event.subscribe.sid == NULL ||
+		    event.event.subscribe.callback != NULL) {
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_BAD_REQUEST);
+			return;
 		}
+		event.type = GENA_EVENT_TYPE_SUBSCRIBE_RENEW;
+	}
+	rc = connection->callbacks->gena.event(connection->callbacks->gena.cookie, &event);
+	if (event.event.subscribe.sid != request->sid) {
+		/* sid is allocated by the subscription callback */
+		request->newsid = event.event.subscribe.sid;
+		request->sid = request->newsid;
+	}
+	if (rc != 0) {
+		/* a renewal of an unknown or expired subscription */
+		gena_senderrorheader(connection, (event.type == GENA_EVENT_TYPE_SUBSCRIBE_RENEW) ? GENA_RESPONSE_TYPE_PRECONDITION_FAILED : GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
+		return;
+	}
+	if (gena_connection_printf(connection, fmt, request->sid, (event.event.subscribe.duration > 0) ? event.event.subscribe.duration : 1800, gena_connection_header(connection)) < 0) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
+		return;
 	}
+	debugf(_DBG, "header:\n%.*s", connection->datalength, connection->data);
+	/* accept event is delivered once the response is sent, renewals do not
+	 * get the initial event again */
+	if (event.type == GENA_EVENT_TYPE_SUBSCRIBE_REQUEST) {
+		connection->subscribed = 1;
+	}
+}
+
+static void gena_handler_subscribed (gena_connection_t *connection)
+{
+	gena_event_t event;
+	gena_request_t *request;
+
+	request = &connection->request;
+	memset(&event, 0, sizeof(gena_event_t));
+	event.type = GENA_EVENT_TYPE_SUBSCRIBE_ACCEPT;
+	event.event.subscribe.path = request->path;
+	event.event.subscribe.host = request->host;
+	event.event.subscribe.nt = request->nt;
+	event.event.subscribe.callback = request->callback;
+	event.event.subscribe.scope = request->scope;
+	event.event.subscribe.timeout = request->timeout;
+	event.event.subscribe.sid = request->sid;
+	connection->callbacks->gena.event(connection->callbacks->gena.cookie, &event);
+}
 
-	gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
-out:
-	free(event.event.subscribe.path);
-	free(event.event.subscribe.host);
-	free(event.event.subscribe.nt);
-	free(event.event.subscribe.callback);
-	free(event.event.subscribe.scope);
-	free(event.event.subscribe.timeout);
-	free(event.event.subscribe.sid);
+/* asks the device whether the posted path takes actions, before memory
+ * is committed to the body */
+static int gena_connection_control (gena_connection_t *connection)
+{
+	gena_event_t event;
+	if (connection->callbacks == NULL ||
+	    connection->callbacks->gena.event == NULL) {
+		return -1;
+	}
+	memset(&event, 0, sizeof(gena_event_t));
+	event.type = GENA_EVENT_TYPE_ACTION_REQUEST;
+	event.event.action.path = connection->request.path;
+	event.event.action.host = connection->request.host;
+	return connection->callbacks->gena.event(connection->callbacks->gena.cookie, &event);
 }
 
-static void gena_handler_post (gena_thread_t *gena_thread, char *header, const char *path)
+static void gena_handler_post (gena_connection_t *connection)
 {
+	int rc;
 	char *ptr;
 	gena_event_t event;
+	gena_request_t *request;
 	const char *format =
 		"HTTP/1.1 200 OK\r\n"
 		"CONTENT-LENGTH: %u\r\n"
 		"CONTENT-TYPE: text/xml\r\n"
+		"Connection: %s\r\n"
 		"\r\n";
 
+	request = &connection->request;
 	memset(&event, 0, sizeof(gena_event_t));
 
-	event.event.action.path = strdup(path);
-
-	while (1) {
-		if (gena_getline(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, GENA_HEADER_SIZE) <= 0) {
-			break;
-		}
-		if (strncasecmp(header, "HOST:", strlen("HOST:")) == 0) {
-			event.event.action.host = strdup(gena_trim(header + strlen("HOST:")));
-		} else if (strncasecmp(header, "CONTENT-LENGTH:", strlen("CONTENT-LENGTH:")) == 0) {
-			event.event.action.length = atol(gena_trim(header + strlen("CONTENT-LENGTH:")));
-		} else if (strncasecmp(header, "SOAPACTION:", strlen("SOAPACTION:")) == 0) {
-			event.event.action.serviceid = strdup(gena_trim(header + strlen("SOAPACTION:")));
-		}
-	}
-	if (event.event.action.length == 0 ||
-	    event.event.action.host == NULL ||
-	    event.event.action.serviceid == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
-		goto out;
-	}
-	event.event.action.request = (char *) malloc(sizeof(char) * (event.event.action.length + 1));
-	if (event.event.action.request == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
+	if (request->length == 0 ||
+	    request->host == NULL ||
+	    request->soapaction == NULL) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
+		return;
 	}
-	if (gena_getcontent(gena_thread->socket, GENA_SOCKET_TIMEOUT, event.event.action.request, event.event.action.length) != event.event.action.length) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_BAD_REQUEST);
-		goto out;
+	if (request->content == NULL) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_BAD_REQUEST);
+		return;
 	}
-	event.event.action.request[event.event.action.length] = '\0';
 
-	ptr = strchr(event.event.action.serviceid, '#');
+	ptr = strchr(request->soapaction, '#');
 	if (ptr == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
-		goto out;
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_PRECONDITION_FAILED);
+		return;
 	}
 	*ptr++ = '\0';
-	event.event.action.action = ptr;
+	/* unknown actions share the last slot */
+	connection->action = GENA_STATS_ACTIONS - 1;
 
 	event.type = GENA_EVENT_TYPE_ACTION;
+	event.event.action.path = request->path;
+	event.event.action.host = request->host;
+	event.event.action.serviceid = request->soapaction;
+	event.event.action.action = ptr;
+	event.event.action.request = request->content;
+	event.event.action.length = request->length;
 
 	debugf(_DBG, "post event;\n"
 	       "  path: '%s'\n"
@@ -679,522 +1636,2130 @@ static void gena_handler_post (gena_thread_t *gena_thread, char *header, const c
 	       event.event.action.length,
 	       event.event.action.request);
 
-	if (event.event.subscribe.path == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
+	if (connection->callbacks == NULL ||
+	    connection->callbacks->gena.event == NULL) {
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
+		return;
 	}
-	if (gena_thread->callbacks == NULL ||
-	    gena_thread->callbacks->gena.event == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
-		goto out;
+	rc = connection->callbacks->gena.event(connection->callbacks->gena.cookie, &event);
+	if (event.event.action.valid == 1) {
+		connection->action = gena_stats_action(&connection->gena->stats, ptr);
 	}
-	if (gena_thread->callbacks->gena.event(gena_thread->callbacks->gena.cookie, &event) == 0) {
+	if (rc == 0 &&
+	    event.event.action.response != NULL) {
 		debugf(_DBG, "sending action response");
-		sprintf(header, format, strlen(event.event.action.response));
-		if (gena_send(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, strlen(header)) != strlen(header)) {
-			debugf(_DBG, "send() failed");
-		} else if (gena_send(gena_thread->socket, GENA_SOCKET_TIMEOUT, event.event.action.response, strlen(event.event.action.response)) != strlen(event.event.action.response)) {
-			debugf(_DBG, "send() failed");
+		connection->response = event.event.action.response;
+		connection->responselength = strlen(event.event.action.response);
+		connection->responseoffset = 0;
+		if (gena_connection_printf(connection, format, connection->responselength, gena_connection_header(connection)) < 0) {
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
 		}
-		goto out;
+		return;
 	}
-	gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-
-out:
-	free(event.event.action.serviceid);
-	free(event.event.action.request);
 	free(event.event.action.response);
-	free(event.event.action.host);
-	free(event.event.action.path);
+	gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
 }
 
-static void * gena_thread_loop (void *arg)
+/*
+ * keeps a window ahead of the cursor being read in by the kernel while the
+ * socket drains, so that disk and network latencies overlap. pages behind
+ * the cursor of large streams are dropped, one long stream should not push
+ * everything else out of the page cache.
+ */
+static void gena_connection_readahead (gena_connection_t *connection)
 {
-	int running;
-	gena_thread_t *gena_thread;
+	unsigned long long end;
+	unsigned long long cursor;
+	unsigned long long length;
+
+	if (connection->advisefd < 0) {
+		return;
+	}
+	cursor = connection->fileoffset + connection->fileinfo.filerange.start + connection->filesent;
+	end = connection->fileoffset + connection->fileinfo.filerange.start + connection->fileinfo.filerange.size;
+	if (connection->advised < cursor) {
+		connection->advised = cursor;
+	}
+	if (connection->advised < end && connection->advised - cursor < GENA_READAHEAD_WINDOW / 2) {
+		length = MIN(cursor + GENA_READAHEAD_WINDOW, end) - connection->advised;
+		upnpd_file_advise(connection->advisefd, connection->advised, length, FILE_ADVICE_WILLNEED);
+		connection->advised += length;
+	}
+	if (connection->dropped > cursor) {
+		connection->dropped = cursor;
+	}
+	if (connection->fileinfo.fileinfo.size >= GENA_DROPBEHIND_SIZE &&
+	    cursor - connection->dropped >= GENA_READAHEAD_WINDOW) {
+		upnpd_file_advise(connection->advisefd, connection->dropped, cursor - connection->dropped, FILE_ADVICE_DONTNEED);
+		connection->dropped = cursor;
+	}
+}
 
+/* appends next piece of file to data, framed as a chunk if requested, returns queued length */
+static int gena_connection_fill (gena_connection_t *connection)
+{
+	int rc;
 	char *data;
-	char *header;
-	int rangerequest;
+	unsigned int length;
+	unsigned int reserved;
+	char chunk[GENA_CHUNK_HEADER_SIZE + 1];
+	gena_fileinfo_internal_t *fileinfo;
+
+	fileinfo = &connection->fileinfo;
+	if (fileinfo->filerange.size - connection->filesent > connection->datasize - connection->datalength &&
+	    gena_connection_data(connection, connection->streamclass) != 0) {
+		debugf(_DBG, "gena_connection_data() failed");
+	}
+	reserved = (fileinfo->chunked == 1) ? GENA_CHUNK_HEADER_SIZE + strlen(GENA_CHUNK_TRAILER) : 0;
+	if (connection->datalength + reserved >= connection->datasize) {
+		debugf(_DBG, "no space left in connection buffer");
+		return -1;
+	}
+	data = connection->data + connection->datalength;
+	length = MIN(connection->quota, connection->datasize - connection->datalength - reserved);
+	rc = connection->callbacks->vfs.read(connection->callbacks->vfs.cookie, connection->filehandle, data + ((fileinfo->chunked == 1) ? GENA_CHUNK_HEADER_SIZE : 0), length);
+	if (rc < 0 || (rc == 0 && fileinfo->fileinfo.size != GENA_FILESIZE_UNKNOWN)) {
+		debugf(_DBG, "read failed");
+		return -1;
+	}
+	gena_connection_consume(connection, rc);
+	if (rc == 0) {
+		debugf(_DBG, "stream finished after %llu bytes", connection->filesent);
+		fileinfo->filerange.size = connection->filesent;
+		if (fileinfo->chunked == 1) {
+			gena_connection_printf(connection, GENA_CHUNK_END);
+		}
+		return connection->datalength;
+	}
+	connection->filesent += rc;
+	gena_connection_readahead(connection);
+	if (fileinfo->chunked == 1) {
+		snprintf(chunk, sizeof(chunk), GENA_CHUNK_HEADER, rc);
+		memcpy(data, chunk, GENA_CHUNK_HEADER_SIZE);
+		memcpy(data + GENA_CHUNK_HEADER_SIZE + rc, GENA_CHUNK_TRAILER, strlen(GENA_CHUNK_TRAILER));
+		connection->datalength += rc + reserved;
+	} else {
+		connection->datalength += rc;
+	}
+	return connection->datalength;
+}
 
-	char *tmpptr;
-	char *urlptr;
-	char *pathptr;
-	static const char request_get[] = "GET";
-	static const char request_head[] = "HEAD";
-	static const char request_post[] = "POST";
-	static const char request_subscribe[] = "SUBSCRIBE";
-	static const char request_unsubscribe[] = "UNSUBSCRIBE";
+static int gena_etag_match (const char *list, const char *etag)
+{
+	size_t length;
+	const char *ptr;
+	length = strlen(etag);
+	for (ptr = list; ptr != NULL; ptr = strchr(ptr, ',')) {
+		while (*ptr == ',' || *ptr == ' ' || *ptr == '\t') {
+			ptr++;
+		}
+		if (*ptr == '*') {
+			return 1;
+		}
+		/* weak comparison */
+		if (strncmp(ptr, "W/", 2) == 0) {
+			ptr += 2;
+		}
+		if (strncmp(ptr, etag, length) == 0 &&
+		    (ptr[length] == '\0' || ptr[length] == ',' || ptr[length] == ' ' || ptr[length] == '\t')) {
+			return 1;
+		}
+	}
+	return 0;
+}
 
-	int rlen;
-	int readlen;
+/* returns number of satisfiable ranges, 0 if header should be ignored, -1 if none is satisfiable */
+static int gena_parse_ranges (gena_fileinfo_internal_t *fileinfo, char *value)
+{
+	char *ptr;
+	unsigned int count;
+	unsigned long long size;
+	unsigned long long start;
+	unsigned long long stop;
+
+	if (strncasecmp(value, "bytes=", strlen("bytes=")) != 0) {
+		return 0;
+	}
+	count = 0;
+	size = fileinfo->fileinfo.size;
+	ptr = value + strlen("bytes=");
+	while (1) {
+		while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') {
+			ptr++;
+		}
+		if (*ptr == '\0') {
+			break;
+		}
+		if (*ptr == '-') {
+			/* suffix range, last n bytes */
+			if (!isdigit((unsigned char) ptr[1])) {
+				return 0;
+			}
+			stop = strtoull(ptr + 1, &ptr, 10);
+			if (stop == 0 || size == 0) {
+				goto next;
+			}
+			start = (stop < size) ? size - stop : 0;
+			stop = size - 1;
+		} else if (isdigit((unsigned char) *ptr)) {
+			start = strtoull(ptr, &ptr, 10);
+			if (*ptr != '-') {
+				return 0;
+			}
+			ptr++;
+			if (isdigit((unsigned char) *ptr)) {
+				stop = strtoull(ptr, &ptr, 10);
+				if (stop < start) {
+					return 0;
+				}
+			} else {
+				stop = size - 1;
+			}
+			if (start >= size) {
+				goto next;
+			}
+			stop = MIN(stop, size - 1);
+		} else {
+			return 0;
+		}
+		if (count == GENA_RANGES_MAX) {
+			debugf(_DBG, "too many ranges, sending whole file");
+			return 0;
+		}
+		fileinfo->ranges[count].start = start;
+		fileinfo->ranges[count].stop = stop;
+		fileinfo->ranges[count].size = stop - start + 1;
+		count++;
+next:
+		while (*ptr == ' ' || *ptr == '\t') {
+			ptr++;
+		}
+		if (*ptr != ',' && *ptr != '\0') {
+			return 0;
+		}
+	}
+	return (count > 0) ? (int) count : -1;
+}
+
+static int gena_handler_notmodified (gena_connection_t *connection)
+{
+	unsigned long long since;
+	gena_request_t *request;
+	gena_fileinfo_internal_t *fileinfo;
+
+	request = &connection->request;
+	fileinfo = &connection->fileinfo;
+	if (fileinfo->fileinfo.seekable == -1) {
+		return 0;
+	}
+	if (request->ifnonematch != NULL) {
+		return gena_etag_match(request->ifnonematch, fileinfo->etag);
+	}
+	if (request->ifmodifiedsince != NULL) {
+		since = upnpd_time_strptime(request->ifmodifiedsince, TIME_FORMAT_RFC1123);
+		return (since != 0 && fileinfo->fileinfo.mtime <= since / 1000) ? 1 : 0;
+	}
+	return 0;
+}
+
+static int gena_handler_ifrange (gena_connection_t *connection)
+{
+	gena_request_t *request;
+	gena_fileinfo_internal_t *fileinfo;
+
+	request = &connection->request;
+	fileinfo = &connection->fileinfo;
+	if (request->ifrange == NULL) {
+		return 1;
+	}
+	if (request->ifrange[0] == '"') {
+		/* strong comparison */
+		return (strcmp(request->ifrange, fileinfo->etag) == 0) ? 1 : 0;
+	}
+	return (upnpd_time_strptime(request->ifrange, TIME_FORMAT_RFC1123) == fileinfo->fileinfo.mtime * 1000) ? 1 : 0;
+}
+
+static void gena_handler_file (gena_connection_t *connection)
+{
+	int rc;
+	unsigned int i;
 	void *filehandle;
-	gena_fileinfo_internal_t fileinfo;
+	gena_request_t *request;
+	gena_fileinfo_internal_t *fileinfo;
 
-	gena_thread = (gena_thread_t *) arg;
+	request = &connection->request;
+	fileinfo = &connection->fileinfo;
 
-	upnpd_thread_mutex_lock(gena_thread->mutex);
-	debugf(_DBG, "started gena child thread");
-	running = 1;
-	gena_thread->running = 1;
-	upnpd_thread_cond_signal(gena_thread->cond);
-	upnpd_thread_mutex_unlock(gena_thread->mutex);
-
-	data = NULL;
-	header = NULL;
-	pathptr = NULL;
-	rangerequest = 0;
-	memset(&fileinfo, 0, sizeof(gena_fileinfo_internal_t));
-	data = (char *) malloc(GENA_DATA_SIZE);
-	if (data == NULL) {
-		goto out;
+	/* do real job */
+	if (connection->callbacks == NULL ||
+	    connection->callbacks->vfs.info == NULL ||
+	    connection->callbacks->vfs.open == NULL ||
+	    connection->callbacks->vfs.read == NULL ||
+	    connection->callbacks->vfs.seek == NULL ||
+	    connection->callbacks->vfs.close == NULL) {
+		debugf(_DBG, "no callbacks installed");
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
+		return;
 	}
-	header = (char *) malloc(GENA_HEADER_SIZE);
-	if (header == NULL) {
-		goto out;
+
+	debugf(_DBG, "reading file info");
+	if (connection->callbacks->vfs.info(connection->callbacks->vfs.cookie, request->path, &fileinfo->fileinfo) < 0) {
+		debugf(_DBG, "info failed");
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_NOT_FOUND);
+		return;
 	}
-	if (gena_getline(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, GENA_HEADER_SIZE) <= 0) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_BAD_REQUEST);
-		goto out;
+
+	if (fileinfo->fileinfo.size == GENA_FILESIZE_UNKNOWN) {
+		/* length is known only when producer finishes, no validators or ranges either */
+		fileinfo->fileinfo.seekable = -1;
+		if (request->version >= 11) {
+			fileinfo->chunked = 1;
+		} else {
+			connection->keepalive = 0;
+		}
 	}
 
-	/* parse method */
-	urlptr = strpbrk(header, " \t");
-	if (urlptr == NULL) {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_BAD_REQUEST);
-		goto out;
+	/* strong validator, changes whenever size or modification time does */
+	snprintf(fileinfo->etag, sizeof(fileinfo->etag), "\"%llx-%llx\"", fileinfo->fileinfo.mtime, fileinfo->fileinfo.size);
+	upnpd_time_strftime(fileinfo->lastmodified, sizeof(fileinfo->lastmodified), TIME_FORMAT_RFC1123, fileinfo->fileinfo.mtime * 1000, 0);
+	if (gena_handler_notmodified(connection) == 1) {
+		debugf(_DBG, "not modified");
+		gena_sendnotmodified(connection);
+		return;
 	}
-	*urlptr++ = '\0';
-	if (strcasecmp(header, request_get) != 0 &&
-	    strcasecmp(header, request_head) != 0 &&
-	    strcasecmp(header, request_post) != 0 &&
-	    strcasecmp(header, request_subscribe) != 0 &&
-	    strcasecmp(header, request_unsubscribe) != 0) {
-		debugf(_DBG, "unsupported header: '%s'", header);
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
-		goto out;
+
+	fileinfo->nranges = 0;
+	if (request->range != NULL &&
+	    fileinfo->fileinfo.seekable != -1 &&
+	    gena_handler_ifrange(connection) == 1) {
+		rc = gena_parse_ranges(fileinfo, request->range);
+		if (rc < 0) {
+			debugf(_DBG, "range not satisfiable '%s'", request->range);
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_RANGE_NOT_SATISFIABLE);
+			return;
+		}
+		fileinfo->nranges = rc;
+		upnpd_atomic_add(&connection->gena->stats.ranges, 1);
 	}
-	debugf(_DBG, "header: %s", header);
-	while (*urlptr && (*urlptr == ' ' || *urlptr == '\t')) {
-		urlptr++;
+
+	debugf(_DBG, "calculating actual size");
+	/* calculate actual size */
+	fileinfo->range = 0;
+	if (fileinfo->nranges == 0) {
+		fileinfo->filerange.start = 0;
+		fileinfo->filerange.stop = (fileinfo->fileinfo.size > 0) ? fileinfo->fileinfo.size - 1 : 0;
+		fileinfo->filerange.size = fileinfo->fileinfo.size;
+		fileinfo->length = fileinfo->fileinfo.size;
+	} else if (fileinfo->nranges == 1) {
+		fileinfo->filerange = fileinfo->ranges[0];
+		fileinfo->length = fileinfo->filerange.size;
+	} else {
+		fileinfo->filerange = fileinfo->ranges[0];
+		fileinfo->length = strlen(GENA_MULTIPART_END);
+		for (i = 0; i < fileinfo->nranges; i++) {
+			fileinfo->length += snprintf(NULL, 0, GENA_MULTIPART_HEADER, fileinfo->fileinfo.mimetype,
+					fileinfo->ranges[i].start, fileinfo->ranges[i].stop, fileinfo->fileinfo.size);
+			fileinfo->length += fileinfo->ranges[i].size;
+		}
 	}
-	if (urlptr[0] != '/') {
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_BAD_REQUEST);
-		goto out;
+	debugf(_DBG, "sending %u ranges, %llu bytes", fileinfo->nranges, fileinfo->length);
+
+	/* long running transfers may not use up the capacity reserved for control requests */
+	if (request->method == GENA_METHOD_GET && fileinfo->length > GENA_STREAM_SIZE) {
+		if (gena_stream_acquire(connection->gena) != 0) {
+			debugf(_DBG, "too many streams");
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_SERVICE_UNAVAILABLE);
+			return;
+		}
+		connection->streaming = 1;
+		gena_socket_tune(connection->socket, GENA_TRAFFIC_STREAM);
+		gena_shaper_attach(connection);
 	}
-	tmpptr = urlptr;
-	while (*tmpptr && (*tmpptr != ' ' && *tmpptr != '\t')) {
-		tmpptr++;
+
+	if (request->method == GENA_METHOD_HEAD) {
+		debugf(_DBG, "only header is requested");
+		gena_sendfileheader(connection);
+		return;
 	}
-	*tmpptr = '\0';
-	pathptr = strdup(urlptr);
-	if (pathptr == NULL) {
-		debugf(_DBG, "strdup(%s) failed", urlptr);
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
+
+	debugf(_DBG, "opening file");
+	filehandle = connection->callbacks->vfs.open(connection->callbacks->vfs.cookie, request->path, GENA_FILEMODE_READ);
+	if (filehandle == NULL) {
+		debugf(_DBG, "open failed");
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
+		return;
 	}
-	gena_remove_escaped_chars(pathptr);
-	debugf(_DBG, "requested url is: %s", pathptr);
 
-	if (strcasecmp(header, request_unsubscribe) == 0) {
-		debugf(_DBG, "gena unsubscribe event");
-		gena_handler_unsubscribe(gena_thread, header, pathptr);
-		goto out;
+	debugf(_DBG, "seeking file");
+	/* seek if requested */
+	if (fileinfo->filerange.start != 0 &&
+	    connection->callbacks->vfs.seek(connection->callbacks->vfs.cookie, filehandle, fileinfo->filerange.start, GENA_SEEK_SET) != fileinfo->filerange.start) {
+		debugf(_DBG, "seek failed");
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
+		connection->callbacks->vfs.close(connection->callbacks->vfs.cookie, filehandle);
+		return;
 	}
-	if (strcasecmp(header, request_subscribe) == 0) {
-		debugf(_DBG, "gena subscribe event");
-		gena_handler_subscribe(gena_thread, header, pathptr);
-		goto out;
+
+	debugf(_DBG, "sending file header");
+	gena_sendfileheader(connection);
+	if (fileinfo->nranges > 1) {
+		gena_connection_printf(connection, GENA_MULTIPART_HEADER, fileinfo->fileinfo.mimetype,
+				fileinfo->filerange.start, fileinfo->filerange.stop, fileinfo->fileinfo.size);
+	}
+	connection->filehandle = filehandle;
+	connection->filesent = 0;
+	if (connection->callbacks->vfs.fd != NULL && fileinfo->fileinfo.size != GENA_FILESIZE_UNKNOWN) {
+		connection->filefd = connection->callbacks->vfs.fd(connection->callbacks->vfs.cookie, filehandle, &connection->fileoffset);
+		/* keep the offset of file start, ranges are added while sending */
+		connection->fileoffset -= fileinfo->filerange.start;
+		if (connection->filefd >= 0) {
+			connection->advisefd = connection->filefd;
+			connection->advised = 0;
+			connection->dropped = connection->fileoffset + fileinfo->filerange.start;
+			upnpd_file_advise(connection->advisefd, connection->fileoffset, 0, FILE_ADVICE_SEQUENTIAL);
+			gena_connection_readahead(connection);
+		}
 	}
-	if (strcasecmp(header, request_post) == 0) {
-		debugf(_DBG, "gena post event");
-		gena_handler_post(gena_thread, header, pathptr);
-		goto out;
+	if (connection->filefd < 0 &&
+	    connection->filesent < fileinfo->filerange.size &&
+	    gena_connection_throttle(connection) == 0 &&
+	    gena_connection_fill(connection) < 0) {
+		/* header is not sent yet, first body bytes go out with it */
+		gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
+		connection->callbacks->vfs.close(connection->callbacks->vfs.cookie, filehandle);
+		connection->filehandle = NULL;
+	}
+}
+
+/* moves to the next part of a multipart response, part header is queued into data */
+static int gena_connection_nextrange (gena_connection_t *connection)
+{
+	gena_fileinfo_internal_t *fileinfo;
+
+	fileinfo = &connection->fileinfo;
+	if (fileinfo->nranges < 2 || fileinfo->range >= fileinfo->nranges) {
+		return 0;
+	}
+	connection->datalength = 0;
+	connection->dataoffset = 0;
+	connection->filesent = 0;
+	connection->advised = 0;
+	fileinfo->range++;
+	if (fileinfo->range == fileinfo->nranges) {
+		memset(&fileinfo->filerange, 0, sizeof(gena_filerange_t));
+		gena_connection_printf(connection, GENA_MULTIPART_END);
+		return 1;
+	}
+	fileinfo->filerange = fileinfo->ranges[fileinfo->range];
+	if (connection->callbacks->vfs.seek(connection->callbacks->vfs.cookie, connection->filehandle, fileinfo->filerange.start, GENA_SEEK_SET) != fileinfo->filerange.start) {
+		debugf(_DBG, "seek failed");
+		return -1;
+	}
+	gena_connection_printf(connection, GENA_MULTIPART_HEADER, fileinfo->fileinfo.mimetype,
+			fileinfo->filerange.start, fileinfo->filerange.stop, fileinfo->fileinfo.size);
+	return 1;
+}
+
+/* queued data is followed by a response body or by sendfile */
+static int gena_connection_more (gena_connection_t *connection)
+{
+	if (connection->response != NULL && connection->responseoffset < connection->responselength) {
+		return 1;
+	}
+	if (connection->filehandle != NULL && connection->filefd >= 0 && connection->filesent < connection->fileinfo.filerange.size) {
+		return 1;
+	}
+	return 0;
+}
+
+static int gena_connection_sendfile (gena_connection_t *connection)
+{
+	int rc;
+	rc = upnpd_socket_sendfile(connection->socket, connection->filefd, connection->fileoffset + connection->fileinfo.filerange.start + connection->filesent, connection->quota);
+	if (rc > 0) {
+		gena_connection_consume(connection, rc);
+		connection->filesent += rc;
+		gena_connection_readahead(connection);
+		return rc;
+	}
+	if (rc != SOCKET_AGAIN && connection->filesent == 0) {
+		/* file position is still at range start, fall back to read and send */
+		debugf(_DBG, "sendfile failed, falling back to read");
+		connection->filefd = -1;
+		return 0;
+	}
+	if (rc == 0) {
+		/* file is shorter than the size reported for it, as in fill */
+		debugf(_DBG, "premature end of file after %llu bytes", connection->filesent);
+		return -1;
+	}
+	return rc;
+}
+
+static void gena_connection_process (gena_connection_t *connection)
+{
+	switch (connection->request.method) {
+		case GENA_METHOD_UNSUBSCRIBE:
+			debugf(_DBG, "gena unsubscribe event");
+			gena_handler_unsubscribe(connection);
+			break;
+		case GENA_METHOD_SUBSCRIBE:
+			debugf(_DBG, "gena subscribe event");
+			gena_handler_subscribe(connection);
+			break;
+		case GENA_METHOD_POST:
+			debugf(_DBG, "gena post event");
+			gena_handler_post(connection);
+			break;
+		case GENA_METHOD_GET:
+		case GENA_METHOD_HEAD:
+			gena_handler_file(connection);
+			break;
+		default:
+			gena_senderrorheader(connection, GENA_RESPONSE_TYPE_NOT_IMPLEMENTED);
+			break;
+	}
+}
+
+static char * gena_header_end (char *buffer)
+{
+	char *ptr;
+	for (ptr = buffer; (ptr = strchr(ptr, '\n')) != NULL; ptr++) {
+		if (ptr[1] == '\n') {
+			return ptr + 2;
+		}
+		if (ptr[1] == '\r' && ptr[2] == '\n') {
+			return ptr + 3;
+		}
+	}
+	return NULL;
+}
+
+static int gena_connection_parse (gena_connection_t *connection, char *end)
+{
+	char *line;
+	char *next;
+	unsigned int length;
+	gena_response_type_t type;
+	gena_request_t *request;
+
+	request = &connection->request;
+	for (line = connection->header; line < end; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		length = strlen(line);
+		if (length > 0 && line[length - 1] == '\r') {
+			line[--length] = '\0';
+		}
+		debugf(_DBG, "%s", line);
+		if (line == connection->header) {
+			if (length == 0) {
+				gena_senderrorheader(connection, GENA_RESPONSE_TYPE_BAD_REQUEST);
+				return -1;
+			}
+			type = gena_request_start(request, line);
+			if (type != GENA_RESPONSE_TYPE_OK) {
+				gena_senderrorheader(connection, type);
+				return -1;
+			}
+		} else if (length > 0) {
+			type = gena_request_header(request, line);
+			if (type != GENA_RESPONSE_TYPE_OK) {
+				gena_senderrorheader(connection, type);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int gena_connection_recv (gena_connection_t *connection)
+{
+	int rc;
+	char *end;
+	unsigned int length;
+	gena_request_t *request;
+
+	request = &connection->request;
+	if (connection->state == GENA_STATE_HEADER) {
+		end = gena_header_end(connection->header);
+		if (end == NULL) {
+			rc = upnpd_socket_recv(connection->socket, connection->header + connection->headerlength, GENA_HEADER_SIZE - 1 - connection->headerlength);
+			if (rc == SOCKET_AGAIN) {
+				return 0;
+			}
+			if (rc <= 0) {
+				return -1;
+			}
+			connection->headerlength += rc;
+			connection->header[connection->headerlength] = '\0';
+			end = gena_header_end(connection->header);
+		}
+		if (connection->started == 0) {
+			/* first bytes of request, pipelined ones are already buffered */
+			connection->started = upnpd_time_monotonic();
+		}
+		if (end == NULL) {
+			if (connection->headerlength >= GENA_HEADER_SIZE - 1) {
+				gena_senderrorheader(connection, GENA_RESPONSE_TYPE_BAD_REQUEST);
+				return 1;
+			}
+			return 0;
+		}
+		connection->headerused = end - connection->header;
+		length = connection->headerlength - connection->headerused;
+		if (gena_connection_parse(connection, end) != 0) {
+			return 1;
+		}
+		connection->keepalive = gena_connection_keepalive(connection);
+		if (request->method == GENA_METHOD_POST && request->length > 0) {
+			if (gena_connection_control(connection) != 0) {
+				/* body is left unread */
+				connection->keepalive = 0;
+				gena_senderrorheader(connection, GENA_RESPONSE_TYPE_NOT_FOUND);
+				return 1;
+			}
+			request->content = (char *) malloc(sizeof(char) * (request->length + 1));
+			if (request->content == NULL) {
+				connection->keepalive = 0;
+				gena_senderrorheader(connection, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
+				return 1;
+			}
+			connection->contentlength = MIN(length, request->length);
+			memcpy(request->content, end, connection->contentlength);
+			connection->headerused += connection->contentlength;
+			connection->state = GENA_STATE_CONTENT;
+		}
+	}
+	if (connection->state == GENA_STATE_CONTENT && connection->contentlength < request->length) {
+		rc = upnpd_socket_recv(connection->socket, request->content + connection->contentlength, request->length - connection->contentlength);
+		if (rc == SOCKET_AGAIN) {
+			return 0;
+		}
+		if (rc <= 0) {
+			return -1;
+		}
+		connection->contentlength += rc;
+		if (connection->contentlength < request->length) {
+			return 0;
+		}
+	}
+	if (request->content != NULL) {
+		request->content[request->length] = '\0';
+	}
+	gena_connection_process(connection);
+	return 1;
+}
+
+static int gena_connection_read (gena_connection_t *connection)
+{
+	int rc;
+	unsigned long long now;
+	unsigned long long deadline;
+	poll_item_t pitem;
+	/* total deadline for the whole request, a slow client can not hold the worker */
+	deadline = upnpd_time_gettimeofday() + GENA_SOCKET_TIMEOUT;
+	while ((rc = gena_connection_recv(connection)) == 0) {
+		now = upnpd_time_gettimeofday();
+		if (now >= deadline) {
+			debugf(_DBG, "request read timed out");
+			return -1;
+		}
+		pitem.item = connection->socket;
+		pitem.events = POLL_EVENT_IN;
+		rc = upnpd_socket_poll(&pitem, 1, (int) (deadline - now));
+		if (rc <= 0 || (pitem.revents & POLL_EVENT_IN) == 0) {
+			debugf(_DBG, "poll failed rc:%d(0x%x)", rc, pitem.revents);
+			return -1;
+		}
+	}
+	return rc;
+}
+
+static int gena_connection_request (gena_connection_t *connection)
+{
+	int rlen;
+	gena_pool_t *pool;
+	poll_item_t pitem;
+
+	pool = &connection->gena->pool;
+
+	if (gena_connection_read(connection) < 0) {
+		return -1;
+	}
+
+	/* header is corked when body follows from another buffer or from sendfile */
+	if (gena_send(connection->socket, GENA_SOCKET_TIMEOUT, connection->data, connection->datalength, gena_connection_more(connection)) != connection->datalength) {
+		debugf(_DBG, "send() failed");
+		return -1;
+	}
+	connection->datalength = 0;
+	if (connection->response != NULL &&
+	    gena_send(connection->socket, GENA_SOCKET_TIMEOUT, connection->response, connection->responselength, 0) != connection->responselength) {
+		debugf(_DBG, "send() failed");
+		return -1;
+	}
+	if (connection->subscribed == 1) {
+		gena_handler_subscribed(connection);
+	}
+	if (connection->filehandle == NULL) {
+		return 0;
+	}
+
+	debugf(_DBG, "sending file");
+	/* send file, one pass for each range of a multipart response */
+	while (1) {
+		while (connection->filesent < connection->fileinfo.filerange.size) {
+			rlen = gena_connection_throttle(connection);
+			if (rlen > 0) {
+				upnpd_time_usleep(rlen * 1000);
+			} else if (connection->filefd >= 0) {
+				pitem.item = connection->socket;
+				pitem.events = POLL_EVENT_OUT;
+				rlen = upnpd_socket_poll(&pitem, 1, GENA_SOCKET_TIMEOUT);
+				if (rlen <= 0 || (pitem.revents & POLL_EVENT_OUT) == 0) {
+					debugf(_DBG, "poll failed rc:%d(0x%x)", rlen, pitem.revents);
+					break;
+				}
+				if (gena_connection_sendfile(connection) == -1) {
+					debugf(_DBG, "sendfile() failed");
+					break;
+				}
+			} else {
+				rlen = gena_connection_fill(connection);
+				if (rlen < 0) {
+					break;
+				}
+				if (gena_send(connection->socket, GENA_SOCKET_TIMEOUT, connection->data, rlen, 0) != rlen) {
+					debugf(_DBG, "send() failed");
+					break;
+				}
+				connection->datalength = 0;
+			}
+			upnpd_thread_mutex_lock(pool->mutex);
+			if (pool->running == 0) {
+				upnpd_thread_mutex_unlock(pool->mutex);
+				break;
+			}
+			upnpd_thread_mutex_unlock(pool->mutex);
+		}
+		if (connection->filesent != connection->fileinfo.filerange.size) {
+			debugf(_DBG, "file send failed");
+			return -1;
+		}
+		rlen = gena_connection_nextrange(connection);
+		if (rlen < 0) {
+			return -1;
+		}
+		if (rlen == 0) {
+			break;
+		}
+		if (gena_send(connection->socket, GENA_SOCKET_TIMEOUT, connection->data, connection->datalength, gena_connection_more(connection)) != connection->datalength) {
+			debugf(_DBG, "send() failed");
+			return -1;
+		}
+		connection->datalength = 0;
+	}
+	return 0;
+}
+
+static int gena_connection_idle (gena_connection_t *connection)
+{
+	int rc;
+	int running;
+	unsigned int timeout;
+	gena_pool_t *pool;
+	poll_item_t pitem;
+
+	pool = &connection->gena->pool;
+	if (gena_header_end(connection->header) != NULL) {
+		/* next request is already buffered */
+		return 0;
+	}
+	for (timeout = 0; timeout < connection->gena->config.keepalive_timeout; timeout += GENA_KEEPALIVE_POLL) {
+		pitem.item = connection->socket;
+		pitem.events = POLL_EVENT_IN;
+		rc = upnpd_socket_poll(&pitem, 1, GENA_KEEPALIVE_POLL);
+		if (rc < 0) {
+			return -1;
+		}
+		if (rc > 0) {
+			return ((pitem.revents & POLL_EVENT_IN) != 0) ? 0 : -1;
+		}
+		upnpd_thread_mutex_lock(pool->mutex);
+		running = (pool->running == 1 && pool->npending == 0);
+		upnpd_thread_mutex_unlock(pool->mutex);
+		if (running == 0) {
+			/* idle connection gives up the worker for queued ones */
+			return -1;
+		}
+	}
+	return -1;
+}
+
+static void gena_connection_serve (gena_connection_t *connection, gena_buffer_cache_t *cache)
+{
+	int rc;
+	if (gena_connection_buffers(connection, cache) != 0) {
+		debugf(_DBG, "gena_connection_buffers() failed");
+		gena_connection_uninit(connection);
+		return;
+	}
+	while (1) {
+		rc = gena_connection_request(connection);
+		gena_connection_finish(connection, (rc == 0) ? 1 : 0);
+		if (rc != 0 || connection->keepalive != 1) {
+			break;
+		}
+		gena_connection_reset(connection);
+		if (gena_connection_idle(connection) != 0) {
+			break;
+		}
+	}
+	gena_connection_uninit(connection);
+}
+
+static void * gena_pool_loop (void *arg)
+{
+	gena_pool_t *pool;
+	gena_buffer_cache_t cache;
+	gena_connection_t *connection;
+
+	pool = (gena_pool_t *) arg;
+	memset(&cache, 0, sizeof(gena_buffer_cache_t));
+	cache.buffers = pool->buffers;
+
+	upnpd_thread_mutex_lock(pool->mutex);
+	debugf(_DBG, "started gena worker thread");
+	pool->started++;
+	upnpd_thread_cond_broadcast(pool->cond);
+
+	while (1) {
+		while (pool->running == 1 && pool->npending == 0) {
+			upnpd_thread_cond_wait(pool->cond, pool->mutex);
+		}
+		if (pool->running == 0) {
+			break;
+		}
+		connection = list_first_entry(&pool->pending, gena_connection_t, head);
+		list_del(&connection->head);
+		pool->npending--;
+		upnpd_thread_mutex_unlock(pool->mutex);
+
+		gena_connection_serve(connection, &cache);
+		upnpd_socket_close(connection->socket);
+		free(connection);
+
+		upnpd_thread_mutex_lock(pool->mutex);
+	}
+
+	debugf(_DBG, "stopped gena worker thread");
+	upnpd_thread_mutex_unlock(pool->mutex);
+	gena_buffer_cache_flush(&cache);
+
+	return NULL;
+}
+
+static void gena_connection_reject (gena_t *gena, socket_t *socket)
+{
+	gena_connection_t connection;
+	gena_connection_init(&connection, gena, socket, GENA_BUFFER_SMALL);
+	if (gena_connection_buffers(&connection, NULL) != 0) {
+		gena_connection_uninit(&connection);
+		return;
+	}
+	gena_senderrorheader(&connection, GENA_RESPONSE_TYPE_SERVICE_UNAVAILABLE);
+	upnpd_socket_send(socket, connection.data, connection.datalength);
+	upnpd_atomic_add(&gena->stats.responses[GENA_RESPONSE_TYPE_SERVICE_UNAVAILABLE], 1);
+	gena_connection_uninit(&connection);
+}
+
+static int gena_pool_add (gena_t *gena, socket_t *socket)
+{
+	gena_pool_t *pool;
+	gena_connection_t *connection;
+	pool = &gena->pool;
+	upnpd_thread_mutex_lock(pool->mutex);
+	if (pool->npending >= gena->config.queue) {
+		upnpd_thread_mutex_unlock(pool->mutex);
+		debugf(_DBG, "gena queue is full");
+		gena_connection_reject(gena, socket);
+		return -1;
+	}
+	upnpd_thread_mutex_unlock(pool->mutex);
+	connection = (gena_connection_t *) malloc(sizeof(gena_connection_t));
+	if (connection == NULL) {
+		debugf(_DBG, "malloc(sizeof(gena_connection_t) failed");
+		return -1;
+	}
+	gena_connection_init(connection, gena, socket, GENA_BUFFER_LARGE);
+	upnpd_thread_mutex_lock(pool->mutex);
+	list_add_tail(&connection->head, &pool->pending);
+	pool->npending++;
+	upnpd_thread_cond_signal(pool->cond);
+	upnpd_thread_mutex_unlock(pool->mutex);
+	return 0;
+}
+
+static int gena_pool_init (gena_pool_t *pool, gena_buffers_t *buffers, unsigned int nthreads)
+{
+	unsigned int i;
+	memset(pool, 0, sizeof(gena_pool_t));
+	pool->buffers = buffers;
+	list_init(&pool->pending);
+	pool->threads = (thread_t **) malloc(sizeof(thread_t *) * nthreads);
+	if (pool->threads == NULL) {
+		debugf(_DBG, "malloc(sizeof(thread_t *)) failed");
+		return -1;
+	}
+	pool->mutex = upnpd_thread_mutex_init("pool->mutex", 0);
+	pool->cond = upnpd_thread_cond_init("pool->cond");
+	upnpd_thread_mutex_lock(pool->mutex);
+	pool->running = 1;
+	for (i = 0; i < nthreads; i++) {
+		pool->threads[i] = upnpd_thread_create("gena_pool_loop", gena_pool_loop, pool);
+		if (pool->threads[i] == NULL) {
+			break;
+		}
+	}
+	pool->nthreads = i;
+	while (pool->started != pool->nthreads) {
+		upnpd_thread_cond_wait(pool->cond, pool->mutex);
+	}
+	upnpd_thread_mutex_unlock(pool->mutex);
+	debugf(_DBG, "started %u gena worker threads", pool->nthreads);
+	return (pool->nthreads == nthreads) ? 0 : -1;
+}
+
+static int gena_pool_uninit (gena_pool_t *pool)
+{
+	unsigned int i;
+	gena_connection_t *connection;
+	gena_connection_t *connection_next;
+	if (pool->threads == NULL) {
+		return 0;
+	}
+	upnpd_thread_mutex_lock(pool->mutex);
+	pool->running = 0;
+	upnpd_thread_cond_broadcast(pool->cond);
+	upnpd_thread_mutex_unlock(pool->mutex);
+	for (i = 0; i < pool->nthreads; i++) {
+		upnpd_thread_join(pool->threads[i]);
+	}
+	list_for_each_entry_safe(connection, connection_next, &pool->pending, head, gena_connection_t) {
+		list_del(&connection->head);
+		gena_connection_uninit(connection);
+		upnpd_socket_close(connection->socket);
+		free(connection);
+	}
+	upnpd_thread_mutex_destroy(pool->mutex);
+	upnpd_thread_cond_destroy(pool->cond);
+	free(pool->threads);
+	pool->threads = NULL;
+	return 0;
+}
+
+/* submits next piece of file to the ring of reactor, returns 0 if submitted, 1 if ring is not used */
+static int gena_connection_ring (gena_connection_t *connection)
+{
+	unsigned int i;
+	unsigned int length;
+	gena_reactor_t *reactor;
+
+	reactor = connection->reactor;
+	if (reactor == NULL || reactor->ring == NULL || connection->quota == 0) {
+		return 1;
+	}
+	if (connection->slot < 0) {
+		for (i = 0; i < GENA_RING_SLOTS; i++) {
+			if (reactor->slots[i] == NULL && reactor->pending[i] == 0) {
+				break;
+			}
+		}
+		if (i == GENA_RING_SLOTS) {
+			/* all slots are busy, stream is sent with sendfile */
+			return 1;
+		}
+		reactor->slots[i] = connection;
+		connection->slot = i;
+	}
+	length = MIN(connection->quota, GENA_RING_SIZE);
+	if (upnpd_socket_ring_stream(reactor->ring, connection->slot, connection->socket, connection->filefd,
+			connection->fileoffset + connection->fileinfo.filerange.start + connection->filesent, length) != 0) {
+		debugf(_DBG, "upnpd_socket_ring_stream() failed");
+		return -1;
+	}
+	reactor->pending[connection->slot] += 2;
+	connection->ringing = 1;
+	connection->ringerror = 0;
+	connection->ringread = 0;
+	connection->ringsent = 0;
+	return 0;
+}
+
+static int gena_connection_send (gena_connection_t *connection)
+{
+	int rc;
+	unsigned int budget;
+
+	budget = 0;
+	while (budget < GENA_REACTOR_BUDGET) {
+		if (connection->dataoffset < connection->datalength) {
+			if (gena_connection_more(connection) == 1) {
+				rc = upnpd_socket_send_more(connection->socket, connection->data + connection->dataoffset, connection->datalength - connection->dataoffset);
+			} else {
+				rc = upnpd_socket_send(connection->socket, connection->data + connection->dataoffset, connection->datalength - connection->dataoffset);
+			}
+			if (rc == SOCKET_AGAIN) {
+				return 0;
+			}
+			if (rc <= 0) {
+				debugf(_DBG, "send() failed");
+				return -1;
+			}
+			connection->dataoffset += rc;
+			budget += rc;
+			continue;
+		}
+		if (connection->subscribed == 1) {
+			connection->subscribed = 0;
+			gena_handler_subscribed(connection);
+		}
+		if (connection->response != NULL && connection->responseoffset < connection->responselength) {
+			rc = upnpd_socket_send(connection->socket, connection->response + connection->responseoffset, connection->responselength - connection->responseoffset);
+			if (rc == SOCKET_AGAIN) {
+				return 0;
+			}
+			if (rc <= 0) {
+				debugf(_DBG, "send() failed");
+				return -1;
+			}
+			connection->responseoffset += rc;
+			budget += rc;
+			continue;
+		}
+		if (connection->filehandle != NULL && connection->filesent < connection->fileinfo.filerange.size) {
+			rc = gena_connection_throttle(connection);
+			if (rc > 0) {
+				connection->resume = upnpd_time_gettimeofday() + rc;
+				return 0;
+			}
+		}
+		if (connection->filehandle != NULL && connection->filefd >= 0 && connection->filesent < connection->fileinfo.filerange.size) {
+			rc = gena_connection_ring(connection);
+			if (rc <= 0) {
+				/* completion of submitted piece resumes connection */
+				return rc;
+			}
+			rc = gena_connection_sendfile(connection);
+			if (rc == SOCKET_AGAIN) {
+				return 0;
+			}
+			if (rc < 0) {
+				debugf(_DBG, "sendfile() failed");
+				return -1;
+			}
+			budget += rc;
+			continue;
+		}
+		if (connection->filehandle != NULL && connection->filesent < connection->fileinfo.filerange.size) {
+			connection->datalength = 0;
+			connection->dataoffset = 0;
+			if (gena_connection_fill(connection) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (connection->filehandle != NULL) {
+			rc = gena_connection_nextrange(connection);
+			if (rc < 0) {
+				return -1;
+			}
+			if (rc == 1) {
+				continue;
+			}
+		}
+		return 1;
+	}
+	/* give other connections a chance, level triggered wait returns at once */
+	return 0;
+}
+
+/* gives up ring slot, operations in flight are cancelled and slot is reused once they complete */
+static void gena_reactor_release (gena_reactor_t *reactor, gena_connection_t *connection)
+{
+	if (connection->slot < 0) {
+		return;
+	}
+	if (reactor->pending[connection->slot] > 0 &&
+	    upnpd_socket_ring_cancel(reactor->ring, connection->slot) == 0) {
+		reactor->pending[connection->slot] += 2;
+	}
+	reactor->slots[connection->slot] = NULL;
+	connection->slot = -1;
+	connection->ringing = 0;
+}
+
+static void gena_reactor_close (gena_reactor_t *reactor, gena_connection_t *connection)
+{
+	gena_connection_finish(connection, 0);
+	gena_reactor_release(reactor, connection);
+	upnpd_socket_event_del(reactor->event, connection->socket);
+	upnpd_thread_mutex_lock(reactor->mutex);
+	list_del(&connection->head);
+	upnpd_thread_mutex_unlock(reactor->mutex);
+	gena_connection_uninit(connection);
+	upnpd_socket_close(connection->socket);
+	free(connection);
+}
+
+static int gena_reactor_want (gena_reactor_t *reactor, gena_connection_t *connection, poll_event_t events)
+{
+	if (connection->events == events) {
+		return 0;
+	}
+	if (upnpd_socket_event_mod(reactor->event, connection->socket, events, connection) != 0) {
+		return -1;
+	}
+	connection->events = events;
+	return 0;
+}
+
+static void gena_reactor_handle (gena_reactor_t *reactor, gena_connection_t *connection, poll_event_t revents)
+{
+	int rc;
+	connection->timestamp = upnpd_time_gettimeofday();
+	if (connection->header == NULL &&
+	    gena_connection_buffers(connection, &reactor->cache) != 0) {
+		debugf(_DBG, "gena_connection_buffers() failed");
+		gena_reactor_close(reactor, connection);
+		return;
+	}
+	if (connection->state == GENA_STATE_SEND &&
+	    (revents & POLL_EVENT_ERR) != 0 && (revents & POLL_EVENT_OUT) == 0) {
+		gena_reactor_close(reactor, connection);
+		return;
+	}
+	if (connection->ringing == 1) {
+		/* piece in ring is not complete yet, errors are reported regardless of requested events */
+		if ((revents & POLL_EVENT_ERR) != 0) {
+			gena_reactor_close(reactor, connection);
+		}
+		return;
+	}
+	while (1) {
+		if (connection->state != GENA_STATE_SEND) {
+			if ((revents & (POLL_EVENT_IN | POLL_EVENT_ERR)) == 0) {
+				return;
+			}
+			rc = gena_connection_recv(connection);
+			if (rc < 0) {
+				gena_reactor_close(reactor, connection);
+				return;
+			}
+			if (rc == 0) {
+				if (gena_reactor_want(reactor, connection, POLL_EVENT_IN) != 0) {
+					gena_reactor_close(reactor, connection);
+				}
+				return;
+			}
+			connection->state = GENA_STATE_SEND;
+		}
+		rc = gena_connection_send(connection);
+		if (rc < 0) {
+			gena_reactor_close(reactor, connection);
+			return;
+		}
+		if (rc == 0) {
+			/* throttled streams are resumed by reactor loop, streams in ring by their completions */
+			if (gena_reactor_want(reactor, connection, (connection->resume != 0 || connection->ringing == 1) ? (poll_event_t) 0 : POLL_EVENT_OUT) != 0) {
+				gena_reactor_close(reactor, connection);
+			}
+			return;
+		}
+		gena_connection_finish(connection, 1);
+		if (connection->keepalive == 0) {
+			gena_reactor_close(reactor, connection);
+			return;
+		}
+		/* response is complete, continue with pipelined requests */
+		gena_reactor_release(reactor, connection);
+		gena_connection_reset(connection);
+		revents = POLL_EVENT_IN;
+	}
+}
+
+/* handles completed ring operations, a connection continues once all operations of its piece are done */
+static int gena_reactor_ring (gena_reactor_t *reactor, int wait)
+{
+	int i;
+	int rc;
+	unsigned int slot;
+	gena_connection_t *connection;
+	socket_ring_item_t items[GENA_REACTOR_EVENTS];
+
+	rc = upnpd_socket_ring_reap(reactor->ring, items, GENA_REACTOR_EVENTS, wait);
+	for (i = 0; i < rc; i++) {
+		slot = items[i].slot;
+		reactor->pending[slot]--;
+		connection = reactor->slots[slot];
+		if (connection == NULL) {
+			/* connection is closed, slot is free once pending drops to zero */
+			continue;
+		}
+		if (items[i].op == SOCKET_RING_READ) {
+			if (items[i].result == 0 || items[i].result == -1) {
+				connection->ringerror = 1;
+			} else if (items[i].result > 0) {
+				connection->ringread = items[i].result;
+			}
+		} else if (items[i].op == SOCKET_RING_SEND) {
+			if (items[i].result == -1) {
+				connection->ringerror = 1;
+			} else if (items[i].result > 0) {
+				gena_connection_consume(connection, items[i].result);
+				connection->ringsent += items[i].result;
+				connection->filesent += items[i].result;
+				gena_connection_readahead(connection);
+			}
+		}
+		if (reactor->pending[slot] > 0) {
+			continue;
+		}
+		connection->ringing = 0;
+		connection->timestamp = upnpd_time_gettimeofday();
+		if (connection->ringerror == 1) {
+			debugf(_DBG, "ring stream failed");
+			gena_reactor_close(reactor, connection);
+			continue;
+		}
+		if (connection->ringsent < (unsigned int) connection->ringread) {
+			/* short send, or send was cancelled after a short read */
+			if (upnpd_socket_ring_send(reactor->ring, slot, connection->socket, connection->ringsent, connection->ringread - connection->ringsent) != 0) {
+				debugf(_DBG, "upnpd_socket_ring_send() failed");
+				gena_reactor_close(reactor, connection);
+				continue;
+			}
+			reactor->pending[slot]++;
+			connection->ringing = 1;
+			continue;
+		}
+		gena_reactor_handle(reactor, connection, POLL_EVENT_OUT);
+	}
+	return rc;
+}
+
+static void * gena_reactor_loop (void *arg)
+{
+	int i;
+	int rc;
+	int running;
+	int throttled;
+	int completed;
+	list_t idle;
+	list_t resume;
+	unsigned long long now;
+	unsigned long long timeout;
+	gena_reactor_t *reactor;
+	gena_connection_t *connection;
+	gena_connection_t *connection_next;
+	socket_event_item_t items[GENA_REACTOR_EVENTS];
+
+	reactor = (gena_reactor_t *) arg;
+
+	upnpd_thread_mutex_lock(reactor->mutex);
+	debugf(_DBG, "started gena reactor thread");
+	running = 1;
+	reactor->running = 1;
+	upnpd_thread_cond_signal(reactor->cond);
+	upnpd_thread_mutex_unlock(reactor->mutex);
+
+	throttled = 0;
+	while (running == 1) {
+		rc = upnpd_socket_event_wait(reactor->event, items, GENA_REACTOR_EVENTS, (throttled == 1) ? GENA_SHAPER_TICK : GENA_REACTOR_TIMEOUT);
+
+		upnpd_thread_mutex_lock(reactor->mutex);
+		running = reactor->running;
+		upnpd_thread_mutex_unlock(reactor->mutex);
+		if (running == 0) {
+			break;
+		}
+
+		completed = 0;
+		for (i = 0; i < rc; i++) {
+			if (items[i].data == reactor) {
+				completed = 1;
+				continue;
+			}
+			gena_reactor_handle(reactor, (gena_connection_t *) items[i].data, items[i].revents);
+		}
+		if (completed == 1) {
+			/* completions may close connections, events of this round are handled before */
+			gena_reactor_ring(reactor, 0);
+		}
+
+		list_init(&idle);
+		list_init(&resume);
+		throttled = 0;
+		now = upnpd_time_gettimeofday();
+		upnpd_thread_mutex_lock(reactor->mutex);
+		list_for_each_entry_safe(connection, connection_next, &reactor->connections, head, gena_connection_t) {
+			if (connection->resume != 0) {
+				if (connection->resume <= now) {
+					list_del(&connection->head);
+					list_add(&connection->head, &resume);
+				} else {
+					throttled = 1;
+				}
+				continue;
+			}
+			timeout = GENA_SOCKET_TIMEOUT;
+			if (connection->state == GENA_STATE_HEADER && connection->headerlength == 0 && connection->requests > 0) {
+				timeout = connection->gena->config.keepalive_timeout;
+			}
+			if (now > connection->timestamp && now - connection->timestamp > timeout) {
+				list_del(&connection->head);
+				list_add(&connection->head, &idle);
+			}
+		}
+		upnpd_thread_mutex_unlock(reactor->mutex);
+		list_for_each_entry_safe(connection, connection_next, &idle, head, gena_connection_t) {
+			debugf(_DBG, "closing idle connection");
+			gena_reactor_close(reactor, connection);
+		}
+		list_for_each_entry_safe(connection, connection_next, &resume, head, gena_connection_t) {
+			list_del(&connection->head);
+			upnpd_thread_mutex_lock(reactor->mutex);
+			list_add(&connection->head, &reactor->connections);
+			upnpd_thread_mutex_unlock(reactor->mutex);
+			connection->resume = 0;
+			/* connection may be closed by handler, check again on next tick */
+			throttled = 1;
+			gena_reactor_handle(reactor, connection, POLL_EVENT_OUT);
+		}
+	}
+
+	debugf(_DBG, "closing remaining gena reactor connections");
+	list_for_each_entry_safe(connection, connection_next, &reactor->connections, head, gena_connection_t) {
+		gena_reactor_close(reactor, connection);
+	}
+	for (i = 0; reactor->ring != NULL && i < GENA_RING_SLOTS; i++) {
+		/* buffers of ring are in use until cancelled operations complete */
+		while (reactor->pending[i] > 0 && gena_reactor_ring(reactor, 1) >= 0) {
+		}
+	}
+	gena_buffer_cache_flush(&reactor->cache);
+
+	upnpd_thread_mutex_lock(reactor->mutex);
+	debugf(_DBG, "stopped gena reactor thread");
+	reactor->stopped = 1;
+	upnpd_thread_cond_signal(reactor->cond);
+	upnpd_thread_mutex_unlock(reactor->mutex);
+
+	return NULL;
+}
+
+static int gena_reactor_add (gena_reactor_t *reactor, gena_t *gena, socket_t *socket)
+{
+	gena_connection_t *connection;
+	connection = (gena_connection_t *) malloc(sizeof(gena_connection_t));
+	if (connection == NULL) {
+		debugf(_DBG, "malloc(sizeof(gena_connection_t) failed");
+		return -1;
+	}
+	gena_connection_init(connection, gena, socket, GENA_BUFFER_MEDIUM);
+	connection->reactor = reactor;
+	connection->events = POLL_EVENT_IN;
+	upnpd_thread_mutex_lock(reactor->mutex);
+	list_add(&connection->head, &reactor->connections);
+	upnpd_thread_mutex_unlock(reactor->mutex);
+	if (upnpd_socket_event_add(reactor->event, socket, POLL_EVENT_IN, connection) != 0) {
+		debugf(_DBG, "upnpd_socket_event_add() failed");
+		upnpd_thread_mutex_lock(reactor->mutex);
+		list_del(&connection->head);
+		upnpd_thread_mutex_unlock(reactor->mutex);
+		gena_connection_uninit(connection);
+		free(connection);
+		return -1;
+	}
+	return 0;
+}
+
+static int gena_reactor_init (gena_reactor_t *reactor, gena_buffers_t *buffers)
+{
+	memset(reactor, 0, sizeof(gena_reactor_t));
+	reactor->cache.buffers = buffers;
+	list_init(&reactor->connections);
+	reactor->event = upnpd_socket_event_init();
+	if (reactor->event == NULL) {
+		debugf(_DBG, "upnpd_socket_event_init() failed");
+		return -1;
+	}
+	reactor->ring = upnpd_socket_ring_init(GENA_RING_SLOTS, GENA_RING_SIZE);
+	if (reactor->ring != NULL &&
+	    upnpd_socket_event_add(reactor->event, upnpd_socket_ring_socket(reactor->ring), POLL_EVENT_IN, reactor) != 0) {
+		debugf(_DBG, "upnpd_socket_event_add() failed, streaming without ring");
+		upnpd_socket_ring_uninit(reactor->ring);
+		reactor->ring = NULL;
+	}
+	reactor->mutex = upnpd_thread_mutex_init("reactor->mutex", 0);
+	reactor->cond = upnpd_thread_cond_init("reactor->cond");
+	upnpd_thread_mutex_lock(reactor->mutex);
+	reactor->thread = upnpd_thread_create("gena_reactor_loop", gena_reactor_loop, reactor);
+	while (reactor->running == 0) {
+		upnpd_thread_cond_wait(reactor->cond, reactor->mutex);
+	}
+	upnpd_thread_mutex_unlock(reactor->mutex);
+	return 0;
+}
+
+static int gena_reactor_uninit (gena_reactor_t *reactor)
+{
+	if (reactor->event == NULL) {
+		return 0;
+	}
+	upnpd_thread_mutex_lock(reactor->mutex);
+	reactor->running = 0;
+	while (reactor->stopped != 1) {
+		upnpd_thread_cond_wait(reactor->cond, reactor->mutex);
+	}
+	upnpd_thread_join(reactor->thread);
+	upnpd_thread_mutex_unlock(reactor->mutex);
+	upnpd_thread_mutex_destroy(reactor->mutex);
+	upnpd_thread_cond_destroy(reactor->cond);
+	upnpd_socket_event_uninit(reactor->event);
+	upnpd_socket_ring_uninit(reactor->ring);
+	return 0;
+}
+
+static void * gena_loop (void *arg)
+{
+	int rc;
+	int running;
+	int timeout;
+
+	socket_t *socket;
+	poll_item_t pitem;
+
+	gena_t *gena;
+	gena_listener_t *listener;
+
+	listener = (gena_listener_t *) arg;
+	gena = listener->gena;
+
+	upnpd_thread_mutex_lock(gena->mutex);
+	debugf(_DBG, "started gena thread %u", listener->index);
+	running = 1;
+	timeout = 500;
+	gena->started++;
+	upnpd_thread_cond_signal(gena->cond);
+	upnpd_thread_mutex_unlock(gena->mutex);
+
+	while (running == 1) {
+		pitem.item = listener->socket;
+		pitem.events = POLL_EVENT_IN;
+		rc = upnpd_socket_poll(&pitem, 1, timeout);
+
+		upnpd_thread_mutex_lock(gena->mutex);
+		running = gena->running;
+		upnpd_thread_mutex_unlock(gena->mutex);
+
+		if (running == 0 || rc <= 0 || pitem.revents != POLL_EVENT_IN) {
+			continue;
+		}
+
+		debugf(_DBG, "we have a new connection request");
+		/* connections are served non-blocking in both modes */
+		socket = upnpd_socket_accept_nonblock(listener->socket);
+		if (socket != NULL) {
+			debugf(_DBG, "accepted new connection");
+			if (gena->reactors != NULL) {
+				/* hand over to reactor threads in round robin, listeners start at different reactors */
+				rc = gena_reactor_add(&gena->reactors[(listener->index + listener->reactor++) % gena->config.reactors], gena, socket);
+			} else {
+				rc = gena_pool_add(gena, socket);
+			}
+			if (rc != 0) {
+				upnpd_socket_close(socket);
+			}
+		}
+	}
+
+	upnpd_thread_mutex_lock(gena->mutex);
+	debugf(_DBG, "stopped gena thread %u", listener->index);
+	gena->stopped++;
+	upnpd_thread_cond_signal(gena->cond);
+	upnpd_thread_mutex_unlock(gena->mutex);
+
+	return NULL;
+}
+
+static socket_t * gena_listener_open (gena_t *gena, unsigned short port, int reuseport)
+{
+	socket_t *socket;
+	socket = upnpd_socket_open(SOCKET_TYPE_STREAM, 1);
+	if (socket == NULL) {
+		debugf(_DBG, "socket() failed");
+		return NULL;
+	}
+	if (reuseport == 1 && upnpd_socket_option_reuseport(socket, 1) != 0) {
+		debugf(_DBG, "upnpd_socket_option_reuseport() failed");
+		upnpd_socket_close(socket);
+		return NULL;
+	}
+	if (upnpd_socket_bind(socket, gena->address, port) == -1 ||
+	    upnpd_socket_listen(socket, GENA_LISTEN_MAX) == -1) {
+		upnpd_socket_close(socket);
+		return NULL;
+	}
+	/* accepted connections inherit the control profile */
+	gena_socket_tune(socket, GENA_TRAFFIC_CONTROL);
+	if (upnpd_socket_option_deferaccept(socket, GENA_DEFER_ACCEPT) != 0) {
+		debugf(_DBG, "upnpd_socket_option_deferaccept() failed");
+	}
+	return socket;
+}
+
+static void gena_listeners_close (gena_t *gena)
+{
+	unsigned int i;
+	for (i = 0; i < gena->config.listeners; i++) {
+		if (gena->listeners[i].socket != NULL) {
+			upnpd_socket_close(gena->listeners[i].socket);
+			gena->listeners[i].socket = NULL;
+		}
+	}
+}
+
+static int gena_init_server (gena_t *gena)
+{
+	unsigned int i;
+	socket_t *socket;
+	unsigned short port;
+
+	port = gena->port;
+	if (port < GENA_LISTEN_PORT) {
+		port = GENA_LISTEN_PORT;
+	}
+
+	for (i = 0; i < gena->config.listeners; i++) {
+		gena->listeners[i].gena = gena;
+		gena->listeners[i].index = i;
+	}
+	do {
+		port++;
+		debugf(_DBG, "trying port: %d", port);
+		/* port must be free for a socket without SO_REUSEPORT, so it is not shared with another process */
+		socket = gena_listener_open(gena, port, 0);
+		if (socket == NULL) {
+			continue;
+		}
+		if (gena->config.listeners == 1) {
+			gena->listeners[0].socket = socket;
+			break;
+		}
+		upnpd_socket_close(socket);
+		for (i = 0; i < gena->config.listeners; i++) {
+			gena->listeners[i].socket = gena_listener_open(gena, port, 1);
+			if (gena->listeners[i].socket == NULL) {
+				break;
+			}
+		}
+		if (i == gena->config.listeners) {
+			break;
+		}
+		gena_listeners_close(gena);
+		/* whether SO_REUSEPORT is not usable or a later listener failed
+		 * (descriptor limit, another binder racing in), retry the port
+		 * once with a single listener, which cannot fail half way */
+		debugf(_DBG, "listener %u of %u failed, falling back to a single listener", i, gena->config.listeners);
+		gena->config.listeners = 1;
+		port--;
+	} while (1);
+
+	gena->port = port;
+	debugf(_DBG, "gena started %u listeners on port: %s:%u", gena->config.listeners, gena->address, gena->port);
+	return 0;
+}
+
+static int gena_peers_init (gena_peers_t *peers)
+{
+	memset(peers, 0, sizeof(gena_peers_t));
+	list_init(&peers->idle);
+	peers->mutex = upnpd_thread_mutex_init("peers->mutex", 0);
+	if (peers->mutex == NULL) {
+		debugf(_DBG, "upnpd_thread_mutex_init() failed");
+		return -1;
+	}
+	return 0;
+}
+
+static void gena_peer_close (gena_peer_t *peer)
+{
+	upnpd_socket_close(peer->socket);
+	free(peer->host);
+	free(peer);
+}
+
+static void gena_peers_uninit (gena_peers_t *peers)
+{
+	gena_peer_t *peer;
+	gena_peer_t *peer_next;
+	list_for_each_entry_safe(peer, peer_next, &peers->idle, head, gena_peer_t) {
+		list_del(&peer->head);
+		gena_peer_close(peer);
+	}
+	peers->count = 0;
+	if (peers->mutex != NULL) {
+		upnpd_thread_mutex_destroy(peers->mutex);
+	}
+}
+
+/* takes an idle connection to host:port out of the pool, closing expired ones on the way */
+static socket_t * gena_peers_get (gena_peers_t *peers, const char *host, const unsigned short port)
+{
+	int rc;
+	socket_t *socket;
+	gena_peer_t *peer;
+	gena_peer_t *peer_next;
+	poll_item_t pitem;
+	unsigned long long now;
+	socket = NULL;
+	now = upnpd_time_gettimeofday();
+	upnpd_thread_mutex_lock(peers->mutex);
+	list_for_each_entry_safe(peer, peer_next, &peers->idle, head, gena_peer_t) {
+		if (now - peer->idle >= GENA_PEER_IDLE) {
+			list_del(&peer->head);
+			peers->count--;
+			gena_peer_close(peer);
+			continue;
+		}
+		if (socket != NULL || peer->port != port || strcmp(peer->host, host) != 0) {
+			continue;
+		}
+		list_del(&peer->head);
+		peers->count--;
+		/* an idle connection must not be readable, the peer either closed it or sent garbage */
+		pitem.item = peer->socket;
+		pitem.events = POLL_EVENT_IN;
+		rc = upnpd_socket_poll(&pitem, 1, 0);
+		if (rc != 0) {
+			debugf(_DBG, "dropping stale connection to '%s:%d'", host, port);
+			gena_peer_close(peer);
+			continue;
+		}
+		socket = peer->socket;
+		free(peer->host);
+		free(peer);
+	}
+	upnpd_thread_mutex_unlock(peers->mutex);
+	return socket;
+}
+
+/* gives a connection back to the pool, or closes it when the peer already has enough idle ones */
+static void gena_peers_put (gena_peers_t *peers, const char *host, const unsigned short port, socket_t *socket)
+{
+	unsigned int count;
+	gena_peer_t *peer;
+	upnpd_thread_mutex_lock(peers->mutex);
+	count = 0;
+	list_for_each_entry(peer, &peers->idle, head, gena_peer_t) {
+		if (peer->port == port && strcmp(peer->host, host) == 0) {
+			count++;
+		}
+	}
+	if (count >= GENA_PEER_HOST_MAX || peers->count >= GENA_PEER_MAX) {
+		goto close;
+	}
+	peer = (gena_peer_t *) malloc(sizeof(gena_peer_t));
+	if (peer == NULL) {
+		goto close;
+	}
+	memset(peer, 0, sizeof(gena_peer_t));
+	peer->host = strdup(host);
+	if (peer->host == NULL) {
+		free(peer);
+		goto close;
+	}
+	peer->port = port;
+	peer->socket = socket;
+	peer->idle = upnpd_time_gettimeofday();
+	list_add(&peer->head, &peers->idle);
+	peers->count++;
+	upnpd_thread_mutex_unlock(peers->mutex);
+	return;
+close:
+	upnpd_thread_mutex_unlock(peers->mutex);
+	upnpd_socket_close(socket);
+}
+
+/* buffered reader for responses to outbound requests */
+typedef struct gena_reader_s {
+	socket_t *socket;
+	int timeout;
+	unsigned int start;
+	unsigned int end;
+	unsigned long long received;
+	/* peer closed or reset the connection, a timeout leaves this 0 */
+	int closed;
+	char buffer[GENA_READER_SIZE];
+} gena_reader_t;
+
+/* collects a response body when the caller did not give a sink */
+typedef struct gena_body_s {
+	char *data;
+	unsigned int length;
+	unsigned int size;
+} gena_body_t;
+
+static int gena_reader_fill (gena_reader_t *reader)
+{
+	int rc;
+	poll_item_t pitem;
+	if (reader->start > 0) {
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+	if (reader->end >= sizeof(reader->buffer)) {
+		debugf(_DBG, "line does not fit into reader buffer");
+		return -1;
+	}
+	while (1) {
+		pitem.item = reader->socket;
+		pitem.events = POLL_EVENT_IN;
+		rc = upnpd_socket_poll(&pitem, 1, reader->timeout);
+		if (rc <= 0 || (pitem.revents & POLL_EVENT_IN) == 0) {
+			debugf(_DBG, "poll failed rc:%d(0x%x)", rc, pitem.revents);
+			reader->closed = (rc > 0) ? 1 : 0;
+			return -1;
+		}
+		rc = upnpd_socket_recv(reader->socket, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end);
+		if (rc == SOCKET_AGAIN) {
+			continue;
+		}
+		if (rc <= 0) {
+			reader->closed = 1;
+			return (rc == 0) ? 0 : -1;
+		}
+		reader->end += rc;
+		reader->received += rc;
+		return rc;
 	}
+}
 
-	/* eat rest of headers */
+/* returns the next line without its line end, valid until the reader is filled again */
+static int gena_reader_line (gena_reader_t *reader, char **line)
+{
+	int l;
+	char *eol;
 	while (1) {
-		if (gena_getline(gena_thread->socket, GENA_SOCKET_TIMEOUT, header, GENA_HEADER_SIZE) <= 0) {
+		eol = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+		if (eol != NULL) {
 			break;
 		}
-		if (strncasecmp(header, "Range:", strlen("Range:")) == 0) {
-			tmpptr = header + strlen("Range:");
-			while (*tmpptr && *tmpptr == ' ') {
-				tmpptr++;
-			}
-			if (strncmp(tmpptr, "bytes=", strlen("bytes=")) == 0) {
-				rangerequest = 1;
-				tmpptr += strlen("bytes=");
-				fileinfo.filerange.start = strtoull(tmpptr, &tmpptr, 10);
-				if (tmpptr[0] != '-' || fileinfo.filerange.start < 0) {
-					fileinfo.filerange.start = 0;
-					fileinfo.filerange.stop = 0;
-					fileinfo.filerange.size = 0;
-				} else if (tmpptr[1] != '\0') {
-					fileinfo.filerange.stop = strtoull(tmpptr + 1, NULL, 10);
-					if (fileinfo.filerange.stop < 0 || fileinfo.filerange.stop < fileinfo.filerange.start) {
-						fileinfo.filerange.start = 0;
-						fileinfo.filerange.stop = 0;
-						fileinfo.filerange.size = 0;
-					}
-				}
-			}
-			debugf(_DBG, "range requested %lu-%lu", fileinfo.filerange.start, fileinfo.filerange.stop);
+		if (gena_reader_fill(reader) <= 0) {
+			return -1;
 		}
 	}
-
-	/* do real job */
-	if (gena_thread->callbacks == NULL ||
-	    gena_thread->callbacks->vfs.info == NULL ||
-	    gena_thread->callbacks->vfs.open == NULL ||
-	    gena_thread->callbacks->vfs.read == NULL ||
-	    gena_thread->callbacks->vfs.seek == NULL ||
-	    gena_thread->callbacks->vfs.close == NULL) {
-		debugf(_DBG, "no callbacks installed");
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
-	}
-
-	debugf(_DBG, "reading file info");
-	if (gena_thread->callbacks->vfs.info(gena_thread->callbacks->vfs.cookie, pathptr, &fileinfo.fileinfo) < 0) {
-		debugf(_DBG, "info failed");
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_NOT_FOUND);
-		goto out;
-	}
-	debugf(_DBG, "opening file");
-	filehandle = gena_thread->callbacks->vfs.open(gena_thread->callbacks->vfs.cookie, pathptr, GENA_FILEMODE_READ);
-	if (filehandle == NULL) {
-		debugf(_DBG, "open failed");
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto out;
-	}
-
-	debugf(_DBG, "calculating actual size");
-	/* calculate actual size */
-	if (fileinfo.filerange.stop == 0 && rangerequest == 1) {
-		/* we do support range as requested */
-		fileinfo.filerange.stop = fileinfo.fileinfo.size - 1;
-	}
-	fileinfo.filerange.stop = MIN(fileinfo.filerange.stop, fileinfo.fileinfo.size - 1);
-	if (fileinfo.filerange.start == 0 && fileinfo.filerange.stop == 0) {
-		fileinfo.filerange.size = fileinfo.fileinfo.size;
-	} else {
-		fileinfo.filerange.size = fileinfo.filerange.stop - fileinfo.filerange.start + 1;
-	}
-
-	debugf(_DBG, "sending file header");
-	/* send header */
-	gena_sendfileheader(gena_thread->socket, &fileinfo);
-	if (strcasecmp(header, request_head) == 0) {
-		debugf(_DBG, "only header is requested");
-		goto close_out;
+	*eol = '\0';
+	*line = reader->buffer + reader->start;
+	l = eol - *line;
+	if (l > 0 && (*line)[l - 1] == '\r') {
+		(*line)[--l] = '\0';
 	}
+	reader->start = eol + 1 - reader->buffer;
+	debugf(_DBG, "%s", *line);
+	return l;
+}
 
-	debugf(_DBG, "seeking file");
-	/* seek if requested */
-	if (gena_thread->callbacks->vfs.seek(gena_thread->callbacks->vfs.cookie, filehandle, fileinfo.filerange.start, GENA_SEEK_SET) != fileinfo.filerange.start) {
-		debugf(_DBG, "seek failed");
-		gena_senderrorheader(gena_thread->socket, GENA_RESPONSE_TYPE_INTERNAL_SERVER_ERROR);
-		goto close_out;
+/* passes exactly length bytes of body to the sink */
+static int gena_reader_body (gena_reader_t *reader, unsigned long long length, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie)
+{
+	unsigned int n;
+	while (length > 0) {
+		if (reader->start == reader->end) {
+			if (gena_reader_fill(reader) <= 0) {
+				return -1;
+			}
+		}
+		n = reader->end - reader->start;
+		if (n > length) {
+			n = length;
+		}
+		if (sink(cookie, reader->buffer + reader->start, n) != 0) {
+			return -1;
+		}
+		reader->start += n;
+		length -= n;
 	}
+	return 0;
+}
 
-	debugf(_DBG, "sending file");
-	/* send file */
-	readlen = 0;
-	while (readlen < fileinfo.filerange.size) {
-		rlen = MIN((int) fileinfo.filerange.size - readlen, GENA_DATA_SIZE);
-		rlen = gena_thread->callbacks->vfs.read(gena_thread->callbacks->vfs.cookie, filehandle, data, rlen);
-		if (rlen <= 0) {
-			debugf(_DBG, "read failed");
-			break;
+static int gena_reader_chunked (gena_reader_t *reader, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie)
+{
+	int rc;
+	char *end;
+	char *line;
+	unsigned long size;
+	while (1) {
+		if (gena_reader_line(reader, &line) < 0) {
+			return -1;
 		}
-		if (gena_send(gena_thread->socket, GENA_SOCKET_TIMEOUT, data, rlen) != rlen) {
-			debugf(_DBG, "send() failed");
-			break;
+		/* chunk extensions after ';' are ignored */
+		size = strtoul(line, &end, 16);
+		if (end == line) {
+			debugf(_DBG, "invalid chunk size '%s'", line);
+			return -1;
 		}
-		upnpd_thread_mutex_lock(gena_thread->mutex);
-		if (gena_thread->running == 0) {
-			upnpd_thread_mutex_unlock(gena_thread->mutex);
+		if (size == 0) {
 			break;
 		}
-		upnpd_thread_mutex_unlock(gena_thread->mutex);
-		readlen += rlen;
+		if (gena_reader_body(reader, size, sink, cookie) != 0) {
+			return -1;
+		}
+		if (gena_reader_line(reader, &line) != 0) {
+			debugf(_DBG, "chunk is not terminated");
+			return -1;
+		}
 	}
-
-	if (readlen != fileinfo.filerange.size) {
-		debugf(_DBG, "file send failed");
+	/* trailer headers end with an empty line */
+	while ((rc = gena_reader_line(reader, &line)) > 0) {
 	}
-
-close_out:
-	debugf(_DBG, "closing file");
-	gena_thread->callbacks->vfs.close(gena_thread->callbacks->vfs.cookie, filehandle);
-out:
-	free(pathptr);
-	free(fileinfo.fileinfo.mimetype);
-	free(data);
-	free(header);
-	upnpd_thread_mutex_lock(gena_thread->mutex);
-	debugf(_DBG, "stopped gena child thread");
-	gena_thread->stopped = 1;
-	upnpd_thread_cond_signal(gena_thread->cond);
-	upnpd_thread_mutex_unlock(gena_thread->mutex);
-
-	return NULL;
+	return (rc == 0) ? 0 : -1;
 }
 
-static void * gena_loop (void *arg)
+/* reads until the peer closes, a timeout ends the body as well */
+static int gena_reader_close (gena_reader_t *reader, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie)
 {
-	int rc;
-	int running;
-	int timeout;
-
-	socket_t *socket;
-	poll_item_t pitem;
-
-	gena_t *gena;
-	gena_thread_t *gena_thread;
-	gena_thread_t *gena_thread_next;
-
-	gena = (gena_t *) arg;
-
-	upnpd_thread_mutex_lock(gena->mutex);
-	debugf(_DBG, "started gena thread");
-	running = 1;
-	timeout = 500;
-	gena->running = 1;
-	upnpd_thread_cond_signal(gena->cond);
-	upnpd_thread_mutex_unlock(gena->mutex);
-
-	while (running == 1) {
-		pitem.item = gena->socket;
-		pitem.events = POLL_EVENT_IN;
-		rc = upnpd_socket_poll(&pitem, 1, timeout);
-
-		upnpd_thread_mutex_lock(gena->mutex);
-		running = gena->running;
-		list_for_each_entry_safe(gena_thread, gena_thread_next, &gena->threads, head, gena_thread_t) {
-			upnpd_thread_mutex_lock(gena_thread->mutex);
-			if (gena_thread->stopped == 1) {
-				upnpd_thread_join(gena_thread->thread);
-				debugf(_DBG, "closing stopped gena child threads");
-				list_del(&gena_thread->head);
-				upnpd_thread_mutex_unlock(gena_thread->mutex);
-				upnpd_thread_mutex_destroy(gena_thread->mutex);
-				upnpd_thread_cond_destroy(gena_thread->cond);
-				upnpd_socket_close(gena_thread->socket);
-				free(gena_thread);
-			} else {
-				upnpd_thread_mutex_unlock(gena_thread->mutex);
+	while (1) {
+		if (reader->start < reader->end) {
+			if (sink(cookie, reader->buffer + reader->start, reader->end - reader->start) != 0) {
+				return -1;
 			}
+			reader->start = reader->end;
 		}
-		if (running == 0) {
-			debugf(_DBG, "stopping and closing remaining gena child threads");
-			list_for_each_entry_safe(gena_thread, gena_thread_next, &gena->threads, head, gena_thread_t) {
-				upnpd_thread_mutex_lock(gena_thread->mutex);
-				if (gena_thread->stopped == 1) {
-					upnpd_thread_join(gena_thread->thread);
-				} else if (gena_thread->running == 1) {
-					gena_thread->running = 0;
-					upnpd_thread_cond_signal(gena_thread->cond);
-					while (gena_thread->stopped != 1) {
-						upnpd_thread_cond_wait(gena_thread->cond, gena_thread->mutex);
-					}
-					upnpd_thread_join(gena_thread->thread);
-				} else {
-					debugf(_DBG, "this should not happen");
-					assert(0);
-				}
-				list_del(&gena_thread->head);
-				upnpd_thread_mutex_unlock(gena_thread->mutex);
-				upnpd_thread_mutex_destroy(gena_thread->mutex);
-				upnpd_thread_cond_destroy(gena_thread->cond);
-				upnpd_socket_close(gena_thread->socket);
-				free(gena_thread);
-			}
+		if (gena_reader_fill(reader) <= 0) {
+			return 0;
 		}
-		upnpd_thread_mutex_unlock(gena->mutex);
+	}
+}
 
-		if (running == 0 || rc <= 0 || pitem.revents != POLL_EVENT_IN) {
-			continue;
+static int gena_body_sink (void *cookie, const char *buffer, unsigned int length)
+{
+	char *data;
+	unsigned int size;
+	gena_body_t *body;
+	body = (gena_body_t *) cookie;
+	if (body->length + length + 1 > body->size) {
+		size = (body->size > 0) ? body->size : GENA_READER_SIZE;
+		while (body->length + length + 1 > size) {
+			size *= 2;
 		}
-
-		debugf(_DBG, "we have a new connection request");
-		socket = upnpd_socket_accept(gena->socket);
-		if (socket != NULL) {
-			debugf(_DBG, "accepted new connection");
-			gena_thread = (gena_thread_t *) malloc(sizeof(gena_thread_t));
-			if (gena_thread == NULL) {
-				debugf(_DBG, "malloc(sizeof(gena_thread_t) failed");
-				upnpd_socket_close(socket);
-				continue;
-			}
-			memset(gena_thread, 0, sizeof(gena_thread_t));
-			gena_thread->socket = socket;
-			gena_thread->callbacks = gena->callbacks;
-			gena_thread->mutex = upnpd_thread_mutex_init("gena_thread->mutex", 0);
-			gena_thread->cond = upnpd_thread_cond_init("gena_thread->cond");
-			upnpd_thread_mutex_lock(gena_thread->mutex);
-			gena_thread->thread = upnpd_thread_create("gena_thread_loop", gena_thread_loop, gena_thread);
-			while (gena_thread->running != 1) {
-				upnpd_thread_cond_wait(gena_thread->cond, gena_thread->mutex);
-			}
-			list_add(&gena_thread->head, &gena->threads);
-			debugf(_DBG, "created and added new gena thread");
-			upnpd_thread_mutex_unlock(gena_thread->mutex);
+		data = realloc(body->data, size);
+		if (data == NULL) {
+			debugf(_DBG, "realloc(%u) failed", size);
+			return -1;
 		}
+		body->data = data;
+		body->size = size;
 	}
-
-	upnpd_thread_mutex_lock(gena->mutex);
-	debugf(_DBG, "stopped gena thread");
-	gena->stopped = 1;
-	upnpd_thread_cond_signal(gena->cond);
-	upnpd_thread_mutex_unlock(gena->mutex);
-
-	return NULL;
+	memcpy(body->data + body->length, buffer, length);
+	body->length += length;
+	body->data[body->length] = '\0';
+	return 0;
 }
 
-static int gena_init_server (gena_t *gena)
+static int gena_stats_printf (gena_body_t *body, const char *format, ...)
 {
-	socket_t *socket;
-	unsigned short port;
-
-	port = gena->port;
-	if (port < GENA_LISTEN_PORT) {
-		port = GENA_LISTEN_PORT;
-	}
-
-	socket = upnpd_socket_open(SOCKET_TYPE_STREAM, 1);
-	if (socket == NULL) {
-		debugf(_DBG, "socket() failed");
+	int len;
+	va_list ap;
+	char line[GENA_STATS_LINE];
+	va_start(ap, format);
+	len = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	if (len < 0 || len >= (int) sizeof(line)) {
 		return -1;
 	}
-	do {
-		port++;
-		debugf(_DBG, "trying port: %d", port);
-		if (upnpd_socket_bind(socket, gena->address, port) != -1 &&
-		    upnpd_socket_listen(socket, GENA_LISTEN_MAX) != -1) {
-			break;
-		}
-	} while (1);
-
-	gena->socket = socket;
-	gena->port = port;
-	debugf(_DBG, "gena started on port: %s:%u", gena->address, gena->port);
-	return 0;
+	return gena_body_sink(body, line, len);
 }
 
-char * upnpd_upnp_gena_send_recv (gena_t *gena, const char *host, const unsigned short port, const char *header, const char *data)
+static int gena_stats_histogram (gena_body_t *body, const char *metric, const char *label, const char *value, gena_histogram_t *histogram)
 {
-	int r;
-	size_t t;
-	char *tmp;
-	char *buffer;
-	int contentlength;
-	unsigned int length;
-
-	socket_t *socket;
-	poll_item_t pitem;
+	int rc;
+	unsigned int i;
+	unsigned long long sum;
+	unsigned long long count;
+	count = 0;
+	rc = 0;
+	for (i = 0; i < GENA_STATS_BUCKETS; i++) {
+		count += upnpd_atomic_get(&histogram->buckets[i]);
+		rc |= gena_stats_printf(body, "%s_bucket{%s=\"%s\",le=\"%llu.%06llu\"} %llu\n", metric, label, value, gena_stats_bounds[i] / 1000000, gena_stats_bounds[i] % 1000000, count);
+	}
+	count = upnpd_atomic_get(&histogram->count);
+	sum = upnpd_atomic_get(&histogram->sum);
+	rc |= gena_stats_printf(body, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", metric, label, value, count);
+	rc |= gena_stats_printf(body, "%s_sum{%s=\"%s\"} %llu.%06llu\n", metric, label, value, sum / 1000000, sum % 1000000);
+	rc |= gena_stats_printf(body, "%s_count{%s=\"%s\"} %llu\n", metric, label, value, count);
+	return rc;
+}
 
-	socket = upnpd_socket_open(SOCKET_TYPE_STREAM, 0);
-	if (socket == NULL) {
-		return NULL;
+/* counters in prometheus text exposition format, counters are read one by one and may be slightly apart */
+char * upnpd_upnp_gena_stats (gena_t *gena)
+{
+	int rc;
+	unsigned int i;
+	unsigned int n;
+	gena_body_t body;
+	gena_stats_t *stats;
+
+	rc = 0;
+	stats = &gena->stats;
+	memset(&body, 0, sizeof(gena_body_t));
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_request_seconds Time from first byte of request to last byte of response.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_request_seconds histogram\n");
+	for (i = 0; i < GENA_STATS_TYPES; i++) {
+		if (i != GENA_STATS_NOTIFY) {
+			rc |= gena_stats_histogram(&body, "upnpd_gena_request_seconds", "method", gena_stats_names[i], &stats->requests[i]);
+		}
 	}
-	if (gena_connect(socket, GENA_SOCKET_TIMEOUT, host, port) != 0) {
-		upnpd_socket_close(socket);
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_action_seconds Time from first byte of soap action request to last byte of response.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_action_seconds histogram\n");
+	n = upnpd_atomic_get(&stats->nactions);
+	for (i = 0; i < GENA_STATS_ACTIONS; i++) {
+		if (i < n || (i == GENA_STATS_ACTIONS - 1 && upnpd_atomic_get(&stats->actions[i].latency.count) > 0)) {
+			rc |= gena_stats_histogram(&body, "upnpd_gena_action_seconds", "action", stats->actions[i].name, &stats->actions[i].latency);
+		}
+	}
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_outbound_seconds Time of outbound requests answered by the peer.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_outbound_seconds histogram\n");
+	for (i = 0; i < GENA_STATS_TYPES; i++) {
+		if (i == GENA_STATS_GET || i == GENA_STATS_POST || i == GENA_STATS_NOTIFY) {
+			rc |= gena_stats_histogram(&body, "upnpd_gena_outbound_seconds", "method", gena_stats_names[i], &stats->outbound[i]);
+		}
+	}
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_outbound_errors_total Outbound requests that failed.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_outbound_errors_total counter\n");
+	for (i = 0; i < GENA_STATS_TYPES; i++) {
+		if (i == GENA_STATS_GET || i == GENA_STATS_POST || i == GENA_STATS_NOTIFY) {
+			rc |= gena_stats_printf(&body, "upnpd_gena_outbound_errors_total{method=\"%s\"} %llu\n", gena_stats_names[i], upnpd_atomic_get(&stats->outerrors[i]));
+		}
+	}
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_responses_total Completed responses by status code.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_responses_total counter\n");
+	for (i = 0; i < GENA_RESPONSE_TYPES; i++) {
+		rc |= gena_stats_printf(&body, "upnpd_gena_responses_total{code=\"%d\"} %llu\n", gena_responses[i].code, upnpd_atomic_get(&stats->responses[i]));
+	}
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_aborted_total Requests whose connection failed before the response was complete.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_aborted_total counter\n");
+	rc |= gena_stats_printf(&body, "upnpd_gena_aborted_total %llu\n", upnpd_atomic_get(&stats->aborted));
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_range_requests_total Requests served with byte ranges.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_range_requests_total counter\n");
+	rc |= gena_stats_printf(&body, "upnpd_gena_range_requests_total %llu\n", upnpd_atomic_get(&stats->ranges));
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_sent_bytes_total File and stream body bytes sent.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_sent_bytes_total counter\n");
+	rc |= gena_stats_printf(&body, "upnpd_gena_sent_bytes_total %llu\n", upnpd_atomic_get(&stats->bytes));
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_connections_total Accepted connections.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_connections_total counter\n");
+	rc |= gena_stats_printf(&body, "upnpd_gena_connections_total %llu\n", upnpd_atomic_get(&stats->connections));
+	rc |= gena_stats_printf(&body, "# HELP upnpd_gena_connections Open connections, queued ones included.\n");
+	rc |= gena_stats_printf(&body, "# TYPE upnpd_gena_connections gauge\n");
+	rc |= gena_stats_printf(&body, "upnpd_gena_connections %llu\n", upnpd_atomic_get(&stats->active));
+	if (rc != 0) {
+		debugf(_DBG, "gena_stats_printf() failed");
+		free(body.data);
 		return NULL;
 	}
-	if (gena_send(socket, GENA_SOCKET_TIMEOUT, header, strlen(header)) != strlen(header)) {
-		upnpd_socket_close(socket);
+	return body.data;
+}
+
+/* sends one request and streams its response body to the sink, reports the
+ * status code, whether the connection may carry another request and whether
+ * it died before answering */
+static int gena_exchange (socket_t *socket, int timeout, const char *header, const char *data, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie, int *status, int *keepalive, int *stale)
+{
+	int rc;
+	int chunked;
+	int contentlength;
+	char *line;
+	char *value;
+	unsigned long long length;
+	gena_reader_t *reader;
+
+	*stale = 0;
+	*status = 0;
+	*keepalive = 0;
+	rc = gena_send(socket, timeout, header, strlen(header), (data != NULL) ? 1 : 0);
+	if (rc != strlen(header)) {
 		debugf(_DBG, "gena_send() failed");
-		return NULL;
+		/* the peer did not get any part of the request */
+		*stale = (rc == 0) ? 1 : 0;
+		return -1;
 	}
 	if (data != NULL) {
-		if (gena_send(socket, GENA_SOCKET_TIMEOUT, data, strlen(data)) != strlen(data)) {
-			upnpd_socket_close(socket);
+		if (gena_send(socket, timeout, data, strlen(data), 0) != strlen(data)) {
 			debugf(_DBG, "gena_send() failed");
-			return NULL;
+			return -1;
 		}
 	}
-	length = 0;
-	contentlength = 0;
-	buffer = malloc(GENA_HEADER_SIZE);
-	while (1) {
-		if (gena_getline(socket, GENA_SOCKET_TIMEOUT, buffer, GENA_HEADER_SIZE) <= 0) {
-			break;
+	reader = (gena_reader_t *) malloc(sizeof(gena_reader_t));
+	if (reader == NULL) {
+		debugf(_DBG, "malloc(sizeof(gena_reader_t)) failed");
+		return -1;
+	}
+	reader->socket = socket;
+	reader->timeout = timeout;
+	reader->start = 0;
+	reader->end = 0;
+	reader->received = 0;
+	reader->closed = 0;
+	do {
+		if (gena_reader_line(reader, &line) <= 0) {
+			debugf(_DBG, "no response received");
+			/* only a close or reset before any answer is stale, after a
+			 * timeout the peer may still act on the request */
+			*stale = (reader->received == 0 && reader->closed == 1) ? 1 : 0;
+			goto error;
 		}
-		if (strncasecmp(buffer, "Content-length:", strlen("Content-length:")) == 0) {
-			length = atol(gena_trim(buffer + strlen("Content-length:")));
-			contentlength = 1;
+		if (strncasecmp(line, "HTTP/", strlen("HTTP/")) != 0 || strchr(line, ' ') == NULL) {
+			debugf(_DBG, "invalid status line '%s'", line);
+			goto error;
 		}
-	}
-	free(buffer);
-	buffer = NULL;
-	if (contentlength == 1) {
-		if (length <= 0) {
-			upnpd_socket_close(socket);
-			debugf(_DBG, "no data received %d\n", length);
-			return NULL;
+		/* http/1.1 connections are persistent unless the peer says otherwise */
+		*keepalive = (strncasecmp(line, "HTTP/1.1", strlen("HTTP/1.1")) == 0) ? 1 : 0;
+		*status = atoi(strchr(line, ' ') + 1);
+		length = 0;
+		chunked = 0;
+		contentlength = 0;
+		while ((rc = gena_reader_line(reader, &line)) > 0) {
+			if (strncasecmp(line, "Content-length:", strlen("Content-length:")) == 0) {
+				length = strtoull(gena_trim(line + strlen("Content-length:")), NULL, 10);
+				contentlength = 1;
+			} else if (strncasecmp(line, "Transfer-Encoding:", strlen("Transfer-Encoding:")) == 0) {
+				value = gena_trim(line + strlen("Transfer-Encoding:"));
+				chunked = (strcasecmp(value, "chunked") == 0) ? 1 : 0;
+			} else if (strncasecmp(line, "Connection:", strlen("Connection:")) == 0) {
+				value = gena_trim(line + strlen("Connection:"));
+				if (strcasecmp(value, "close") == 0) {
+					*keepalive = 0;
+				} else if (strcasecmp(value, "keep-alive") == 0) {
+					*keepalive = 1;
+				}
+			}
 		}
-		buffer = malloc(sizeof(char) * (length + 1));
-		if (buffer == NULL) {
-			upnpd_socket_close(socket);
-			debugf(_DBG, "no data received %d", length);
-			return NULL;
-		}
-		t = 0;
-		while (t < length) {
-			pitem.item = socket;
-			pitem.events = POLL_EVENT_IN;
-			r = upnpd_socket_poll(&pitem, 1, GENA_SOCKET_TIMEOUT);
-			if (r <= 0 || (pitem.revents & POLL_EVENT_IN) == 0) {
+		if (rc < 0) {
+			goto error;
+		}
+		/* interim responses are followed by the real one */
+	} while (*status >= 100 && *status < 200);
+
+	if (*status == 204 || *status == 304) {
+		rc = 0;
+	} else if (chunked == 1) {
+		rc = gena_reader_chunked(reader, sink, cookie);
+	} else if (contentlength == 1) {
+		rc = gena_reader_body(reader, length, sink, cookie);
+	} else {
+		*keepalive = 0;
+		rc = gena_reader_close(reader, sink, cookie);
+	}
+	if (rc != 0) {
+		goto error;
+	}
+	/* nothing was pipelined, anything left over means the framing is off */
+	if (reader->start != reader->end) {
+		*keepalive = 0;
+	}
+	free(reader);
+	return 0;
+error:
+	*keepalive = 0;
+	free(reader);
+	return -1;
+}
+
+int upnpd_upnp_gena_send_recv_status (gena_t *gena, const char *host, const unsigned short port, int timeout, const char *header, const char *data, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie, int *status)
+{
+	int rc;
+	int code;
+	int stale;
+	int reused;
+	int retry;
+	int keepalive;
+	socket_t *socket;
+	gena_stats_type_t type;
+	unsigned long long started;
+
+	rc = -1;
+	if (status != NULL) {
+		*status = 0;
+	}
+	type = GENA_STATS_OTHER;
+	if (strncmp(header, "NOTIFY ", strlen("NOTIFY ")) == 0) {
+		type = GENA_STATS_NOTIFY;
+	} else if (strncmp(header, "POST ", strlen("POST ")) == 0) {
+		type = GENA_STATS_POST;
+	} else if (strncmp(header, "GET ", strlen("GET ")) == 0) {
+		type = GENA_STATS_GET;
+	}
+	started = upnpd_time_monotonic();
+	for (retry = 0; retry < 2; retry++) {
+		socket = gena_peers_get(&gena->peers, host, port);
+		reused = (socket != NULL) ? 1 : 0;
+		if (socket == NULL) {
+			socket = upnpd_socket_open(SOCKET_TYPE_STREAM, 0);
+			if (socket == NULL) {
 				break;
 			}
-			r = upnpd_socket_recv(socket, buffer + t, length - t);
-			if (r <= 0) {
+			if (gena_connect(socket, timeout, host, port) != 0) {
+				upnpd_socket_close(socket);
 				break;
 			}
-			t += r;
 		}
-		buffer[length] = '\0';
-		if (t != length) {
-			free(buffer);
-			buffer = NULL;
+		rc = gena_exchange(socket, timeout, header, data, sink, cookie, &code, &keepalive, &stale);
+		if (status != NULL) {
+			*status = code;
 		}
-	} else {
-		length = 0;
-		buffer = NULL;
-again:
-		length += 512;
-		tmp = realloc(buffer, sizeof(char) * (length + 1));
-		if (tmp == NULL) {
+		if (keepalive == 1) {
+			gena_peers_put(&gena->peers, host, port, socket);
+		} else {
 			upnpd_socket_close(socket);
-			free(buffer);
-			debugf(_DBG, "no data received %d", length);
-			return NULL;
-		}
-		buffer = tmp;
-		t = length - 512;
-		while (t < length) {
-			pitem.item = socket;
-			pitem.events = POLL_EVENT_IN;
-			r = upnpd_socket_poll(&pitem, 1, GENA_SOCKET_TIMEOUT);
-			if (r <= 0 || (pitem.revents & POLL_EVENT_IN) == 0) {
-				goto done;
-				break;
-			}
-			r = upnpd_socket_recv(socket, buffer + t, length - t);
-			if (r <= 0) {
-				goto done;
-			}
-			t += r;
-			buffer[t] = '\0';
 		}
-		goto again;
-done:
-		buffer[t] = '\0';
+		/* a reused connection may have been closed by the peer while idle,
+		 * it was closed before answering so the request is safe to send once more */
+		if (stale == 1 && reused == 1) {
+			debugf(_DBG, "retrying on a fresh connection to '%s:%d'", host, port);
+			continue;
+		}
+		break;
 	}
-	upnpd_socket_close(socket);
-	return buffer;
+	if (rc == 0) {
+		gena_histogram_observe(&gena->stats.outbound[type], upnpd_time_monotonic() - started);
+	} else {
+		upnpd_atomic_add(&gena->stats.outerrors[type], 1);
+	}
+	return rc;
+}
+
+int upnpd_upnp_gena_send_recv_sink (gena_t *gena, const char *host, const unsigned short port, const char *header, const char *data, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie)
+{
+	return upnpd_upnp_gena_send_recv_status(gena, host, port, GENA_SOCKET_TIMEOUT, header, data, sink, cookie, NULL);
+}
+
+char * upnpd_upnp_gena_send_recv (gena_t *gena, const char *host, const unsigned short port, const char *header, const char *data)
+{
+	gena_body_t body;
+	memset(&body, 0, sizeof(gena_body_t));
+	if (upnpd_upnp_gena_send_recv_sink(gena, host, port, header, data, gena_body_sink, &body) != 0) {
+		free(body.data);
+		return NULL;
+	}
+	if (body.length == 0) {
+		debugf(_DBG, "no data received");
+		free(body.data);
+		return NULL;
+	}
+	return body.data;
 }
 
 char * upnpd_upnp_gena_download (gena_t *gena, const char *host, const unsigned short port, const char *path)
@@ -1227,8 +3792,9 @@ const char * upnpd_upnp_gena_getaddress (gena_t *gena)
 	return gena->address;
 }
 
-gena_t * upnpd_upnp_gena_init (char *address, unsigned short port, gena_callbacks_t *callbacks)
+gena_t * upnpd_upnp_gena_init (char *address, unsigned short port, gena_callbacks_t *callbacks, gena_config_t *config)
 {
+	unsigned int i;
 	gena_t *gena;
 	gena = (gena_t *) malloc(sizeof(gena_t));
 	if (gena == NULL) {
@@ -1239,25 +3805,138 @@ gena_t * upnpd_upnp_gena_init (char *address, unsigned short port, gena_callback
 	gena->address = (address != NULL) ? strdup(address) : NULL;
 	gena->port = port;
 	gena->callbacks = callbacks;
-	list_init(&gena->threads);
-	gena_init_server(gena);
-
+	if (config != NULL) {
+		gena->config = *config;
+	}
+	if (gena->config.workers == 0) {
+		gena->config.workers = GENA_WORKERS;
+	}
+	if (gena->config.mode == GENA_MODE_REACTOR) {
+		/* streams do not hold a thread in reactor mode */
+		if (gena->config.streams == 0) {
+			gena->config.streams = GENA_RING_SLOTS * ((gena->config.reactors > 0) ? gena->config.reactors : GENA_REACTOR_THREADS);
+		}
+	} else if (gena->config.streams == 0 || gena->config.streams >= gena->config.workers) {
+		gena->config.streams = (gena->config.workers > GENA_WORKERS_CONTROL) ? gena->config.workers - GENA_WORKERS_CONTROL : 1;
+	}
+	if (gena->config.queue == 0) {
+		gena->config.queue = GENA_QUEUE_MAX;
+	}
+	if (gena->config.keepalive_timeout == 0) {
+		gena->config.keepalive_timeout = GENA_KEEPALIVE_TIMEOUT;
+	}
+	if (gena->config.keepalive_requests == 0) {
+		gena->config.keepalive_requests = GENA_KEEPALIVE_REQUESTS;
+	}
+	if (gena->config.buffers == 0) {
+		gena->config.buffers = GENA_BUFFERS_LIMIT;
+	}
+	if (gena_buffers_init(&gena->buffers, gena->config.buffers) != 0) {
+		free(gena->address);
+		free(gena);
+		return NULL;
+	}
+	if (gena_shaper_init(&gena->shaper, &gena->config) != 0) {
+		gena_buffers_uninit(&gena->buffers);
+		free(gena->address);
+		free(gena);
+		return NULL;
+	}
+	if (gena_stats_init(&gena->stats) != 0) {
+		gena_stats_uninit(&gena->stats);
+		gena_shaper_uninit(&gena->shaper);
+		gena_buffers_uninit(&gena->buffers);
+		free(gena->address);
+		free(gena);
+		return NULL;
+	}
+	if (gena_peers_init(&gena->peers) != 0) {
+		gena_peers_uninit(&gena->peers);
+		gena_stats_uninit(&gena->stats);
+		gena_shaper_uninit(&gena->shaper);
+		gena_buffers_uninit(&gena->buffers);
+		free(gena->address);
+		free(gena);
+		return NULL;
+	}
+	if (gena->config.listeners == 0) {
+		gena->config.listeners = GENA_LISTENERS;
+	}
+	gena->listeners = (gena_listener_t *) malloc(sizeof(gena_listener_t) * gena->config.listeners);
+	if (gena->listeners == NULL) {
+		debugf(_DBG, "malloc(sizeof(gena_listener_t)) failed");
+		gena_peers_uninit(&gena->peers);
+		gena_stats_uninit(&gena->stats);
+		gena_shaper_uninit(&gena->shaper);
+		gena_buffers_uninit(&gena->buffers);
+		free(gena->address);
+		free(gena);
+		return NULL;
+	}
+	memset(gena->listeners, 0, sizeof(gena_listener_t) * gena->config.listeners);
 	gena->mutex = upnpd_thread_mutex_init("gena->mutex", 0);
 	gena->cond = upnpd_thread_cond_init("gena->cond");
-	gena->thread = upnpd_thread_create("gena_loop", gena_loop, gena);
+	gena_init_server(gena);
+
+	if (gena->config.mode == GENA_MODE_THREAD) {
+		if (gena_pool_init(&gena->pool, &gena->buffers, gena->config.workers) != 0) {
+			gena_pool_uninit(&gena->pool);
+			goto error;
+		}
+	} else if (gena->config.mode == GENA_MODE_REACTOR) {
+		if (gena->config.reactors == 0) {
+			gena->config.reactors = GENA_REACTOR_THREADS;
+		}
+		gena->reactors = (gena_reactor_t *) malloc(sizeof(gena_reactor_t) * gena->config.reactors);
+		if (gena->reactors == NULL) {
+			debugf(_DBG, "malloc(sizeof(gena_reactor_t)) failed");
+			goto error;
+		}
+		memset(gena->reactors, 0, sizeof(gena_reactor_t) * gena->config.reactors);
+		for (i = 0; i < gena->config.reactors; i++) {
+			if (gena_reactor_init(&gena->reactors[i], &gena->buffers) != 0) {
+				while (i-- > 0) {
+					gena_reactor_uninit(&gena->reactors[i]);
+				}
+				free(gena->reactors);
+				goto error;
+			}
+		}
+		debugf(_DBG, "started %u gena reactor threads", gena->config.reactors);
+	}
 
 	upnpd_thread_mutex_lock(gena->mutex);
-	while (gena->running == 0) {
+	gena->running = 1;
+	for (i = 0; i < gena->config.listeners; i++) {
+		gena->listeners[i].thread = upnpd_thread_create("gena_loop", gena_loop, &gena->listeners[i]);
+		if (gena->config.listeners > 1 && upnpd_thread_affinity(gena->listeners[i].thread, i) != 0) {
+			debugf(_DBG, "upnpd_thread_affinity() failed");
+		}
+	}
+	while (gena->started < gena->config.listeners) {
 		upnpd_thread_cond_wait(gena->cond, gena->mutex);
 	}
 	debugf(_DBG, "started gena loop");
 	upnpd_thread_mutex_unlock(gena->mutex);
 	debugf(_DBG, "initialized gena");
 	return gena;
+error:
+	upnpd_thread_mutex_destroy(gena->mutex);
+	upnpd_thread_cond_destroy(gena->cond);
+	gena_peers_uninit(&gena->peers);
+	gena_stats_uninit(&gena->stats);
+	gena_shaper_uninit(&gena->shaper);
+	gena_buffers_uninit(&gena->buffers);
+	gena_listeners_close(gena);
+	free(gena->listeners);
+	free(gena->address);
+	free(gena);
+	return NULL;
 }
 
 int upnpd_upnp_gena_uninit (gena_t *gena)
 {
+	unsigned int i;
 	debugf(_DBG, "stopping gena thread");
 	if (gena == NULL) {
 		goto out;
@@ -1265,14 +3944,30 @@ int upnpd_upnp_gena_uninit (gena_t *gena)
 	upnpd_thread_mutex_lock(gena->mutex);
 	gena->running = 0;
 	upnpd_thread_cond_signal(gena->cond);
-	while (gena->stopped != 1) {
+	while (gena->stopped != gena->started) {
 		upnpd_thread_cond_wait(gena->cond, gena->mutex);
 	}
-	upnpd_thread_join(gena->thread);
 	upnpd_thread_mutex_unlock(gena->mutex);
+	for (i = 0; i < gena->config.listeners; i++) {
+		if (gena->listeners[i].thread != NULL) {
+			upnpd_thread_join(gena->listeners[i].thread);
+		}
+	}
+	gena_pool_uninit(&gena->pool);
+	if (gena->reactors != NULL) {
+		for (i = 0; i < gena->config.reactors; i++) {
+			gena_reactor_uninit(&gena->reactors[i]);
+		}
+		free(gena->reactors);
+	}
+	gena_peers_uninit(&gena->peers);
+	gena_stats_uninit(&gena->stats);
+	gena_shaper_uninit(&gena->shaper);
+	gena_buffers_uninit(&gena->buffers);
 	upnpd_thread_mutex_destroy(gena->mutex);
 	upnpd_thread_cond_destroy(gena->cond);
-	upnpd_socket_close(gena->socket);
+	gena_listeners_close(gena);
+	free(gena->listeners);
 	free(gena->address);
 	free(gena);
 out:	debugf(_DBG, "gena uninited");
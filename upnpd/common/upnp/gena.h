@@ -45,8 +45,31 @@ typedef enum {
 	GENA_EVENT_TYPE_SUBSCRIBE_RENEW   = 0x03,
 	GENA_EVENT_TYPE_SUBSCRIBE_DROP    = 0x04,
 	GENA_EVENT_TYPE_ACTION            = 0x05,
+	/* path of an action post, checked before its body is read */
+	GENA_EVENT_TYPE_ACTION_REQUEST    = 0x06,
 } gena_event_type_t;
 
+typedef enum {
+	GENA_MODE_THREAD  = 0x00,
+	GENA_MODE_REACTOR = 0x01,
+} gena_mode_t;
+
+typedef struct gena_config_s {
+	gena_mode_t mode;
+	unsigned int reactors;
+	unsigned int listeners;
+	unsigned int workers;
+	unsigned int streams;
+	unsigned int queue;
+	unsigned int keepalive_timeout;
+	unsigned int keepalive_requests;
+	unsigned int buffers;
+	/* media stream shaping in bytes per second, 0 for unlimited */
+	unsigned int streamrate;
+	unsigned int clientrate;
+	unsigned int totalrate;
+} gena_config_t;
+
 typedef struct gena_file_s {
 	int virtual;
 	int fd;
@@ -56,6 +79,9 @@ typedef struct gena_file_s {
 	void *data;
 } gena_file_t;
 
+/* size reported by info for streams produced on the fly, sent chunked */
+#define GENA_FILESIZE_UNKNOWN (~0ULL >> 1)
+
 typedef struct gena_fileinfo_s {
 	unsigned long long size;
 	char *mimetype;
@@ -70,6 +96,8 @@ typedef struct gena_callback_vfs_s {
 	int (*write) (void *cookie, void *handle, char *buffer, unsigned int length);
 	unsigned long long (*seek)  (void *cookie, void *handle, unsigned long long offset, gena_seek_t whence);
 	int (*close) (void *cookie, void *handle);
+	/* optional, returns descriptor and current offset of regular files for zero copy send, -1 otherwise */
+	int (*fd) (void *cookie, void *handle, unsigned long long *offset);
 	void *cookie;
 } gena_callback_vfs_t;
 
@@ -87,6 +115,8 @@ typedef struct gena_event_subscribe_s {
 	char *scope;
 	char *timeout;
 	char *sid;
+	/* granted subscription duration in seconds, set by the callback */
+	int duration;
 } gena_event_subscribe_t;
 
 typedef struct gena_event_action_s {
@@ -97,6 +127,9 @@ typedef struct gena_event_action_s {
 	char *request;
 	char *response;
 	unsigned int length;
+	/* set by the handler when the service knows the action, only then
+	 * the client supplied name is used as a stats label */
+	int valid;
 } gena_event_action_t;
 
 typedef struct gena_event_s {
@@ -120,7 +153,14 @@ typedef struct gena_callbacks_s {
 
 char * upnpd_upnp_gena_download (gena_t *gena, const char *host, const unsigned short port, const char *path);
 char * upnpd_upnp_gena_send_recv (gena_t *gena, const char *host, const unsigned short port, const char *header, const char *data);
+/* streams the response body to sink as it arrives, sink returns non zero to abort */
+int upnpd_upnp_gena_send_recv_sink (gena_t *gena, const char *host, const unsigned short port, const char *header, const char *data, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie);
+/* as above with timeout in milliseconds for connect, send and each receive,
+ * status is set to the response status code, 0 if none was received */
+int upnpd_upnp_gena_send_recv_status (gena_t *gena, const char *host, const unsigned short port, int timeout, const char *header, const char *data, int (*sink) (void *cookie, const char *buffer, unsigned int length), void *cookie, int *status);
+/* request counters and latency histograms in prometheus text format, caller frees */
+char * upnpd_upnp_gena_stats (gena_t *gena);
 unsigned short upnpd_upnp_gena_getport (gena_t *gena);
 const char * upnpd_upnp_gena_getaddress (gena_t *gena);
-gena_t * upnpd_upnp_gena_init (char *address, unsigned short port, gena_callbacks_t *callbacks);
+gena_t * upnpd_upnp_gena_init (char *address, unsigned short port, gena_callbacks_t *callbacks, gena_config_t *config);
 int upnpd_upnp_gena_uninit (gena_t *gena);
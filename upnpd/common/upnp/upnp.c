@@ -50,6 +50,21 @@
 #endif
 
 #define UPNP_SUBSCRIPTION_MAX 100
+#define UPNP_SUBSCRIPTION_BUCKETS 64
+/* granted subscription durations in seconds, also used for infinite */
+#define UPNP_SUBSCRIPTION_TIMEOUT 1800
+#define UPNP_SUBSCRIPTION_TIMEOUT_MIN 60
+/* expiry timer wheel, one slot per second */
+#define UPNP_SUBSCRIPTION_WHEEL 64
+
+/* event notifications are delivered by a small pool of notifier threads,
+ * each subscriber keeps its own queue so SEQ order is preserved and a dead
+ * control point only ever costs the events queued for it */
+#define UPNP_NOTIFY_WORKERS 2
+#define UPNP_NOTIFY_QUEUE_MAX 16
+#define UPNP_NOTIFY_FAILURES 3
+/* milliseconds, a dead callback should not hold a notifier thread long */
+#define UPNP_NOTIFY_TIMEOUT 3000
 
 typedef struct upnp_error_s {
 	upnp_error_type_t error;
@@ -85,13 +100,59 @@ static upnp_error_t upnp_errors[] = {
 	{ 0, 0, NULL }
 };
 
+typedef struct upnp_notify_s {
+	list_t head;
+	unsigned int sequence;
+	char *propset;
+} upnp_notify_t;
+
 typedef struct upnp_subscribe_s {
+	/** subscribers of the service */
 	list_t head;
+	/** sid hash bucket chain */
+	list_t bucket;
+	/** least recently renewed first */
+	list_t lru;
+	/** expiry timer wheel slot */
+	list_t timer;
+	struct upnp_service_s *service;
+	/** monotonic seconds */
+	unsigned long long expires;
 	char sid[50];
 	unsigned int sequence;
 	upnp_url_t url;
+	/* initial event is queued, until then it gets no moderated changes as
+	 * the initial event must be SEQ 0 and follow the SUBSCRIBE response */
+	int accepted;
+	/* pending upnp_notify_t in SEQ order, guarded by upnp->mutex */
+	list_t pending;
+	unsigned int npending;
+	/* link in notifier->ready, while waiting for a notifier thread */
+	list_t ready;
+	int queued;
+	/* a notifier thread is delivering, it frees the subscriber if dropped */
+	int busy;
+	int dropped;
+	unsigned int failures;
 } upnp_subscribe_t;
 
+/* moderated state of an evented variable, changes are held here until
+ * maxrate allows them out and are sent together with the other changes of
+ * the service in one propertyset */
+typedef struct upnp_variable_s {
+	list_t head;
+	char *name;
+	char *value;
+	int pending;
+	/* miliseconds between events, 0 for no limit */
+	unsigned int maxrate;
+	/* numeric change needed to trigger an event, 0 for any change */
+	unsigned int mindelta;
+	int evented;
+	double sent;
+	unsigned long long last;
+} upnp_variable_t;
+
 typedef struct upnp_service_s {
 	list_t head;
 	char *udn;
@@ -99,6 +160,7 @@ typedef struct upnp_service_s {
 	char *eventurl;
 	char *controlurl;
 	list_t subscribers;
+	list_t variables;
 } upnp_service_t;
 
 typedef enum {
@@ -112,10 +174,32 @@ typedef struct upnp_device_s {
 	char *description;
 	char *location;
 	list_t services;
+	/** control and event urls to services, built at register */
+	strmap_t *controls;
+	strmap_t *events;
 	int (*callback) (void *cookie, upnp_event_t *event);
 	void *cookie;
 } upnp_device_t;
 
+typedef struct upnp_subscriptions_s {
+	unsigned int count;
+	list_t lru;
+	list_t buckets[UPNP_SUBSCRIPTION_BUCKETS];
+	list_t wheel[UPNP_SUBSCRIPTION_WHEEL];
+	/** last second the wheel was turned to */
+	unsigned long long tick;
+} upnp_subscriptions_t;
+
+typedef struct upnp_notifier_s {
+	int running;
+	unsigned int started;
+	unsigned int nthreads;
+	thread_t *threads[UPNP_NOTIFY_WORKERS];
+	unsigned int nready;
+	list_t ready;
+	thread_cond_t *cond;
+} upnp_notifier_t;
+
 typedef struct upnp_client_s {
 	upnp_type_t type;
 	int (*callback) (void *cookie, upnp_event_t *event);
@@ -134,8 +218,11 @@ struct upnp_s {
 		upnp_client_t client;
 	} type;
 	thread_mutex_t *mutex;
+	upnp_notifier_t notifier;
+	upnp_subscriptions_t subscriptions;
 	gena_callbacks_t gena_callbacks;
 	gena_callback_vfs_t *vfscallbacks;
+	unsigned long long timestamp;
 };
 
 static int gena_callback_info (void *cookie, char *path, gena_fileinfo_t *info)
@@ -147,7 +234,7 @@ static int gena_callback_info (void *cookie, char *path, gena_fileinfo_t *info)
 	upnpd_thread_mutex_lock(upnp->mutex);
 	if (strcmp(path, "/description.xml") == 0) {
 		info->size = strlen(upnp->type.device.description);
-		info->mtime = (upnpd_time_gettimeofday() / 1000);
+		info->mtime = upnp->timestamp;
 		info->mimetype = strdup("text/xml");
 		upnpd_thread_mutex_unlock(upnp->mutex);
 		return 0;
@@ -274,45 +361,31 @@ static int gena_callback_close (void *cookie, void *handle)
 	return 0;
 }
 
-static char * strdup_escaped (const char *p )
+static int gena_callback_fd (void *cookie, void *handle, unsigned long long *offset)
 {
-	int i;
-	int j;
-	int plen;
-	int dlen;
-	char *buf;
-	if (p == NULL) {
-		return NULL;
+	upnp_t *upnp;
+	gena_file_t *file;
+	upnp = (upnp_t *) cookie;
+	file = (gena_file_t *) handle;
+	if (file == NULL || file->virtual == 1) {
+		return -1;
 	}
-	buf = NULL;
-	dlen = 0;
-	plen = strlen(p);
-	for (i = 0; i < plen; i++) {
-		switch (p[i]) {
-			case '<':  dlen += 4; break;
-			case '>':  dlen += 4; break;
-			case '&':  dlen += 5; break;
-			case '\'': dlen += 6; break;
-			case '\"': dlen += 6; break;
-			default:   dlen += 1; break;
-		}
+	if (upnp->vfscallbacks != NULL &&
+	    upnp->vfscallbacks->fd != NULL) {
+		return upnp->vfscallbacks->fd(upnp->vfscallbacks->cookie, file->data, offset);
 	}
-	buf = (char *) malloc(dlen + 1);
-	if (buf == NULL) {
+	return -1;
+}
+
+static char * strdup_escaped (const char *p )
+{
+	strbuf_t buf;
+	if (p == NULL) {
 		return NULL;
 	}
-	for (j = 0, i = 0; i < plen; i++) {
-		switch (p[i]) {
-			case '<':  buf[j++] = '&'; buf[j++] = 'l'; buf[j++] = 't'; buf[j++] = ';'; break;
-			case '>':  buf[j++] = '&'; buf[j++] = 'g'; buf[j++] = 't'; buf[j++] = ';'; break;
-			case '&':  buf[j++] = '&'; buf[j++] = 'a'; buf[j++] = 'm'; buf[j++] = 'p'; buf[j++] = ';'; break;
-			case '\'': buf[j++] = '&'; buf[j++] = 'a'; buf[j++] = 'p'; buf[j++] = 'o'; buf[j++] = 's'; buf[j++] = ';'; break;
-			case '\"': buf[j++] = '&'; buf[j++] = 'q'; buf[j++] = 'u'; buf[j++] = 'o'; buf[j++] = 't'; buf[j++] = ';'; break;
-			default:   buf[j++] = p[i]; break;
-		}
-	}
-	buf[j] = '\0';
-	return buf;
+	upnpd_strbuf_init(&buf, upnpd_strbuf_escape_length(p));
+	upnpd_strbuf_escape(&buf, p);
+	return upnpd_strbuf_detach(&buf);
 }
 
 int upnpd_upnp_addtoactionresponse (upnp_event_action_t *response, const char *service, const char *variable, const char *value)
@@ -353,40 +426,334 @@ int upnpd_upnp_addtoactionresponse (upnp_event_action_t *response, const char *s
 
 static char * upnp_propertyset (const char **names, const char **values, unsigned int count)
 {
-	char *buffer;
-	unsigned int counter = 0;
-	int size = 0;
-	unsigned int temp_counter = 0;
+	strbuf_t buf;
+	unsigned int i;
+	unsigned int size;
+	const char *head = "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">";
+	const char *tail = "</e:propertyset>\n\n";
+
+	size = strlen(head) + strlen(tail);
+	for (i = 0; i < count; i++) {
+		size += strlen("<e:property><></></e:property>") + 2 * strlen(names[i]) + strlen(values[i]);
+	}
+	upnpd_strbuf_init(&buf, size);
+	upnpd_strbuf_append(&buf, head);
+	for (i = 0; i < count; i++) {
+		upnpd_strbuf_append(&buf, "<e:property><");
+		upnpd_strbuf_append(&buf, names[i]);
+		upnpd_strbuf_append(&buf, ">");
+		upnpd_strbuf_append(&buf, values[i]);
+		upnpd_strbuf_append(&buf, "</");
+		upnpd_strbuf_append(&buf, names[i]);
+		upnpd_strbuf_append(&buf, "></e:property>");
+	}
+	upnpd_strbuf_append(&buf, tail);
+	return upnpd_strbuf_detach(&buf);
+}
 
-	size += strlen("<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">\n");
-	size += strlen("</e:propertyset>\n\n");
+static unsigned int upnp_subscriptions_hash (const char *sid)
+{
+	unsigned int hash;
+	hash = 5381;
+	while (*sid != '\0') {
+		hash = ((hash << 5) + hash) + (unsigned char) *sid++;
+	}
+	return hash % UPNP_SUBSCRIPTION_BUCKETS;
+}
+
+static unsigned long long upnp_subscriptions_now (void)
+{
+	return upnpd_time_monotonic() / 1000000;
+}
 
-	for (temp_counter = 0, counter = 0; counter < count; counter++) {
-		size += strlen( "<e:property>\n</e:property>\n" );
-		size += (2 * strlen(names[counter]) + strlen(values[counter]) + (strlen("<></>\n")));
+static void upnp_subscriptions_init (upnp_subscriptions_t *subscriptions)
+{
+	unsigned int i;
+	list_init(&subscriptions->lru);
+	for (i = 0; i < UPNP_SUBSCRIPTION_BUCKETS; i++) {
+		list_init(&subscriptions->buckets[i]);
 	}
-	buffer = (char *)malloc(size + 1);
-	if (buffer == NULL) {
-		return NULL;
+	for (i = 0; i < UPNP_SUBSCRIPTION_WHEEL; i++) {
+		list_init(&subscriptions->wheel[i]);
 	}
-	memset(buffer, 0, size + 1);
+	subscriptions->count = 0;
+	subscriptions->tick = upnp_subscriptions_now();
+}
 
-	strcpy(buffer, "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">");
-	for (counter = 0; counter < count; counter++) {
-		strcat(buffer, "<e:property>");
-		sprintf(&buffer[strlen(buffer)], "<%s>%s</%s></e:property>", names[counter], values[counter], names[counter]);
+/* called with upnp->mutex held */
+static upnp_subscribe_t * upnp_subscriptions_find (upnp_subscriptions_t *subscriptions, const char *sid)
+{
+	upnp_subscribe_t *c;
+	list_for_each_entry(c, &subscriptions->buckets[upnp_subscriptions_hash(sid)], bucket, upnp_subscribe_t) {
+		if (strcmp(c->sid, sid) == 0) {
+			return c;
+		}
 	}
-	strcat(buffer, "</e:propertyset>\n\n");
-	return buffer;
+	return NULL;
 }
 
-int upnpd_upnp_accept_subscription (upnp_t *upnp, const char *udn, const char *serviceid, const char **variable_names, const char **variable_values, const unsigned int variables_count, const char *sid)
+/* called with upnp->mutex held, (re)starts the subscription for duration
+ * seconds and marks it most recently used */
+static void upnp_subscriptions_touch (upnp_subscriptions_t *subscriptions, upnp_subscribe_t *c, unsigned int duration)
+{
+	list_del(&c->lru);
+	list_add_tail(&c->lru, &subscriptions->lru);
+	list_del(&c->timer);
+	c->expires = upnp_subscriptions_now() + duration;
+	list_add_tail(&c->timer, &subscriptions->wheel[c->expires % UPNP_SUBSCRIPTION_WHEEL]);
+}
+
+static unsigned int upnp_subscriptions_duration (const char *timeout)
+{
+	long duration;
+	if (timeout == NULL ||
+	    strncasecmp(timeout, "Second-", strlen("Second-")) != 0) {
+		return UPNP_SUBSCRIPTION_TIMEOUT;
+	}
+	timeout += strlen("Second-");
+	if (strcasecmp(timeout, "infinite") == 0) {
+		return UPNP_SUBSCRIPTION_TIMEOUT;
+	}
+	duration = strtol(timeout, NULL, 10);
+	if (duration < UPNP_SUBSCRIPTION_TIMEOUT_MIN) {
+		return UPNP_SUBSCRIPTION_TIMEOUT_MIN;
+	}
+	if (duration > UPNP_SUBSCRIPTION_TIMEOUT) {
+		return UPNP_SUBSCRIPTION_TIMEOUT;
+	}
+	return (unsigned int) duration;
+}
+
+static void upnp_subscribe_free (upnp_subscribe_t *c)
+{
+	upnp_notify_t *n;
+	upnp_notify_t *nn;
+	list_for_each_entry_safe(n, nn, &c->pending, head, upnp_notify_t) {
+		list_del(&n->head);
+		free(n->propset);
+		free(n);
+	}
+	free(c->url.host);
+	free(c->url.url);
+	free(c->url.path);
+	free(c);
+}
+
+/* called with upnp->mutex held, a subscriber being delivered to is left to
+ * its notifier thread */
+static void upnp_subscribe_remove (upnp_t *upnp, upnp_subscribe_t *c)
+{
+	list_del(&c->head);
+	list_del(&c->bucket);
+	list_del(&c->lru);
+	list_del(&c->timer);
+	upnp->subscriptions.count--;
+	if (c->queued == 1) {
+		list_del(&c->ready);
+		upnp->notifier.nready--;
+		c->queued = 0;
+	}
+	if (c->busy == 1) {
+		c->dropped = 1;
+		return;
+	}
+	upnp_subscribe_free(c);
+}
+
+/* called with upnp->mutex held */
+static void upnp_subscribe_schedule (upnp_t *upnp, upnp_subscribe_t *c)
+{
+	if (c->queued == 1 || c->busy == 1 || c->npending == 0) {
+		return;
+	}
+	list_add_tail(&c->ready, &upnp->notifier.ready);
+	upnp->notifier.nready++;
+	c->queued = 1;
+	upnpd_thread_cond_signal(upnp->notifier.cond);
+}
+
+/* called with upnp->mutex held, turns the wheel up to now and drops the
+ * subscriptions that were not renewed in time */
+static void upnp_subscriptions_expire (upnp_t *upnp)
+{
+	unsigned int i;
+	upnp_subscribe_t *c;
+	upnp_subscribe_t *cn;
+	unsigned long long now;
+	upnp_subscriptions_t *subscriptions;
+	subscriptions = &upnp->subscriptions;
+	now = upnp_subscriptions_now();
+	for (i = 0; i < UPNP_SUBSCRIPTION_WHEEL && subscriptions->tick < now; i++) {
+		subscriptions->tick++;
+		list_for_each_entry_safe(c, cn, &subscriptions->wheel[subscriptions->tick % UPNP_SUBSCRIPTION_WHEEL], timer, upnp_subscribe_t) {
+			if (c->expires <= now) {
+				debugf(_DBG, "subscription '%s' expired", c->sid);
+				upnp_subscribe_remove(upnp, c);
+			}
+		}
+	}
+	subscriptions->tick = now;
+}
+
+/* called with upnp->mutex held, takes over propset */
+static int upnp_subscribe_enqueue (upnp_t *upnp, upnp_subscribe_t *c, char *propset)
+{
+	upnp_notify_t *n;
+	upnp_notify_t *o;
+	n = (upnp_notify_t *) malloc(sizeof(upnp_notify_t));
+	if (n == NULL) {
+		free(propset);
+		return -1;
+	}
+	memset(n, 0, sizeof(upnp_notify_t));
+	n->propset = propset;
+	if (c->npending >= UPNP_NOTIFY_QUEUE_MAX) {
+		o = list_first_entry(&c->pending, upnp_notify_t, head);
+		debugf(_DBG, "queue of '%s' is full, dropping event %u", c->sid, o->sequence);
+		list_del(&o->head);
+		free(o->propset);
+		free(o);
+		c->npending--;
+	}
+	n->sequence = c->sequence++;
+	list_add_tail(&n->head, &c->pending);
+	c->npending++;
+	upnp_subscribe_schedule(upnp, c);
+	return 0;
+}
+
+static void upnp_variable_free (upnp_variable_t *v)
+{
+	free(v->name);
+	free(v->value);
+	free(v);
+}
+
+/* returns when the pending change may be evented, 0 if it does not trigger
+ * an event on its own */
+static unsigned long long upnp_variable_deadline (upnp_variable_t *v)
+{
+	double delta;
+	if (v->pending == 0) {
+		return 0;
+	}
+	if (v->mindelta > 0 && v->evented == 1) {
+		delta = strtod(v->value, NULL) - v->sent;
+		if (delta < 0) {
+			delta = -delta;
+		}
+		if (delta < v->mindelta) {
+			return 0;
+		}
+	}
+	if (v->evented == 0) {
+		return 1;
+	}
+	return v->last + (unsigned long long) v->maxrate * 1000;
+}
+
+/* called with upnp->mutex held, sends the due changes of a service as one
+ * propertyset, changes held back by mindelta ride along */
+static void upnp_service_moderate (upnp_t *upnp, upnp_service_t *s, unsigned long long now)
 {
-	char *data;
-	char *header;
 	char *propset;
-	upnp_service_t *s;
+	unsigned int count;
+	upnp_variable_t *v;
 	upnp_subscribe_t *c;
+	unsigned long long deadline;
+	const char **names;
+	const char **values;
+	count = 0;
+	list_for_each_entry(v, &s->variables, head, upnp_variable_t) {
+		deadline = upnp_variable_deadline(v);
+		if (deadline != 0 && deadline <= now) {
+			count++;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+	count = list_count(&s->variables);
+	names = (const char **) malloc(sizeof(char *) * count);
+	values = (const char **) malloc(sizeof(char *) * count);
+	if (names == NULL || values == NULL) {
+		free(names);
+		free(values);
+		return;
+	}
+	count = 0;
+	list_for_each_entry(v, &s->variables, head, upnp_variable_t) {
+		deadline = upnp_variable_deadline(v);
+		if (v->pending == 1 && deadline <= now) {
+			names[count] = v->name;
+			values[count] = v->value;
+			count++;
+			v->pending = 0;
+			v->evented = 1;
+			v->sent = strtod(v->value, NULL);
+			v->last = now;
+		}
+	}
+	debugf(_DBG, "eventing %u changed variables of '%s'", count, s->serviceid);
+	list_for_each_entry(c, &s->subscribers, head, upnp_subscribe_t) {
+		if (c->accepted == 0) {
+			continue;
+		}
+		propset = upnp_propertyset(names, values, count);
+		if (propset == NULL) {
+			break;
+		}
+		upnp_subscribe_enqueue(upnp, c, propset);
+	}
+	free(names);
+	free(values);
+}
+
+/* called with upnp->mutex held, returns miliseconds until the next moderated
+ * change is due, -1 if there is none */
+static int upnp_notifier_moderate (upnp_t *upnp)
+{
+	int timeout;
+	upnp_service_t *s;
+	upnp_variable_t *v;
+	unsigned long long now;
+	unsigned long long next;
+	unsigned long long deadline;
+	if (upnp->type.type != UPNP_TYPE_DEVICE) {
+		return -1;
+	}
+	now = upnpd_time_monotonic();
+	next = 0;
+	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
+		upnp_service_moderate(upnp, s, now);
+		list_for_each_entry(v, &s->variables, head, upnp_variable_t) {
+			deadline = upnp_variable_deadline(v);
+			if (deadline != 0 && (next == 0 || deadline < next)) {
+				next = deadline;
+			}
+		}
+	}
+	if (next == 0) {
+		return -1;
+	}
+	timeout = (next > now) ? (int) ((next - now + 999) / 1000) : 0;
+	return timeout;
+}
+
+static int upnp_notify_sink (void *cookie, const char *buffer, unsigned int length)
+{
+	(void) cookie;
+	(void) buffer;
+	(void) length;
+	return 0;
+}
+
+/* returns the status code of the response, -1 if none was received */
+static int upnp_notify_send (upnp_t *upnp, upnp_subscribe_t *c, upnp_notify_t *n)
+{
+	int rc;
+	int status;
+	char *header;
 	const char *format =
 		"NOTIFY /%s HTTP/1.1\r\n"
 		"HOST: %s:%d\r\n"
@@ -396,55 +763,235 @@ int upnpd_upnp_accept_subscription (upnp_t *upnp, const char *udn, const char *s
 		"NTS: upnp:propchange\r\n"
 		"SID: %s\r\n"
 		"SEQ: %u\r\n"
-		"Connection: close\r\n"
 		"Cache-Control: no-cache\r\n"
 		"\r\n";
+	if (asprintf(&header, format,
+			c->url.path,
+			c->url.host, c->url.port,
+			strlen(n->propset),
+			c->sid,
+			n->sequence) < 0) {
+		return -1;
+	}
+	debugf(_DBG, "header: %s\n", header);
+	debugf(_DBG, "propset: %s\n", n->propset);
+	rc = upnpd_upnp_gena_send_recv_status(upnp->gena, c->url.host, c->url.port, UPNP_NOTIFY_TIMEOUT, header, n->propset, upnp_notify_sink, NULL, &status);
+	free(header);
+	return (rc == 0) ? status : -1;
+}
+
+static void * upnp_notifier_loop (void *arg)
+{
+	int rc;
+	int timeout;
+	upnp_t *upnp;
+	upnp_notify_t *n;
+	upnp_notify_t *nn;
+	upnp_subscribe_t *c;
+	upnp_notifier_t *notifier;
+
+	upnp = (upnp_t *) arg;
+	notifier = &upnp->notifier;
+
 	upnpd_thread_mutex_lock(upnp->mutex);
-	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
-		if (strcmp(s->serviceid, serviceid) == 0 &&
-		    strcmp(s->udn, udn) == 0) {
-			list_for_each_entry(c, &s->subscribers, head, upnp_subscribe_t) {
-				if (strcmp(c->sid, sid) == 0) {
-					goto found;
-				}
+	notifier->started++;
+	upnpd_thread_cond_broadcast(notifier->cond);
+
+	while (1) {
+		if (notifier->running == 0) {
+			break;
+		}
+		upnp_subscriptions_expire(upnp);
+		timeout = upnp_notifier_moderate(upnp);
+		if (upnp->subscriptions.count > 0 && (timeout < 0 || timeout > 1000)) {
+			timeout = 1000;
+		}
+		if (notifier->nready == 0) {
+			if (timeout != 0) {
+				upnpd_thread_cond_timedwait(notifier->cond, upnp->mutex, timeout);
 			}
+			continue;
+		}
+		c = list_first_entry(&notifier->ready, upnp_subscribe_t, ready);
+		list_del(&c->ready);
+		notifier->nready--;
+		c->queued = 0;
+		n = list_first_entry(&c->pending, upnp_notify_t, head);
+		list_del(&n->head);
+		c->npending--;
+		c->busy = 1;
+		upnpd_thread_mutex_unlock(upnp->mutex);
+
+		/* url and sid are not changed while the subscriber lives, and
+		 * busy keeps it alive */
+		rc = upnp_notify_send(upnp, c, n);
+		free(n->propset);
+		free(n);
+
+		upnpd_thread_mutex_lock(upnp->mutex);
+		c->busy = 0;
+		if (c->dropped == 1) {
+			upnp_subscribe_free(c);
+			continue;
+		}
+		if (rc == 412) {
+			/* control point does not know the sid any more */
+			debugf(_DBG, "subscriber '%s' rejected notify, dropping", c->sid);
+			upnp_subscribe_remove(upnp, c);
+			continue;
+		}
+		if (rc >= 200 && rc < 300) {
+			c->failures = 0;
+		} else {
+			c->failures++;
+			debugf(_DBG, "notify to '%s' failed (%u)", c->sid, c->failures);
+			if (c->failures >= UPNP_NOTIFY_FAILURES) {
+				debugf(_DBG, "expiring unreachable subscriber '%s'", c->sid);
+				upnp_subscribe_remove(upnp, c);
+				continue;
+			}
+			/* the subscriber missed a SEQ and has to resubscribe anyway,
+			 * do not spend a connect timeout on each queued event */
+			list_for_each_entry_safe(n, nn, &c->pending, head, upnp_notify_t) {
+				list_del(&n->head);
+				free(n->propset);
+				free(n);
+			}
+			c->npending = 0;
+		}
+		upnp_subscribe_schedule(upnp, c);
+	}
+
+	upnpd_thread_mutex_unlock(upnp->mutex);
+	return NULL;
+}
+
+static int upnp_notifier_init (upnp_t *upnp)
+{
+	unsigned int i;
+	upnp_notifier_t *notifier;
+	notifier = &upnp->notifier;
+	list_init(&notifier->ready);
+	notifier->cond = upnpd_thread_cond_init("notifier->cond");
+	if (notifier->cond == NULL) {
+		return -1;
+	}
+	upnpd_thread_mutex_lock(upnp->mutex);
+	notifier->running = 1;
+	for (i = 0; i < UPNP_NOTIFY_WORKERS; i++) {
+		notifier->threads[i] = upnpd_thread_create("upnp_notifier_loop", upnp_notifier_loop, upnp);
+		if (notifier->threads[i] == NULL) {
 			break;
 		}
 	}
+	notifier->nthreads = i;
+	while (notifier->started != notifier->nthreads) {
+		upnpd_thread_cond_wait(notifier->cond, upnp->mutex);
+	}
+	upnpd_thread_mutex_unlock(upnp->mutex);
+	debugf(_DBG, "started %u notifier threads", notifier->nthreads);
+	return (notifier->nthreads > 0) ? 0 : -1;
+}
+
+static void upnp_notifier_uninit (upnp_t *upnp)
+{
+	unsigned int i;
+	upnp_notifier_t *notifier;
+	notifier = &upnp->notifier;
+	if (notifier->cond == NULL) {
+		return;
+	}
+	upnpd_thread_mutex_lock(upnp->mutex);
+	notifier->running = 0;
+	upnpd_thread_cond_broadcast(notifier->cond);
+	upnpd_thread_mutex_unlock(upnp->mutex);
+	for (i = 0; i < notifier->nthreads; i++) {
+		upnpd_thread_join(notifier->threads[i]);
+	}
+	upnpd_thread_cond_destroy(notifier->cond);
+	notifier->cond = NULL;
+}
+
+int upnpd_upnp_accept_subscription (upnp_t *upnp, const char *udn, const char *serviceid, const char **variable_names, const char **variable_values, const unsigned int variables_count, const char *sid)
+{
+	char *propset;
+	upnp_subscribe_t *c;
+	propset = upnp_propertyset(variable_names, variable_values, variables_count);
+	if (propset == NULL) {
+		return 0;
+	}
+	upnpd_thread_mutex_lock(upnp->mutex);
+	c = upnp_subscriptions_find(&upnp->subscriptions, sid);
+	if (c != NULL &&
+	    strcmp(c->service->serviceid, serviceid) == 0 &&
+	    strcmp(c->service->udn, udn) == 0) {
+		goto found;
+	}
 	debugf(_DBG, "cannot find subscription: %s\n", sid);
 	upnpd_thread_mutex_unlock(upnp->mutex);
+	free(propset);
 	return 0;
 
 found:
-	debugf(_DBG, "found subscription: %s\n", sid);
+	debugf(_DBG, "queueing event %u for subscription: %s\n", c->sequence, sid);
+	upnp_subscribe_enqueue(upnp, c, propset);
+	c->accepted = 1;
 	upnpd_thread_mutex_unlock(upnp->mutex);
-	propset = upnp_propertyset(variable_names, variable_values, variables_count);
-	if (propset == NULL) {
+	return 0;
+}
+
+int upnpd_upnp_event_variable (upnp_t *upnp, const char *udn, const char *serviceid, const char *name, const char *value, unsigned int maxrate, unsigned int mindelta)
+{
+	int ret;
+	char *tmp;
+	upnp_service_t *s;
+	upnp_variable_t *v;
+	ret = -1;
+	upnpd_thread_mutex_lock(upnp->mutex);
+	if (upnp->type.type != UPNP_TYPE_DEVICE) {
 		goto out;
 	}
-	if (asprintf(&header, format,
-			c->url.path,
-			c->url.host, c->url.port,
-			strlen(propset),
-			c->sid,
-			c->sequence) < 0) {
-		free(propset);
-		goto out;
+	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
+		if (strcmp(s->serviceid, serviceid) == 0 &&
+		    strcmp(s->udn, udn) == 0) {
+			goto found;
+		}
 	}
-	c->sequence++;
+	debugf(_DBG, "cannot find service: %s", serviceid);
+	goto out;
 
-	debugf(_DBG, "header: %s\n", header);
-	debugf(_DBG, "propset: %s\n", propset);
-
-	data = upnpd_upnp_gena_send_recv(upnp->gena, c->url.host, c->url.port, header, propset);
-	if (data == NULL) {
-		//debugf(_DBG, "gena_send_recv() failed");
+found:
+	list_for_each_entry(v, &s->variables, head, upnp_variable_t) {
+		if (strcmp(v->name, name) == 0) {
+			goto update;
+		}
+	}
+	v = (upnp_variable_t *) malloc(sizeof(upnp_variable_t));
+	if (v == NULL) {
+		goto out;
 	}
+	memset(v, 0, sizeof(upnp_variable_t));
+	v->name = strdup(name);
+	if (v->name == NULL) {
+		free(v);
+		goto out;
+	}
+	list_add_tail(&v->head, &s->variables);
 
-	free(data);
-	free(header);
-	free(propset);
-out:	return 0;
+update:
+	tmp = strdup(value);
+	if (tmp == NULL) {
+		goto out;
+	}
+	free(v->value);
+	v->value = tmp;
+	v->maxrate = maxrate;
+	v->mindelta = mindelta;
+	v->pending = 1;
+	upnpd_thread_cond_signal(upnp->notifier.cond);
+	ret = 0;
+out:	upnpd_thread_mutex_unlock(upnp->mutex);
+	return ret;
 }
 
 static size_t __strnlen (const char *string, size_t maxlen)
@@ -535,36 +1082,48 @@ static int gena_callback_event_subscribe_request (upnp_t *upnp, gena_event_subsc
 	uuid_gen_t uuid;
 	upnp_service_t *s;
 	upnp_subscribe_t *c;
+	upnp_subscribe_t *o;
 	ret = -1;
 	debugf(_DBG, "enter");
 	upnpd_thread_mutex_lock(upnp->mutex);
-	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
+	s = (upnp_service_t *) upnpd_strmap_find(upnp->type.device.events, subscribe->path);
+	if (s != NULL) {
 		debugf(_DBG, "eventurl: %s, callback: %s", s->eventurl, subscribe->callback);
-		if (strcmp(subscribe->path, s->eventurl) == 0) {
-			c = (upnp_subscribe_t *) malloc(sizeof(upnp_subscribe_t));
-			if (c == NULL) {
-				ret = -1;
-				goto out;
-			}
-			memset(c, 0, sizeof(upnp_subscribe_t));
-			upnpd_upnp_uuid_generate(&uuid);
-			sprintf(c->sid, "uuid:%s", uuid.uuid);
-			subscribe->sid = strdup(c->sid);
-			if (subscribe->sid == NULL) {
-				free(c);
-				ret = -1;
-				goto out;
-			}
-			if (upnpd_upnp_url_parse(subscribe->callback, &c->url) != 0) {
-				debugf(_DBG, "upnpd_upnp_url_parse(%s) failed", subscribe->callback);
-				free(c);
-				ret = -1;
-				goto out;
-			}
-			list_add_tail(&c->head, &s->subscribers);
-			ret = 0;
+		c = (upnp_subscribe_t *) malloc(sizeof(upnp_subscribe_t));
+		if (c == NULL) {
+			ret = -1;
 			goto out;
 		}
+		memset(c, 0, sizeof(upnp_subscribe_t));
+		list_init(&c->pending);
+		list_init(&c->lru);
+		list_init(&c->timer);
+		upnpd_upnp_uuid_generate(&uuid);
+		sprintf(c->sid, "uuid:%s", uuid.uuid);
+		subscribe->sid = strdup(c->sid);
+		if (subscribe->sid == NULL) {
+			upnp_subscribe_free(c);
+			ret = -1;
+			goto out;
+		}
+		if (upnpd_upnp_url_parse(subscribe->callback, &c->url) != 0) {
+			debugf(_DBG, "upnpd_upnp_url_parse(%s) failed", subscribe->callback);
+			upnp_subscribe_free(c);
+			ret = -1;
+			goto out;
+		}
+		if (upnp->subscriptions.count >= UPNP_SUBSCRIPTION_MAX) {
+			o = list_first_entry(&upnp->subscriptions.lru, upnp_subscribe_t, lru);
+			debugf(_DBG, "too many subscriptions, evicting '%s'", o->sid);
+			upnp_subscribe_remove(upnp, o);
+		}
+		c->service = s;
+		list_add_tail(&c->head, &s->subscribers);
+		list_add(&c->bucket, &upnp->subscriptions.buckets[upnp_subscriptions_hash(c->sid)]);
+		upnp->subscriptions.count++;
+		subscribe->duration = upnp_subscriptions_duration(subscribe->timeout);
+		upnp_subscriptions_touch(&upnp->subscriptions, c, subscribe->duration);
+		ret = 0;
 	}
 out:	upnpd_thread_mutex_unlock(upnp->mutex);
 	debugf(_DBG, "ret: %d", ret);
@@ -579,23 +1138,21 @@ static int gena_callback_event_subscribe_accept (upnp_t *upnp, gena_event_subscr
 	ret = -1;
 	debugf(_DBG, "enter");
 	upnpd_thread_mutex_lock(upnp->mutex);
-	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
-		if (strcmp(subscribe->path, s->eventurl) == 0) {
-			memset(&e, 0, sizeof(upnp_event_t));
-			e.type = UPNP_EVENT_TYPE_SUBSCRIBE_REQUEST;
-			e.event.subscribe.serviceid = s->serviceid;
-			e.event.subscribe.udn = s->udn;
-			e.event.subscribe.sid = subscribe->sid;
-			upnpd_thread_mutex_unlock(upnp->mutex);
-			if (upnp->type.device.callback != NULL) {
-				upnp->type.device.callback(upnp->type.device.cookie, &e);
-			}
-			upnpd_thread_mutex_lock(upnp->mutex);
-			ret = 0;
-			goto out;
+	s = (upnp_service_t *) upnpd_strmap_find(upnp->type.device.events, subscribe->path);
+	if (s != NULL) {
+		memset(&e, 0, sizeof(upnp_event_t));
+		e.type = UPNP_EVENT_TYPE_SUBSCRIBE_REQUEST;
+		e.event.subscribe.serviceid = s->serviceid;
+		e.event.subscribe.udn = s->udn;
+		e.event.subscribe.sid = subscribe->sid;
+		upnpd_thread_mutex_unlock(upnp->mutex);
+		if (upnp->type.device.callback != NULL) {
+			upnp->type.device.callback(upnp->type.device.cookie, &e);
 		}
+		upnpd_thread_mutex_lock(upnp->mutex);
+		ret = 0;
 	}
-out:	upnpd_thread_mutex_unlock(upnp->mutex);
+	upnpd_thread_mutex_unlock(upnp->mutex);
 	debugf(_DBG, "ret: %d", ret);
 	return ret;
 }
@@ -603,65 +1160,95 @@ out:	upnpd_thread_mutex_unlock(upnp->mutex);
 static int gena_callback_event_subscribe_renew (upnp_t *upnp, gena_event_subscribe_t *subscribe)
 {
 	int ret;
-	upnp_service_t *s;
 	upnp_subscribe_t *c;
 	ret = -1;
+	if (subscribe->sid == NULL) {
+		return -1;
+	}
 	upnpd_thread_mutex_lock(upnp->mutex);
-	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
-		if (strcmp(subscribe->path, s->eventurl) == 0) {
-			list_for_each_entry(c, &s->subscribers, head, upnp_subscribe_t) {
-				if (strcmp(c->sid, subscribe->sid) == 0) {
-					ret = 0;
-					goto out;
-				}
-			}
-		}
+	c = upnp_subscriptions_find(&upnp->subscriptions, subscribe->sid);
+	if (c != NULL && strcmp(subscribe->path, c->service->eventurl) == 0) {
+		subscribe->duration = upnp_subscriptions_duration(subscribe->timeout);
+		upnp_subscriptions_touch(&upnp->subscriptions, c, subscribe->duration);
+		ret = 0;
 	}
-out:	upnpd_thread_mutex_unlock(upnp->mutex);
-	return -1;
+	upnpd_thread_mutex_unlock(upnp->mutex);
+	debugf(_DBG, "renew '%s' ret: %d", subscribe->sid, ret);
+	return ret;
 }
 
 static int gena_callback_event_subscribe_drop (upnp_t *upnp, gena_event_unsubscribe_t *unsubscribe)
 {
-	upnp_service_t *s;
+	int ret;
 	upnp_subscribe_t *c;
-	upnp_subscribe_t *cn;
+	ret = -1;
+	if (unsubscribe->sid == NULL) {
+		return -1;
+	}
 	upnpd_thread_mutex_lock(upnp->mutex);
-	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
-		if (strcmp(unsubscribe->path, s->eventurl) == 0) {
-			list_for_each_entry_safe(c, cn, &s->subscribers, head, upnp_subscribe_t) {
-				if (strcmp(c->sid, unsubscribe->sid) == 0) {
-					list_del(&c->head);
-					free(c->url.host);
-					free(c->url.url);
-					free(c->url.path);
-					free(c);
-				}
-			}
-		}
+	c = upnp_subscriptions_find(&upnp->subscriptions, unsubscribe->sid);
+	if (c != NULL && strcmp(unsubscribe->path, c->service->eventurl) == 0) {
+		upnp_subscribe_remove(upnp, c);
+		ret = 0;
 	}
 	upnpd_thread_mutex_unlock(upnp->mutex);
-	return 0;
+	return ret;
 }
 
-static int gena_callback_event_action (upnp_t *upnp, gena_event_action_t *action)
+/* builds the soap envelope of an action response in one pass, sized up front */
+static char * upnp_action_response (upnp_event_action_t *action)
 {
-	int ret;
-	char *tmp;
-	char *response;
-	upnp_event_t e;
-	upnp_service_t *s;
-	upnp_error_t *error;
+	strbuf_t buf;
+	unsigned int size;
 	upnp_event_action_node_t *n;
-	upnp_event_action_node_t *n_;
-	const char *envelope =
+	const char *head =
 	        "<s:Envelope "
 	        "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
 	        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
-	        "<s:Body>\n"
-		"%s"
+	        "<s:Body>\n";
+	const char *tail =
 		"</s:Body>\n"
 		"</s:Envelope>\n";
+
+	size = strlen(head) + strlen(tail);
+	size += strlen("<u:Response xmlns:u=\"\">\n") + strlen(action->action) + ((action->response.service != NULL) ? strlen(action->response.service) : strlen("(null)"));
+	size += strlen("</u:Response>") + strlen(action->action);
+	list_for_each_entry(n, &action->response.nodes, head, upnp_event_action_node_t) {
+		size += strlen("<></>\n") + 2 * strlen(n->variable) + ((n->value != NULL) ? strlen(n->value) : strlen("(null)"));
+	}
+	upnpd_strbuf_init(&buf, size);
+	upnpd_strbuf_append(&buf, head);
+	upnpd_strbuf_printf(&buf, "<u:%sResponse xmlns:u=\"%s\">\n", action->action, (action->response.service != NULL) ? action->response.service : "(null)");
+	list_for_each_entry(n, &action->response.nodes, head, upnp_event_action_node_t) {
+		upnpd_strbuf_append(&buf, "<");
+		upnpd_strbuf_append(&buf, n->variable);
+		upnpd_strbuf_append(&buf, ">");
+		upnpd_strbuf_append(&buf, (n->value != NULL) ? n->value : "(null)");
+		upnpd_strbuf_append(&buf, "</");
+		upnpd_strbuf_append(&buf, n->variable);
+		upnpd_strbuf_append(&buf, ">\n");
+	}
+	upnpd_strbuf_printf(&buf, "</u:%sResponse>", action->action);
+	upnpd_strbuf_append(&buf, tail);
+	return upnpd_strbuf_detach(&buf);
+}
+
+static int gena_callback_event_action_request (upnp_t *upnp, gena_event_action_t *action)
+{
+	int ret;
+	upnpd_thread_mutex_lock(upnp->mutex);
+	ret = (upnpd_strmap_find(upnp->type.device.controls, action->path) != NULL) ? 0 : -1;
+	upnpd_thread_mutex_unlock(upnp->mutex);
+	return ret;
+}
+
+static int gena_callback_event_action (upnp_t *upnp, gena_event_action_t *action)
+{
+	upnp_event_t e;
+	upnp_service_t *s;
+	upnp_error_t *error;
+	upnp_event_action_node_t *n;
+	upnp_event_action_node_t *n_;
 	const char *fault =
 		"<s:Envelope "
 		"xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
@@ -680,102 +1267,47 @@ static int gena_callback_event_action (upnp_t *upnp, gena_event_action_t *action
 		"</s:Body>\n"
 		"</s:Envelope>\n";
 
-	ret = -1;
 	upnpd_thread_mutex_lock(upnp->mutex);
-	list_for_each_entry(s, &upnp->type.device.services, head, upnp_service_t) {
-		if (strcmp(action->path, s->controlurl) == 0) {
-			memset(&e, 0, sizeof(upnp_event_t));
-			e.type = UPNP_EVENT_TYPE_ACTION;
-			e.event.action.action = action->action;
-			e.event.action.request = action->request;
-			e.event.action.serviceid = s->serviceid;
-			e.event.action.udn = s->udn;
-			list_init(&e.event.action.response.nodes);
-			upnpd_thread_mutex_unlock(upnp->mutex);
-			if (upnp->type.device.callback != NULL) {
-				upnp->type.device.callback(upnp->type.device.cookie, &e);
-			}
-			if (e.event.action.errcode == 0) {
-				tmp = NULL;
-				if (asprintf(&tmp,
-						"<u:%sResponse xmlns:u=\"%s\">\n",
-						 e.event.action.action,
-						 e.event.action.response.service) < 0) {
-					response = NULL;
-					tmp = NULL;
-				} else {
-					response = tmp;
-					tmp = NULL;
-					list_for_each_entry(n, &e.event.action.response.nodes, head, upnp_event_action_node_t) {
-						if (asprintf(&tmp,
-								"%s<%s>%s</%s>\n",
-								response,
-								n->variable,
-								n->value,
-								n->variable) < 0) {
-							free(response);
-							response = NULL;
-							tmp = NULL;
-							break;
-						} else {
-							free(response);
-							response = tmp;
-							tmp = NULL;
-						}
-					}
-					if (response != NULL) {
-						if (asprintf(&tmp,
-								"%s</u:%sResponse>",
-								response,
-								e.event.action.action) < 0) {
-							free(response);
-							response = NULL;
-							tmp = NULL;
-						} else {
-							free(response);
-							response = tmp;
-							tmp = NULL;
-						}
-					}
-				}
-				if (response != NULL) {
-					if (asprintf(&action->response,
-							envelope,
-							response) < 0) {
-						action->response = NULL;
-					}
-					free(response);
-					response = NULL;
-				}
-			} else {
-				int i;
-				response = NULL;
-				for (i = 0; upnp_errors[i].str != NULL; i++) {
-					error = &upnp_errors[i];
-					if (error->error == e.event.action.errcode) {
-						if (asprintf(&action->response, fault, error->code, error->str) < 0) {
-							action->response = NULL;
-						}
-						break;
-					}
+	s = (upnp_service_t *) upnpd_strmap_find(upnp->type.device.controls, action->path);
+	if (s == NULL) {
+		upnpd_thread_mutex_unlock(upnp->mutex);
+		return -1;
+	}
+	memset(&e, 0, sizeof(upnp_event_t));
+	e.type = UPNP_EVENT_TYPE_ACTION;
+	e.event.action.action = action->action;
+	e.event.action.request = action->request;
+	e.event.action.serviceid = s->serviceid;
+	e.event.action.udn = s->udn;
+	list_init(&e.event.action.response.nodes);
+	upnpd_thread_mutex_unlock(upnp->mutex);
+	if (upnp->type.device.callback != NULL) {
+		upnp->type.device.callback(upnp->type.device.cookie, &e);
+	}
+	action->valid = (e.event.action.errcode != UPNP_ERROR_INVALID_ACTION) ? 1 : 0;
+	if (e.event.action.errcode == 0) {
+		action->response = upnp_action_response(&e.event.action);
+	} else {
+		int i;
+		for (i = 0; upnp_errors[i].str != NULL; i++) {
+			error = &upnp_errors[i];
+			if (error->error == e.event.action.errcode) {
+				if (asprintf(&action->response, fault, error->code, error->str) < 0) {
+					action->response = NULL;
 				}
+				break;
 			}
-			e.event.action.request = NULL;
-			free(e.event.action.response.service);
-			list_for_each_entry_safe(n, n_, &e.event.action.response.nodes, head, upnp_event_action_node_t ) {
-				list_del(&n->head);
-				free(n->variable);
-				free(n->value);
-				free(n);
-			}
-			free(response);
-			upnpd_thread_mutex_lock(upnp->mutex);
-			ret = 0;
-			goto out;
 		}
 	}
-out:	upnpd_thread_mutex_unlock(upnp->mutex);
-	return ret;
+	e.event.action.request = NULL;
+	free(e.event.action.response.service);
+	list_for_each_entry_safe(n, n_, &e.event.action.response.nodes, head, upnp_event_action_node_t ) {
+		list_del(&n->head);
+		free(n->variable);
+		free(n->value);
+		free(n);
+	}
+	return 0;
 }
 
 static int gena_callback_event (void *cookie, gena_event_t *event)
@@ -793,6 +1325,8 @@ static int gena_callback_event (void *cookie, gena_event_t *event)
 			return gena_callback_event_subscribe_drop(upnp, &event->event.unsubscribe);
 		case GENA_EVENT_TYPE_ACTION:
 			return gena_callback_event_action(upnp, &event->event.action);
+		case GENA_EVENT_TYPE_ACTION_REQUEST:
+			return gena_callback_event_action_request(upnp, &event->event.action);
 		default:
 			break;
 	}
@@ -948,8 +1482,40 @@ static int upnp_parser_callback (void *context, const char *path, const char *na
 	return 0;
 }
 
+/* called with upnp->mutex held once all services are registered, on
+ * duplicate urls the service met first in the list wins, as it did with
+ * the list walks */
+static int upnp_device_routes (upnp_device_t *device)
+{
+	unsigned int n;
+	upnp_service_t *s;
+	n = 0;
+	list_for_each_entry(s, &device->services, head, upnp_service_t) {
+		n++;
+	}
+	device->controls = upnpd_strmap_init(n);
+	device->events = upnpd_strmap_init(n);
+	if (device->controls == NULL || device->events == NULL) {
+		upnpd_strmap_uninit(device->controls);
+		upnpd_strmap_uninit(device->events);
+		device->controls = NULL;
+		device->events = NULL;
+		return -1;
+	}
+	list_for_each_entry(s, &device->services, head, upnp_service_t) {
+		if (upnpd_strmap_add(device->controls, s->controlurl, s) != 0) {
+			debugf(_DBG, "duplicate control url '%s'", s->controlurl);
+		}
+		if (upnpd_strmap_add(device->events, s->eventurl, s) != 0) {
+			debugf(_DBG, "duplicate event url '%s'", s->eventurl);
+		}
+	}
+	return 0;
+}
+
 int upnpd_upnp_register_device (upnp_t *upnp, const char *description, int (*callback) (void *cookie, upnp_event_t *), void *cookie)
 {
+	int ret;
 	char *deviceusn;
 	upnp_service_t *service;
 
@@ -961,6 +1527,7 @@ int upnpd_upnp_register_device (upnp_t *upnp, const char *description, int (*cal
 	upnp->type.type = UPNP_TYPE_DEVICE;
 	list_init(&upnp->type.device.services);
 	upnp->type.device.description = strdup(description);
+	upnp->timestamp = upnpd_time_gettimeofday() / 1000;
 	upnp->type.device.callback = callback;
 	upnp->type.device.cookie = cookie;
 	if (upnp->type.device.description == NULL) {
@@ -1024,6 +1591,7 @@ int upnpd_upnp_register_device (upnp_t *upnp, const char *description, int (*cal
 						memset(service, 0, sizeof(upnp_service_t));
 						list_init(&service->head);
 						list_init(&service->subscribers);
+						list_init(&service->variables);
 						service->udn = strdup(data.devices[d].UDN);
 						if (service->udn == NULL) {
 							free(service);
@@ -1044,6 +1612,10 @@ int upnpd_upnp_register_device (upnp_t *upnp, const char *description, int (*cal
 		}
 	}
 
+	ret = upnp_device_routes(&upnp->type.device);
+	if (ret != 0) {
+		debugf(_DBG, "upnp_device_routes() failed");
+	}
 	upnpd_thread_mutex_unlock(upnp->mutex);
 	for (d = 0; d < data.ndevices; d++) {
 		for (s = 0; s < data.devices[d].nservices; s++) {
@@ -1060,7 +1632,7 @@ int upnpd_upnp_register_device (upnp_t *upnp, const char *description, int (*cal
 	}
 	free(data.devices);
 	free(data.URLBase);
-	return 0;
+	return ret;
 }
 
 char * upnpd_upnp_getaddress (upnp_t *upnp)
@@ -1073,7 +1645,12 @@ unsigned short upnpd_upnp_getport (upnp_t *upnp)
 	return upnp->port;
 }
 
-upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned short port, gena_callback_vfs_t *vfscallbacks, void *vfscookie)
+char * upnpd_upnp_stats (upnp_t *upnp)
+{
+	return upnpd_upnp_gena_stats(upnp->gena);
+}
+
+upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned short port, gena_callback_vfs_t *vfscallbacks, void *vfscookie, gena_config_t *genaconfig)
 {
 	upnp_t *upnp;
 	debugf(_DBG, "setting seed");
@@ -1095,6 +1672,7 @@ upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned sho
 		return NULL;
 	}
 	upnp->port = port;
+	upnp_subscriptions_init(&upnp->subscriptions);
 
 	upnp->gena_callbacks.vfs.info = gena_callback_info;
 	upnp->gena_callbacks.vfs.open = gena_callback_open;
@@ -1102,6 +1680,7 @@ upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned sho
 	upnp->gena_callbacks.vfs.write = gena_callback_write;
 	upnp->gena_callbacks.vfs.seek = gena_callback_seek;
 	upnp->gena_callbacks.vfs.close = gena_callback_close;
+	upnp->gena_callbacks.vfs.fd = gena_callback_fd;
 	upnp->gena_callbacks.vfs.cookie = upnp;
 
 	upnp->gena_callbacks.gena.event = gena_callback_event;
@@ -1112,7 +1691,7 @@ upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned sho
 		upnp->vfscallbacks->cookie = vfscookie;
 	}
 
-	upnp->gena = upnpd_upnp_gena_init(upnp->host, upnp->port, &upnp->gena_callbacks);
+	upnp->gena = upnpd_upnp_gena_init(upnp->host, upnp->port, &upnp->gena_callbacks, genaconfig);
 	if (upnp->gena == NULL) {
 		free(upnp->host);
 		free(upnp->mask);
@@ -1132,6 +1711,17 @@ upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned sho
 		return NULL;
 	}
 
+	if (upnp_notifier_init(upnp) != 0) {
+		upnp_notifier_uninit(upnp);
+		upnpd_upnp_ssdp_uninit(upnp->ssdp);
+		upnpd_upnp_gena_uninit(upnp->gena);
+		free(upnp->host);
+		free(upnp->mask);
+		upnpd_thread_mutex_destroy(upnp->mutex);
+		free(upnp);
+		return NULL;
+	}
+
 	return upnp;
 }
 
@@ -1141,9 +1731,13 @@ int upnpd_upnp_uninit (upnp_t *upnp)
 	upnp_service_t *sn;
 	upnp_subscribe_t *c;
 	upnp_subscribe_t *cn;
+	upnp_variable_t *v;
+	upnp_variable_t *vn;
 	if (upnp == NULL) {
 		return 0;
 	}
+	debugf(_DBG, "stopping notifier threads");
+	upnp_notifier_uninit(upnp);
 	debugf(_DBG, "calling ssdp_uninit");
 	upnpd_upnp_ssdp_uninit(upnp->ssdp);
 	debugf(_DBG, "calling gena_uninit");
@@ -1153,10 +1747,11 @@ int upnpd_upnp_uninit (upnp_t *upnp)
 		list_for_each_entry_safe(s, sn, &upnp->type.device.services, head, upnp_service_t) {
 			list_for_each_entry_safe(c, cn, &s->subscribers, head, upnp_subscribe_t) {
 				list_del(&c->head);
-				free(c->url.host);
-				free(c->url.url);
-				free(c->url.path);
-				free(c);
+				upnp_subscribe_free(c);
+			}
+			list_for_each_entry_safe(v, vn, &s->variables, head, upnp_variable_t) {
+				list_del(&v->head);
+				upnp_variable_free(v);
 			}
 			list_del(&s->head);
 			free(s->udn);
@@ -1165,6 +1760,8 @@ int upnpd_upnp_uninit (upnp_t *upnp)
 			free(s->serviceid);
 			free(s);
 		}
+		upnpd_strmap_uninit(upnp->type.device.controls);
+		upnpd_strmap_uninit(upnp->type.device.events);
 		free(upnp->type.device.description);
 		free(upnp->type.device.location);
 	}
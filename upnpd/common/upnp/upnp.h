@@ -32,8 +32,9 @@
 
 typedef struct upnp_s upnp_t;
 
+/* 0 is success */
 typedef enum {
-	UPNP_ERROR_INVALID_ACTION,
+	UPNP_ERROR_INVALID_ACTION = 1,
 	UPNP_ERROR_INVALIG_ARGS,
 	UPNP_ERROR_INVALID_VAR,
 	UPNP_ERROR_ACTION_FAILED,
@@ -128,9 +129,13 @@ int upnpd_upnp_advertise (upnp_t *upnp);
 int upnpd_upnp_register_device (upnp_t *upnp, const char *description, int (*callback) (void *cookie, upnp_event_t *), void *cookie);
 char * upnpd_upnp_getaddress (upnp_t *upnp);
 unsigned short upnpd_upnp_getport (upnp_t *upnp);
-upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned short port, gena_callback_vfs_t *vfscallbacks, void *vfscookie);
+char * upnpd_upnp_stats (upnp_t *upnp);
+upnp_t * upnpd_upnp_init (const char *host, const char *mask, const unsigned short port, gena_callback_vfs_t *vfscallbacks, void *vfscookie, gena_config_t *genaconfig);
 int upnpd_upnp_uninit (upnp_t *upnp);
 int upnpd_upnp_accept_subscription (upnp_t *upnp, const char *udn, const char *serviceid, const char **variable_names, const char **variable_values, const unsigned int variables_count, const char *sid);
+/* changes of a service are coalesced into one propertyset, a variable is evented at most once
+ * per maxrate miliseconds, and numeric ones only after moving by mindelta */
+int upnpd_upnp_event_variable (upnp_t *upnp, const char *udn, const char *serviceid, const char *name, const char *value, unsigned int maxrate, unsigned int mindelta);
 int upnpd_upnp_addtoactionresponse (upnp_event_action_t *response, const char *service, const char *variable, const char *value);
 
 #endif /* UPNP_H_ */